@@ -0,0 +1,71 @@
+; s[0:3] = texture descriptor
+; s4     = src x offset of a quarter dst pixel in x
+; s5     = src y offset of a quarter dst pixel in x
+; s6     = src x offset of a quarter dst pixel in y
+; s7     = src y offset of a quarter dst pixel in y
+; s8     = M# Memory descriptor (implicit, after USER_SGPR)
+;
+; Average a 4x4 grid of bilinear samples spread over the area of the
+; dst pixel in the src, which filters downscales of up to 8:1.
+box:
+	; setup memory descriptor (M#) register (required for interpolation)
+	s_mov_b32 m0, s8
+
+	; switch to whole quad mode
+	s_mov_b32 s8, exec_lo
+	s_wqm_b32 exec_lo, exec_lo
+
+	; interpolate texture coordinates
+	v_interp_p1_f32_e32 v2, v0, attr0.x
+	v_interp_p1_f32_e32 v3, v0, attr0.y
+	v_interp_p2_f32_e32 v2, v1, attr0.x
+	v_interp_p2_f32_e32 v3, v1, attr0.y
+
+	; switch back to exact mode
+	s_mov_b32 exec_lo, s8
+
+	; compute bilinear sampler descriptor in s[8:11]
+	s_mov_b32 s8, 0x8036 ; clamp x = ClampBorder, clamp y = ClampBorder, force unnormalized
+	s_mov_b32 s9, 0
+	s_mov_b32 s10, 0x24500000 ; mip filter = point, aniso override, xy filter = bilinear
+	s_mov_b32 s11, 0
+
+	; move to the first sample, 1.5 steps back in x and y
+	v_mov_b32 v4, s4
+	v_add_f32 v4, s6, v4
+	v_fmac_f32 v2, -1.5, v4
+	v_mov_b32 v4, s5
+	v_add_f32 v4, s7, v4
+	v_fmac_f32 v3, -1.5, v4
+
+	v_mov_b32 v8, 0
+	v_mov_b32 v9, 0
+	v_mov_b32 v10, 0
+	v_mov_b32 v11, 0
+	.rept 4
+	v_mov_b32 v4, v2
+	v_mov_b32 v5, v3
+	.rept 4
+	image_sample_lz v[12:15], v[4:5], s[0:7], s[8:11] dmask:0xf dim:SQ_RSRC_IMG_2D r128
+	s_waitcnt vmcnt(0)
+	v_add_f32 v8, v8, v12
+	v_add_f32 v9, v9, v13
+	v_add_f32 v10, v10, v14
+	v_add_f32 v11, v11, v15
+	v_add_f32 v4, s6, v4
+	v_add_f32 v5, s7, v5
+	.endr
+	v_add_f32 v2, s4, v2
+	v_add_f32 v3, s5, v3
+	.endr
+
+	; export the average color
+	v_mul_f32 v8, 0x3d800000, v8 ; 1/16
+	v_mul_f32 v9, 0x3d800000, v9
+	v_mul_f32 v10, 0x3d800000, v10
+	v_mul_f32 v11, 0x3d800000, v11
+	v_cvt_pkrtz_f16_f32_e32 v0, v8, v9
+	v_cvt_pkrtz_f16_f32_e32 v1, v10, v11
+	exp mrt0 v0, off, v1, off done compr vm
+
+	s_endpgm
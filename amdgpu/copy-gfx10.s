@@ -1,11 +1,12 @@
 ; s[0:3] = texture descriptor
-; s4     = M# Memory descriptor (implicit, after USER_SGPR)
+; s4     = sampler filter bits (SQ_IMG_SAMP_WORD2)
+; s5     = M# Memory descriptor (implicit, after USER_SGPR)
 copy:
 	; setup memory descriptor (M#) register (required for interpolation)
-	s_mov_b32 m0, s4
+	s_mov_b32 m0, s5
 
 	; switch to whole quad mode
-	s_mov_b32 s4, exec_lo
+	s_mov_b32 s5, exec_lo
 	s_wqm_b32 exec_lo, exec_lo
 
 	; interpolate texture coordinates
@@ -15,12 +16,12 @@ copy:
 	v_interp_p2_f32_e32 v3, v1, attr0.y
 
 	; switch back to exact mode
-	s_mov_b32 exec_lo, s4
+	s_mov_b32 exec_lo, s5
 
-	; compute sampler descriptor in s[0:3]
+	; compute sampler descriptor in s[4:7]
+	s_or_b32 s6, s4, 0x24000000 ; mip filter = point, aniso override
 	s_mov_b32 s4, 0x8036 ; clamp x = ClampBorder, clamp y = ClampBorder, force unnormalized
 	s_mov_b32 s5, 0
-	s_brev_b32 s6, 36
 	s_mov_b32 s7, 0
 
 	; sample image
@@ -0,0 +1,35 @@
+; s[0:3] = dst image descriptor with a UINT format of the pixel size
+; s[4:7] = src image descriptor with the same format
+; s[8:9] = top left of the rectangle in dst
+; s[10:11] = bottom right of the rectangle in dst
+; s[12:13] = offset from dst to src coordinates
+; s14    = workgroup id x
+; s15    = workgroup id y
+; v0     = thread id x in the 8x8 workgroup
+; v1     = thread id y in the 8x8 workgroup
+copycs:
+	; compute dst coordinates
+	s_lshl_b32 s14, s14, 3
+	s_lshl_b32 s15, s15, 3
+	s_add_u32 s14, s14, s8
+	s_add_u32 s15, s15, s9
+	v_add_nc_u32_e32 v0, s14, v0
+	v_add_nc_u32_e32 v1, s15, v1
+
+	; skip pixels past the bottom right
+	v_cmp_gt_i32_e32 vcc_lo, s10, v0
+	v_cmp_gt_i32_e64 s16, s11, v1
+	s_and_b32 vcc_lo, vcc_lo, s16
+	s_and_b32 exec_lo, exec_lo, vcc_lo
+
+	; compute src coordinates
+	v_add_nc_u32_e32 v2, s12, v0
+	v_add_nc_u32_e32 v3, s13, v1
+
+	; copy pixel, of up to two dwords
+	; pass s[4:11] and s[0:7], as with image_sample in copy
+	image_load v[4:5], v[2:3], s[4:11] dmask:0x3 dim:SQ_RSRC_IMG_2D unorm r128
+	s_waitcnt vmcnt(0)
+	image_store v[4:5], v[0:1], s[0:7] dmask:0x3 dim:SQ_RSRC_IMG_2D unorm r128
+
+	s_endpgm
@@ -0,0 +1,29 @@
+; s[0:3] = dst image descriptor with a UINT format of the pixel size
+; s4     = packed pixel
+; s[5:6] = top left of the rectangle
+; s[7:8] = bottom right of the rectangle
+; s9     = workgroup id x
+; s10    = workgroup id y
+; v0     = thread id x in the 8x8 workgroup
+; v1     = thread id y in the 8x8 workgroup
+fillcs:
+	; compute dst coordinates
+	s_lshl_b32 s9, s9, 3
+	s_lshl_b32 s10, s10, 3
+	s_add_u32 s9, s9, s5
+	s_add_u32 s10, s10, s6
+	v_add_nc_u32_e32 v0, s9, v0
+	v_add_nc_u32_e32 v1, s10, v1
+
+	; skip pixels past the bottom right
+	v_cmp_gt_i32_e32 vcc_lo, s7, v0
+	v_cmp_gt_i32_e64 s11, s8, v1
+	s_and_b32 vcc_lo, vcc_lo, s11
+	s_and_b32 exec_lo, exec_lo, vcc_lo
+
+	; store pixel
+	; pass s[0:7], as with image_sample in copy
+	v_mov_b32_e32 v2, s4
+	image_store v2, v[0:1], s[0:7] dmask:0x1 dim:SQ_RSRC_IMG_2D unorm r128
+
+	s_endpgm
@@ -11,11 +11,15 @@ Double check BO alignment and flags
 #include <assert.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 
 #include <fcntl.h>
+#include <sys/ioctl.h>
 #include <unistd.h>
+#include <linux/sync_file.h>
 
 #include <pixman.h>
 #include <amdgpu.h>
@@ -32,6 +36,7 @@ struct bo {
 	amdgpu_va_handle va;
 	size_t size;
 	uint64_t addr;
+	uint32_t kms;
 };
 
 struct shader_info {
@@ -44,21 +49,163 @@ struct shader {
 	const struct shader_info *info;
 };
 
-struct cmdbuf {
+/*
+Command streams and vertices are recorded into chunks of GTT memory.
+Command stream chunks end with an INDIRECT_BUFFER packet that chains to
+the next. Chunks are returned to a pool when they are submitted, and
+reused once that submission completes.
+*/
+struct chunk {
+	struct bo bo;
+	uint32_t *buf;
+	unsigned cap;
+	/* fence sequence number of the last submission that used the chunk */
+	uint64_t seq;
+};
+
+/* chunks not being recorded into, in submission order */
+struct pool {
+	struct chunk **chunk;
+	size_t len, cap;
+	/* flags for amdgpu_va_range_alloc */
+	uint32_t vaflags;
+	/* ring of the submissions, and its last sequence number known to have signalled */
+	uint32_t ip;
+	uint64_t done;
+	/* last submission to the ring */
+	uint64_t seq;
+};
+
+/*
+Small images are suballocated from slabs, BOs divided into 64 slots of
+SLAB_MIN << i bytes for the slabs in list i of the context.
+*/
+#define SLAB_MIN 0x1000
+#define SLAB_SIZES 4
+
+struct slab {
+	struct bo bo;
+	/* a bit for each free slot */
+	uint64_t free;
+	/* the last batch whose BO list has the slab */
+	uint64_t batch;
+	struct slab *next;
+};
+
+/*
+Memory and imported syncobj of a destroyed image, and the last
+submission to each ring when it was destroyed.
+*/
+struct garbage {
 	struct bo bo;
+	struct slab *slab;
+	uint32_t syncobj;
+	uint64_t seq[3];
+};
+
+enum {
+	REG_CONTEXT,
+	REG_SH,
+	REG_UCONFIG,
+};
+
+/*
+Register values set so far in a command stream, so that writes which
+don't change them can be skipped. Only the first 1024 registers of each
+space are tracked, which covers every register we set.
+*/
+struct shadow {
+	uint32_t val[3][0x400];
+	uint32_t known[3][0x400 / 32];
+};
+
+struct cmdbuf {
+	/* current chunk */
 	uint32_t *buf;
 	unsigned len, cap;
+	struct shadow *shadow;
+	/*
+	Header of the last SET_*_REG packet, where it ends, and the
+	register after its last one, so that it can be extended.
+	*/
+	uint32_t *pkt, *pkt_end;
+	unsigned pkt_op, pkt_next;
+	/* pool that new chunks come from */
+	struct pool *pool;
+	/* chunks recorded into since the last submission, the last being current */
+	struct chunk **chunk;
+	size_t chunk_len, chunk_cap;
+	/* length of the first chunk, and size field of the last chain packet */
+	unsigned first_len;
+	uint32_t *chain;
+	/* length of the stream so far, and that of the last submission */
+	unsigned total, hint;
 };
 
+/*
+Vertex buffers start with a buffer descriptor for the vertex shader,
+followed by the vertices. pos is the first vertex not yet drawn.
+*/
 struct vertbuf {
-	struct bo bo;
+	/* current buffer */
 	uint32_t *buf;
 	unsigned len, cap, pos;
+	/* buffers filled since the last submission, the last being current */
+	struct chunk **chunk;
+	size_t chunk_len, chunk_cap;
 };
 
 struct draw {
 	struct cmdbuf cmd;
+	struct shadow shadow;
 	struct vertbuf vert;
+	/* recording a stream, or finished and waiting for flush to submit it */
+	int recording, pending;
+	/* fence of the last submission */
+	struct amdgpu_cs_fence fence;
+	/* syncobjs imported with blt_image_import_fence */
+	struct drm_amdgpu_cs_chunk_sem *wait;
+	size_t wait_len, wait_cap;
+};
+
+enum {
+	QUEUE_SDMA,
+	QUEUE_COMPUTE,
+};
+
+/*
+Commands for the SDMA engine or the compute ring, which run alongside
+the graphics ring. They are submitted in one IB by flush, or earlier if
+the SDMA IB is full, or graphics rendering or the other queue depends
+on them.
+*/
+struct queue {
+	/*
+	For SDMA, the chunk of commands, then the staging buffers they copy
+	from. That IB isn't chained, so it is submitted when the chunk is
+	full. Compute commands are chained like graphics streams.
+	*/
+	struct cmdbuf cmd;
+	/* registers set by the compute commands */
+	struct shadow shadow;
+	/* images used by the commands, and fences imported into them */
+	struct drm_amdgpu_bo_list_entry *list;
+	size_t list_len, list_cap;
+	struct drm_amdgpu_cs_chunk_sem *wait;
+	size_t wait_len, wait_cap;
+	struct pool pool;
+	/* signalled by the last submission */
+	uint32_t syncobj;
+	uint64_t submits;
+	/* the graphics ring has submitted since the last submission */
+	int wait_gfx;
+	/*
+	Submission of the other queue that the commands depend on, and the
+	last one that submissions waited for.
+	*/
+	uint64_t needed, waited;
+	/* incremented by each barrier between dispatches, and by each submission */
+	uint64_t barriers;
 };
 
 struct context {
@@ -72,25 +219,152 @@ struct context {
 		enum chip_class class;
 	} chip;
 	struct {
-		struct bo vert, fill, copy;
+		struct bo vert, fill, copy, box, fillcs, copycs;
 	} shader;
-	
-	struct cmdbuf init;
+	/* graphics state set up by every submission, and the registers it sets */
+	struct chunk *init;
+	unsigned init_len;
+	struct shadow init_shadow;
+	struct pool cmd_pool, vert_pool;
+	/* destinations that finished recording, submitted together by flush */
+	struct draw **pending;
+	size_t pending_len, pending_cap;
+	/*
+	BO list of the next submission: the first list_base entries are the
+	context's own BOs, then the images used by the pending destinations.
+	*/
+	struct drm_amdgpu_bo_list_entry *list;
+	size_t list_len, list_cap, list_base;
+	/* incremented by each submission */
+	uint64_t batch;
+	/*
+	Incremented by each flush of CB writes with invalidation of the
+	texture caches, and by each wait for pixel shaders. Submissions
+	do both, since the kernel flushes caches around each one.
+	*/
+	uint64_t flushes, waits;
+	struct queue queue[2];
+	/* signalled by the last graphics submission */
+	uint32_t syncobj;
+	/*
+	Submission of each queue that the pending destinations depend on,
+	and the last one that graphics submissions waited for.
+	*/
+	uint64_t queue_needed[2], queue_waited[2];
+	/* print submitted command streams, if BLT_DUMP_IB is set */
+	int dump;
+	/* slabs of each slot size */
+	struct slab *slab[SLAB_SIZES];
+	/* freed by new_image once the submissions have completed, oldest first */
+	struct garbage *garbage;
+	size_t garbage_len, garbage_cap;
+};
+
+struct format {
+	uint32_t format;
+	/* bytes per pixel */
+	int size;
+	uint32_t img_format;
+	/* components returned when sampled, and the matching border color swizzle */
+	uint8_t sel[4];
+	uint32_t bc_swizzle;
+	uint32_t cb_format, cb_number_type, cb_swap;
 };
 
 struct image {
 	struct blt_image base;
+	const struct format *fmt;
+	/* for images in a slab, the slot, which shares the BO of the slab */
 	struct bo bo;
+	struct slab *slab;
 	uint32_t stride;
 	struct draw *draw;
 	uint32_t desc[4];
+	/* the same with unsigned integers of the pixel size and no swizzle, for compute kernels */
+	uint32_t raw[4];
 	int swizzle;
+	uint32_t syncobj;
+	int wait_pending;
+	/* the last batch whose BO list has the image */
+	uint64_t batch;
+	/* values of flushes when last rendered to and waits when last sampled */
+	uint64_t written, read;
+	/* the last batches that rendered to and sampled the image */
+	uint64_t drawn, sampled;
+	/* submission of each queue that last used the image, and the queue that used it last */
+	uint64_t queue[2];
+	int last;
+	/* value of barriers of the compute queue when a dispatch last used the image */
+	uint64_t dispatched;
+	/*
+	DCC metadata after the pixels, if the image can be fast cleared,
+	and whether a fast clear has compressed it since it was last
+	decompressed, which waits until something other than CB reads
+	the pixels.
+	*/
+	uint64_t dcc_offset, dcc_size;
+	int dcc;
+};
+
+static int submit_pending(struct context *);
+static int submit_queue(struct context *, int);
+static int image_write(struct blt_context *, struct blt_image *, const struct blt_rect *, const void *, size_t);
+static int flush(struct blt_context *);
+static int setup(struct blt_context *, int, struct blt_image *, struct blt_image *, struct blt_image *);
+static int end(struct context *);
+static int resolve_dcc(struct context *, struct image *);
+static uint32_t cb_info(struct image *);
+static uint32_t cb_attrib3(struct image *);
+static void release_memory(struct context *, struct bo *, struct slab *);
+static int signalled(struct context *, struct pool *, uint64_t, uint64_t);
+
+/*
+Channel order and alpha-only or alpha-less formats are handled with the
+texture descriptor swizzle and the color buffer component swap, so the
+same shaders work for every combination of formats.
+*/
+static const struct format formats[] = {
+	{
+		BLT_FMT('X', 'R', '2', '4'), 4, V_00A004_IMG_FORMAT_8_8_8_8_UNORM,
+		{V_008F0C_SQ_SEL_Z, V_008F0C_SQ_SEL_Y, V_008F0C_SQ_SEL_X, V_008F0C_SQ_SEL_1}, V_00A00C_BC_SWIZZLE_ZYXW,
+		V_028C70_COLOR_8_8_8_8, V_028C70_NUMBER_UNORM, V_028C70_SWAP_ALT,
+	},
+	{
+		BLT_FMT('A', 'R', '2', '4'), 4, V_00A004_IMG_FORMAT_8_8_8_8_UNORM,
+		{V_008F0C_SQ_SEL_Z, V_008F0C_SQ_SEL_Y, V_008F0C_SQ_SEL_X, V_008F0C_SQ_SEL_W}, V_00A00C_BC_SWIZZLE_ZYXW,
+		V_028C70_COLOR_8_8_8_8, V_028C70_NUMBER_UNORM, V_028C70_SWAP_ALT,
+	},
+	{
+		BLT_FMT('R', 'G', '1', '6'), 2, V_00A004_IMG_FORMAT_5_6_5_UNORM,
+		{V_008F0C_SQ_SEL_Z, V_008F0C_SQ_SEL_Y, V_008F0C_SQ_SEL_X, V_008F0C_SQ_SEL_1}, V_00A00C_BC_SWIZZLE_ZYXW,
+		V_028C70_COLOR_5_6_5, V_028C70_NUMBER_UNORM, V_028C70_SWAP_STD_REV,
+	},
+	{
+		BLT_FMT('A', '8', ' ', ' '), 1, V_00A004_IMG_FORMAT_8_UNORM,
+		{V_008F0C_SQ_SEL_0, V_008F0C_SQ_SEL_0, V_008F0C_SQ_SEL_0, V_008F0C_SQ_SEL_X}, V_00A00C_BC_SWIZZLE_WXYZ,
+		V_028C70_COLOR_8, V_028C70_NUMBER_UNORM, V_028C70_SWAP_ALT_REV,
+	},
+	{
+		BLT_FMT('X', 'R', '3', '0'), 4, V_00A004_IMG_FORMAT_2_10_10_10_UNORM,
+		{V_008F0C_SQ_SEL_Z, V_008F0C_SQ_SEL_Y, V_008F0C_SQ_SEL_X, V_008F0C_SQ_SEL_1}, V_00A00C_BC_SWIZZLE_ZYXW,
+		V_028C70_COLOR_2_10_10_10, V_028C70_NUMBER_UNORM, V_028C70_SWAP_ALT,
+	},
+	{
+		BLT_FMT('A', 'R', '3', '0'), 4, V_00A004_IMG_FORMAT_2_10_10_10_UNORM,
+		{V_008F0C_SQ_SEL_Z, V_008F0C_SQ_SEL_Y, V_008F0C_SQ_SEL_X, V_008F0C_SQ_SEL_W}, V_00A00C_BC_SWIZZLE_ZYXW,
+		V_028C70_COLOR_2_10_10_10, V_028C70_NUMBER_UNORM, V_028C70_SWAP_ALT,
+	},
+	{
+		BLT_FMT('A', 'B', '4', 'H'), 8, V_00A004_IMG_FORMAT_16_16_16_16_FLOAT,
+		{V_008F0C_SQ_SEL_X, V_008F0C_SQ_SEL_Y, V_008F0C_SQ_SEL_Z, V_008F0C_SQ_SEL_W}, V_00A00C_BC_SWIZZLE_XYZW,
+		V_028C70_COLOR_16_16_16_16, V_028C70_NUMBER_FLOAT, V_028C70_SWAP_STD,
+	},
 };
 
 static const struct shader_info vert_info = {
 	.rsrc1 = S_00B128_VGPRS(1) | S_00B028_SGPRS(0),
-	/* s2 = buffer descriptor, s3 = vertex offset, s4 = dst_x, s5 = dst_y, s6 = src_x, s7 = src_y */
-	.rsrc2 = S_00B12C_USER_SGPR(8),
+	/* s2 = buffer descriptor, s3 = vertex offset, s4 = dst_x, s5 = dst_y, s6 = src_x, s7 = src_y, s[8:11] = transform */
+	.rsrc2 = S_00B12C_USER_SGPR(12),
 };
 
 static const uint32_t vert_code[] = {
@@ -111,8 +385,8 @@ static const uint32_t fill_code[] = {
 
 static const struct shader_info copy_info = {
 	.rsrc1 = S_00B028_VGPRS(0) | S_00B028_SGPRS(0),
-	/* s2 = texture descriptor */
-	.rsrc2 = S_00B02C_USER_SGPR(4),
+	/* s[0:3] = texture descriptor, s4 = sampler filter */
+	.rsrc2 = S_00B02C_USER_SGPR(5),
 };
 
 static const uint32_t copy_code[] = {
@@ -120,7 +394,52 @@ static const uint32_t copy_code[] = {
 	0xbf9f0000, 0xbf9f0000, 0xbf9f0000, 0xbf9f0000, 0xbf9f0000,
 };
 
+static const struct shader_info box_info = {
+	.rsrc1 = S_00B028_VGPRS(3) | S_00B028_SGPRS(0),
+	/* s[0:3] = texture descriptor, s[4:7] = quarter pixel steps */
+	.rsrc2 = S_00B02C_USER_SGPR(8),
+};
+
+static const uint32_t box_code[] = {
+#include "box-gfx10.inc"
+	0xbf9f0000, 0xbf9f0000, 0xbf9f0000, 0xbf9f0000, 0xbf9f0000,
+};
+
+static const struct shader_info fillcs_info = {
+	.rsrc1 = S_00B848_VGPRS(0) | S_00B848_SGPRS(0),
+	/* s[0:3] = raw image descriptor, s4 = pixel, s[5:8] = rectangle, s9 = workgroup x, s10 = workgroup y */
+	.rsrc2 = S_00B84C_USER_SGPR(9) | S_00B84C_TGID_X_EN(1) | S_00B84C_TGID_Y_EN(1) | S_00B84C_TIDIG_COMP_CNT(1),
+};
+
+static const uint32_t fillcs_code[] = {
+#include "fillcs-gfx10.inc"
+	0xbf9f0000, 0xbf9f0000, 0xbf9f0000, 0xbf9f0000, 0xbf9f0000,
+};
+
+static const struct shader_info copycs_info = {
+	.rsrc1 = S_00B848_VGPRS(0) | S_00B848_SGPRS(0),
+	/* s[0:3] = dst descriptor, s[4:7] = src descriptor, s[8:11] = dst rectangle, s[12:13] = src offset, s14 = workgroup x, s15 = workgroup y */
+	.rsrc2 = S_00B84C_USER_SGPR(14) | S_00B84C_TGID_X_EN(1) | S_00B84C_TGID_Y_EN(1) | S_00B84C_TIDIG_COMP_CNT(1),
+};
+
+static const uint32_t copycs_code[] = {
+#include "copycs-gfx10.inc"
+	0xbf9f0000, 0xbf9f0000, 0xbf9f0000, 0xbf9f0000, 0xbf9f0000,
+};
+
+/* formats of raw image descriptors, by log2 of the pixel size */
+static const uint32_t raw_formats[] = {
+	V_00A004_IMG_FORMAT_8_UINT,
+	V_00A004_IMG_FORMAT_16_UINT,
+	V_00A004_IMG_FORMAT_32_UINT,
+	V_00A004_IMG_FORMAT_32_32_UINT,
+};
+
 #define ALIGN_UP(x, a) (((x) + (a) - 1) & (-(a)))
+/* chunk sizes in dwords */
+#define CHUNK_MIN 0x1000
+#define CHUNK_MAX 0x40000
+#define VERT_SIZE 0x4000
 #define ARG16(a1, a2, a3, a4, a5, a6, a7, a8, a9, a10, a11, a12, a13, a14, a15, a16, ...) a16
 #define NARG(...) ARG16(__VA_ARGS__, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0)
 #define SET_CONTEXT_REG_IDX(r, i, ...) \
@@ -296,34 +615,246 @@ destroy(struct blt_context *ctx_base)
 	free(ctx);
 }
 
+/*
+Destroy img once the rendering submitted so far is done with it. Its
+memory and syncobj go on the garbage list, which new_image frees from
+when the submissions have completed, since their waits may still refer
+to the syncobj.
+*/
 static void
-image_destroy(struct blt_context *ctx, struct blt_image *img)
+image_destroy(struct blt_context *ctx_base, struct blt_image *img_base)
+{
+	struct context *ctx = (void *)ctx_base;
+	struct image *img = (void *)img_base;
+	struct garbage *g;
+	size_t i, cap;
+
+	/* submit the rendering that uses img, so that the last submissions cover it */
+	if (img->batch == ctx->batch || img->queue[QUEUE_SDMA] > ctx->queue[QUEUE_SDMA].submits || img->queue[QUEUE_COMPUTE] > ctx->queue[QUEUE_COMPUTE].submits)
+		flush(ctx_base);
+	if (ctx->base.dst == img_base)
+		ctx->base.dst = NULL;
+	if (ctx->base.src == img_base)
+		ctx->base.src = NULL;
+	if (ctx->garbage_len == ctx->garbage_cap) {
+		cap = ctx->garbage_cap ? ctx->garbage_cap * 2 : 16;
+		g = realloc(ctx->garbage, cap * sizeof(ctx->garbage[0]));
+		if (g) {
+			ctx->garbage = g;
+			ctx->garbage_cap = cap;
+		}
+	}
+	if (ctx->garbage_len < ctx->garbage_cap) {
+		ctx->garbage[ctx->garbage_len++] = (struct garbage){
+			.bo = img->bo,
+			.slab = img->slab,
+			.syncobj = img->syncobj,
+			.seq = {ctx->cmd_pool.seq, ctx->queue[QUEUE_SDMA].pool.seq, ctx->queue[QUEUE_COMPUTE].pool.seq},
+		};
+	} else {
+		/* no room to free it later, so wait */
+		signalled(ctx, &ctx->cmd_pool, ctx->cmd_pool.seq, AMDGPU_TIMEOUT_INFINITE);
+		for (i = 0; i < LEN(ctx->queue); ++i)
+			signalled(ctx, &ctx->queue[i].pool, ctx->queue[i].pool.seq, AMDGPU_TIMEOUT_INFINITE);
+		release_memory(ctx, &img->bo, img->slab);
+		if (img->syncobj)
+			amdgpu_cs_destroy_syncobj(ctx->dev, img->syncobj);
+	}
+	if (img->draw) {
+		free(img->draw->cmd.chunk);
+		free(img->draw->vert.chunk);
+		free(img->draw->wait);
+		free(img->draw);
+	}
+	free(img);
+}
+
+/* number of packers, log2, which gfx10.3 adds to GB_ADDR_CONFIG */
+#ifndef G_0098F8_NUM_PKRS
+#define G_0098F8_NUM_PKRS(x) (((x) >> 8) & 0x7)
+#endif
+
+/*
+The format modifier of images with a swizzle mode. The XOR bits of the
+_X modes are the number of pipes, and on gfx10.3, whose RB+ layout
+also depends on the number of packers, those too.
+*/
+static uint64_t
+modifier(struct context *ctx, int swizzle)
+{
+	uint64_t mod;
+
+	if (swizzle == 0)
+		return DRM_FORMAT_MOD_LINEAR;
+	mod = AMD_FMT_MOD |
+	      AMD_FMT_MOD_SET(TILE, swizzle) |
+	      AMD_FMT_MOD_SET(PIPE_XOR_BITS, G_0098F8_NUM_PIPES(ctx->info.gb_addr_cfg));
+	if (ctx->chip.class >= GFX10_3) {
+		mod |= AMD_FMT_MOD_SET(TILE_VERSION, AMD_FMT_MOD_TILE_VER_GFX10_RBPLUS) |
+		       AMD_FMT_MOD_SET(PACKERS, G_0098F8_NUM_PKRS(ctx->info.gb_addr_cfg));
+	} else {
+		mod |= AMD_FMT_MOD_SET(TILE_VERSION, AMD_FMT_MOD_TILE_VER_GFX10);
+	}
+	return mod;
+}
+
+/*
+Choose the swizzle mode of a DMA-BUF image from the modifiers it may
+use, or return -1 if none are supported.
+*/
+static int
+choose_swizzle(struct context *ctx, size_t mods_len, const uint64_t *mods)
 {
+	/* 64KiB blocks in the mode CB renders fastest to, then the standard one, then linear */
+	static const int swizzle[] = {27, 25, 0};
+	size_t i, j;
+
+	for (i = 0; i < LEN(swizzle); ++i) {
+		for (j = 0; j < mods_len; ++j) {
+			if (mods[j] == modifier(ctx, swizzle[i]))
+				return swizzle[i];
+		}
+	}
+	errno = ENOTSUP;
+	return -1;
 }
 
 static int
 export_dmabuf(struct blt_context *ctx_base, struct blt_image *img_base, struct blt_plane plane[static 4], uint64_t *mod)
 {
+	struct context *ctx = (void *)ctx_base;
 	struct image *img = (void *)img_base;
 	uint32_t u32;
 	int ret;
 
+	/*
+	Importers don't read DCC and may read the pixels whenever the
+	rendering is done, so shared images aren't fast cleared.
+	*/
+	if (resolve_dcc(ctx, img) < 0)
+		return -1;
+	img->dcc_size = 0;
 	ret = amdgpu_bo_export(img->bo.handle, amdgpu_bo_handle_type_dma_buf_fd, &u32);
 	if (ret < 0)
 		return ret;
-	plane[0] = (struct blt_plane){.fd = u32, .stride = img->stride};
+	/* images in a slab are exported as the BO of the slab, at their slot */
+	plane[0] = (struct blt_plane){
+		.fd = u32,
+		.stride = img->stride,
+		.offset = img->slab ? img->bo.addr - img->slab->bo.addr : 0,
+	};
 	plane[1] = (struct blt_plane){.fd = -1};
 	plane[2] = (struct blt_plane){.fd = -1};
 	plane[3] = (struct blt_plane){.fd = -1};
-	/* TODO: amdgpu format modifiers */
-	*mod = DRM_FORMAT_MOD_INVALID;
+	/*
+	DCC isn't used anymore, so it isn't part of the layout. There are
+	no modifiers for 4KiB blocks, so importers of those use the tiling
+	in the BO metadata.
+	*/
+	*mod = img->swizzle == 0 || img->swizzle >= 24 ? modifier(ctx, img->swizzle) : DRM_FORMAT_MOD_INVALID;
 
 	return 1;
 }
 
+static int
+export_fence(struct blt_context *ctx_base, struct blt_image *img_base)
+{
+	struct context *ctx = (void *)ctx_base;
+	struct image *img = (void *)img_base;
+	uint32_t syncobj;
+	int i, fd, ret;
+
+	/* commands for the current destination haven't been submitted yet */
+	if (img_base == ctx->base.dst && img->draw->recording) {
+		errno = EBUSY;
+		return -1;
+	}
+	/* whoever waits for the fence may read the pixels without DCC */
+	if (resolve_dcc(ctx, img) < 0)
+		return -1;
+	if (img->draw && img->draw->pending && submit_pending(ctx) < 0)
+		return -1;
+	/*
+	If SDMA or compute commands used img, the last submission to a ring
+	covers them: the last graphics one if it waited for the queue that
+	used img last, or else the last one of that queue, which waited for
+	graphics submissions and the other queue's commands using img
+	before it.
+	*/
+	if (img->queue[QUEUE_SDMA] > 0 || img->queue[QUEUE_COMPUTE] > 0) {
+		i = img->last;
+		if (img->queue[i] > ctx->queue[i].submits && submit_queue(ctx, i) < 0)
+			return -1;
+		ret = amdgpu_cs_syncobj_export_sync_file(ctx->dev, img->queue[i] > ctx->queue_waited[i] ? ctx->queue[i].syncobj : ctx->syncobj, &fd);
+		if (ret < 0)
+			goto error0;
+		return fd;
+	}
+	if (img->draw && img->draw->fence.fence != 0)
+		ret = amdgpu_cs_fence_to_handle(ctx->dev, &img->draw->fence, AMDGPU_FENCE_TO_HANDLE_GET_SYNCOBJ, &syncobj);
+	else
+		ret = amdgpu_cs_create_syncobj2(ctx->dev, DRM_SYNCOBJ_CREATE_SIGNALED, &syncobj);
+	if (ret < 0)
+		goto error0;
+	ret = amdgpu_cs_syncobj_export_sync_file(ctx->dev, syncobj, &fd);
+	amdgpu_cs_destroy_syncobj(ctx->dev, syncobj);
+	if (ret < 0)
+		goto error0;
+	return fd;
+
+error0:
+	errno = -ret;
+	return -1;
+}
+
+static int
+import_fence(struct blt_context *ctx_base, struct blt_image *img_base, int fd)
+{
+	struct context *ctx = (void *)ctx_base;
+	struct image *img = (void *)img_base;
+	struct sync_merge_data merge = {.name = "blt"};
+	int ret, old;
+
+	if (fd == -1)
+		return 0;
+	if (!img->syncobj) {
+		ret = amdgpu_cs_create_syncobj2(ctx->dev, DRM_SYNCOBJ_CREATE_SIGNALED, &img->syncobj);
+		if (ret < 0)
+			goto error0;
+	}
+	/*
+	Draws that haven't been submitted may already wait on the
+	syncobj, so it gets a fence that signals when both the earlier
+	one and this one have, rather than just this one.
+	*/
+	ret = amdgpu_cs_syncobj_export_sync_file(ctx->dev, img->syncobj, &old);
+	if (ret < 0)
+		goto error0;
+	merge.fd2 = fd;
+	if (ioctl(old, SYNC_IOC_MERGE, &merge) < 0) {
+		close(old);
+		return -1;
+	}
+	close(old);
+	ret = amdgpu_cs_syncobj_import_sync_file(ctx->dev, img->syncobj, merge.fence);
+	close(merge.fence);
+	if (ret < 0)
+		goto error0;
+	close(fd);
+	img->wait_pending = 1;
+	return 0;
+
+error0:
+	errno = -ret;
+	return -1;
+}
+
 static const struct blt_image_impl image_impl = {
 	.destroy = image_destroy,
 	.export_dmabuf = export_dmabuf,
+	.export_fence = export_fence,
+	.import_fence = import_fence,
+	.write = image_write,
 };
 
 /*
@@ -356,8 +887,13 @@ static int bo_alloc(struct context *ctx, struct bo *bo, uint64_t size, unsigned
 	ret = amdgpu_bo_va_op(bo->handle, 0, bo->size, bo->addr, AMDGPU_VM_PAGE_READABLE|AMDGPU_VM_PAGE_WRITEABLE|AMDGPU_VM_PAGE_EXECUTABLE, AMDGPU_VA_OP_MAP);
 	if (ret < 0)
 		goto error2;
+	ret = amdgpu_bo_export(bo->handle, amdgpu_bo_handle_type_kms, &bo->kms);
+	if (ret < 0)
+		goto error3;
 	return 0;
 
+error3:
+	amdgpu_bo_va_op(bo->handle, 0, bo->size, bo->addr, 0, AMDGPU_VA_OP_UNMAP);
 error2:
 	amdgpu_bo_free(bo->handle);
 error1:
@@ -376,288 +912,1944 @@ bo_free(struct bo *bo)
 	return 0;
 }
 
-static struct draw *
-new_draw(struct context *ctx)
+static void
+free_chunk(struct chunk *c)
 {
-	struct draw *drw;
+	amdgpu_bo_cpu_unmap(c->bo.handle);
+	bo_free(&c->bo);
+	free(c);
+}
+
+/*
+Whether submission seq to the ring of pool has completed, waiting up to
+timeout nanoseconds for it.
+*/
+static int
+signalled(struct context *ctx, struct pool *pool, uint64_t seq, uint64_t timeout)
+{
+	struct amdgpu_cs_fence fence = {
+		.context = ctx->cs,
+		.ip_type = pool->ip,
+		.fence = seq,
+	};
+	uint32_t expired;
+
+	if (seq <= pool->done)
+		return 1;
+	if (amdgpu_cs_query_fence_status(&fence, timeout, 0, &expired) < 0 || !expired)
+		return 0;
+	pool->done = seq;
+	return 1;
+}
+
+/*
+Get a chunk of at least size dwords, reusing an idle one from the pool
+if there is one. While the pool is large, idle chunks that are too
+small are freed.
+*/
+static struct chunk *
+get_chunk(struct context *ctx, struct pool *pool, unsigned size)
+{
+	struct chunk *c;
 	void *map;
+	size_t i;
 	int ret;
 
-	drw = malloc(sizeof(*drw));
-	if (!drw)
-		goto error0;
+	for (i = 0; i < pool->len; ++i) {
+		c = pool->chunk[i];
+		/* the rest of the pool was submitted later */
+		if (!signalled(ctx, pool, c->seq, 0))
+			break;
+		if (c->cap >= size || pool->len > 16) {
+			memmove(&pool->chunk[i], &pool->chunk[i + 1], (pool->len - i - 1) * sizeof(pool->chunk[0]));
+			--pool->len;
+			if (c->cap >= size)
+				return c;
+			free_chunk(c);
+			--i;
+		}
+	}
 
-	ret = bo_alloc(ctx, &drw->cmd.bo, 80 * 1024, 0x100, AMDGPU_GEM_DOMAIN_GTT, AMDGPU_GEM_CREATE_CPU_ACCESS_REQUIRED, 0);
-	if (ret < 0)
+	c = malloc(sizeof(*c));
+	if (!c)
+		goto error0;
+	if (bo_alloc(ctx, &c->bo, size * 4, 0x1000, AMDGPU_GEM_DOMAIN_GTT, AMDGPU_GEM_CREATE_CPU_ACCESS_REQUIRED, pool->vaflags) < 0)
 		goto error1;
-	ret = amdgpu_bo_cpu_map(drw->cmd.bo.handle, &map);
-	if (ret < 0)
+	ret = amdgpu_bo_cpu_map(c->bo.handle, &map);
+	if (ret < 0) {
+		errno = -ret;
 		goto error2;
-	drw->cmd.buf = map;
-	drw->cmd.len = 0;
-	drw->cmd.cap = drw->cmd.bo.size / 4;
-
-	ret = bo_alloc(ctx, &drw->vert.bo, 80 * 1024, 0x400, AMDGPU_GEM_DOMAIN_GTT, AMDGPU_GEM_CREATE_CPU_ACCESS_REQUIRED, AMDGPU_VA_RANGE_32_BIT);
-	if (ret < 0)
-		goto error3;
-	ret = amdgpu_bo_cpu_map(drw->vert.bo.handle, &map);
-	if (ret < 0)
-		goto error4;
-	drw->vert.buf = map;
-	drw->vert.len = 0;
-	drw->vert.cap = drw->vert.bo.size / sizeof(drw->vert.buf[0]);
-
-	drw->vert.buf[drw->vert.len++] = drw->vert.bo.addr + 16;
-	drw->vert.buf[drw->vert.len++] =
-		S_008F04_BASE_ADDRESS_HI((drw->vert.bo.addr + 16) >> 32) |
-		S_008F04_STRIDE(8);
-	drw->vert.buf[drw->vert.len++] = drw->vert.bo.size - 16;
-	drw->vert.buf[drw->vert.len++] =
-		S_008F0C_DST_SEL_X(V_008F0C_SQ_SEL_X) |
-		S_008F0C_DST_SEL_Y(V_008F0C_SQ_SEL_Y) |
-		S_008F0C_DST_SEL_Z(V_008F0C_SQ_SEL_Z) |
-		S_008F0C_DST_SEL_W(V_008F0C_SQ_SEL_W) |
-		S_008F0C_FORMAT(V_008F0C_IMG_FORMAT_32_UINT) |
-		S_008F0C_OOB_SELECT(1) |
-		S_008F0C_RESOURCE_LEVEL(1);
-	drw->vert.pos = drw->vert.len;
-
-	return drw;
+	}
+	c->buf = map;
+	c->cap = size;
+	c->seq = 0;
+	return c;
 
-error4:
-	bo_free(&drw->vert.bo);
-error3:
-	amdgpu_bo_cpu_unmap(drw->cmd.bo.handle);
 error2:
-	bo_free(&drw->cmd.bo);
+	bo_free(&c->bo);
 error1:
-	free(drw);
+	free(c);
 error0:
 	return NULL;
 }
 
-static struct blt_image *
-new_image(struct blt_context *ctx_base, int w, int h, uint32_t format, int flags)
+/* make room in pool for len more chunks */
+static int
+grow_pool(struct pool *pool, size_t len)
+{
+	void *p;
+	size_t cap;
+
+	if (pool->len + len <= pool->cap)
+		return 0;
+	cap = pool->len + len;
+	p = realloc(pool->chunk, cap * sizeof(pool->chunk[0]));
+	if (!p)
+		return -1;
+	pool->chunk = p;
+	pool->cap = cap;
+	return 0;
+}
+
+/* return chunks used by the submission seq to pool, which has room for them */
+static void
+put_chunks(struct pool *pool, struct chunk **chunk, size_t len, uint64_t seq)
+{
+	for (; len; --len, ++chunk) {
+		(*chunk)->seq = seq;
+		pool->chunk[pool->len++] = *chunk;
+	}
+}
+
+/* the tiling in the BO metadata of images of the given swizzle mode */
+static uint64_t
+tiling_info(struct context *ctx, int swizzle)
+{
+	if (ctx->chip.class >= GFX9)
+		return AMDGPU_TILING_SET(SWIZZLE_MODE, swizzle);
+	return AMDGPU_TILING_SET(ARRAY_MODE, 4) |
+	       AMDGPU_TILING_SET(PIPE_CONFIG, 5) |
+	       AMDGPU_TILING_SET(TILE_SPLIT, 3) |
+	       AMDGPU_TILING_SET(BANK_WIDTH, 0) |
+	       AMDGPU_TILING_SET(BANK_HEIGHT, 2) |
+	       AMDGPU_TILING_SET(MACRO_TILE_ASPECT, 2) |
+	       AMDGPU_TILING_SET(NUM_BANKS, 3);
+}
+
+/*
+Suballocate a slot of at least size bytes from a slab, making bo the
+slot. Returns the slab, or NULL on failure.
+*/
+static struct slab *
+slab_alloc(struct context *ctx, struct bo *bo, uint64_t size)
+{
+	struct slab *slab;
+	int i, slot;
+
+	for (i = 0; (uint64_t)SLAB_MIN << i < size; ++i)
+		;
+	for (slab = ctx->slab[i]; slab && !slab->free; slab = slab->next)
+		;
+	if (!slab) {
+		slab = malloc(sizeof(*slab));
+		if (!slab)
+			return NULL;
+		if (bo_alloc(ctx, &slab->bo, (uint64_t)SLAB_MIN << i << 6, 0x10000, AMDGPU_GEM_DOMAIN_VRAM, 0, 0) < 0) {
+			free(slab);
+			return NULL;
+		}
+		/* slabs only hold images of 4KiB_S_X blocks, for importers of them */
+		if (amdgpu_bo_set_metadata(slab->bo.handle, &(struct amdgpu_bo_metadata){.tiling_info = tiling_info(ctx, 21)}) < 0) {
+			bo_free(&slab->bo);
+			free(slab);
+			return NULL;
+		}
+		slab->free = ~(uint64_t)0;
+		slab->batch = 0;
+		slab->next = ctx->slab[i];
+		ctx->slab[i] = slab;
+	}
+	for (slot = 0; !(slab->free >> slot & 1); ++slot)
+		;
+	slab->free &= ~((uint64_t)1 << slot);
+	*bo = slab->bo;
+	bo->size = (uint64_t)SLAB_MIN << i;
+	bo->addr += bo->size * slot;
+	return slab;
+}
+
+/*
+Free the memory of an image, or return its slot to the slab. Empty slabs
+are freed, unless they are the only ones of their size.
+*/
+static void
+release_memory(struct context *ctx, struct bo *bo, struct slab *slab)
+{
+	struct slab **p;
+	int i;
+
+	if (!slab) {
+		bo_free(bo);
+		return;
+	}
+	slab->free |= (uint64_t)1 << (bo->addr - slab->bo.addr) / bo->size;
+	if (slab->free != ~(uint64_t)0)
+		return;
+	for (i = 0; (uint64_t)SLAB_MIN << i < bo->size; ++i)
+		;
+	if (ctx->slab[i] == slab && !slab->next)
+		return;
+	for (p = &ctx->slab[i]; *p != slab; p = &(*p)->next)
+		;
+	*p = slab->next;
+	bo_free(&slab->bo);
+	free(slab);
+}
+
+/* free the memory of destroyed images that completed submissions no longer use */
+static void
+collect(struct context *ctx)
+{
+	struct garbage *g;
+	size_t i, n;
+
+	for (n = 0; n < ctx->garbage_len; ++n) {
+		g = &ctx->garbage[n];
+		if (!signalled(ctx, &ctx->cmd_pool, g->seq[0], 0))
+			break;
+		for (i = 0; i < LEN(ctx->queue); ++i) {
+			if (!signalled(ctx, &ctx->queue[i].pool, g->seq[1 + i], 0))
+				break;
+		}
+		if (i < LEN(ctx->queue))
+			break;
+		release_memory(ctx, &g->bo, g->slab);
+		if (g->syncobj)
+			amdgpu_cs_destroy_syncobj(ctx->dev, g->syncobj);
+	}
+	if (n == 0)
+		return;
+	ctx->garbage_len -= n;
+	memmove(ctx->garbage, ctx->garbage + n, ctx->garbage_len * sizeof(ctx->garbage[0]));
+}
+
+static struct draw *
+new_draw(struct context *ctx)
+{
+	struct draw *drw;
+
+	drw = malloc(sizeof(*drw));
+	if (!drw)
+		return NULL;
+	drw->cmd = (struct cmdbuf){.shadow = &drw->shadow, .pool = &ctx->cmd_pool};
+	drw->vert = (struct vertbuf){0};
+	drw->recording = 0;
+	drw->pending = 0;
+	drw->fence = (struct amdgpu_cs_fence){0};
+	drw->wait = NULL;
+	drw->wait_len = 0;
+	drw->wait_cap = 0;
+
+	return drw;
+}
+
+static struct blt_image *
+new_image(struct blt_context *ctx_base, int w, int h, uint32_t format, int flags, size_t mods_len, const uint64_t *mods)
+{
+	struct context *ctx = (void *)ctx_base;
+	struct image *img;
+	size_t size;
+	int ret;
+	struct amdgpu_bo_metadata metadata = {0};
+	const struct format *fmt;
+	int log2_size, swizzle, block;
+	static const uint64_t linear[] = {BLT_MOD_LINEAR};
+
+	collect(ctx);
+	for (fmt = formats; fmt < formats + LEN(formats); ++fmt) {
+		if (fmt->format == format)
+			break;
+	}
+	if (fmt == formats + LEN(formats)) {
+		errno = ENOTSUP;
+		return NULL;
+	}
+	log2_size = ffs(fmt->size) - 1;
+	if (flags & BLT_IMAGE_DMABUF) {
+		if (!mods) {
+			mods = linear;
+			mods_len = LEN(linear);
+		}
+		swizzle = choose_swizzle(ctx, mods_len, mods);
+		if (swizzle < 0)
+			return NULL;
+	} else if (w >= 256 >> log2_size / 2 && h >= 256 >> (log2_size + 1) / 2) {
+		/* 64KiB_R_X, for images of at least one block */
+		swizzle = 27;
+	} else {
+		/* 4KiB_S_X, so that small images aren't padded to 64KiB; gfx10 has no 4KiB_R_X */
+		swizzle = 21;
+	}
+	img = malloc(sizeof(*img));
+	if (!img)
+		return NULL;
+	img->fmt = fmt;
+	img->base = (struct blt_image){
+		.impl = &image_impl,
+		.width = w,
+		.height = h,
+		.format = format,
+	};
+	img->swizzle = swizzle;
+	if (swizzle == 0) {
+		/* rows of linear images are aligned to 256 bytes */
+		block = 0x1000;
+		img->stride = ALIGN_UP(w * fmt->size, 256);
+		size = img->stride * h;
+	} else {
+		/*
+		align to 64KiB blocks, from 256x256 pixels at 1 byte per pixel
+		to 128x64 at 8, or to 4KiB blocks of a quarter of that each way
+		*/
+		block = swizzle >= 24 ? 0x10000 : 0x1000;
+		img->stride = ALIGN_UP(w, (block == 0x10000 ? 256 : 64) >> log2_size / 2) * fmt->size;
+		size = img->stride * ALIGN_UP(h, (block == 0x10000 ? 256 : 64) >> (log2_size + 1) / 2);
+	}
+	/*
+	DCC has a byte for each 256 bytes of pixels. Its pipe-aligned
+	layout is padded to whole metadata blocks, which 64KiB covers, so
+	only images of 64KiB blocks have it.
+	*/
+	img->dcc_offset = 0;
+	img->dcc_size = 0;
+	if (flags & BLT_IMAGE_DST && ctx->chip.class >= GFX10 && fmt->size == 4 && block == 0x10000) {
+		img->dcc_offset = ALIGN_UP(size, 0x10000);
+		img->dcc_size = ALIGN_UP(size / 256, 0x10000);
+		size = img->dcc_offset + img->dcc_size;
+	}
+	/* images that aren't shared and fit in a slot go in a slab */
+	img->slab = NULL;
+	if (!(flags & BLT_IMAGE_DMABUF) && size <= (uint64_t)SLAB_MIN << (SLAB_SIZES - 1)) {
+		img->slab = slab_alloc(ctx, &img->bo, size);
+		if (!img->slab)
+			goto error0;
+	} else {
+		ret = bo_alloc(ctx, &img->bo, size, block, AMDGPU_GEM_DOMAIN_VRAM, 0, 0);
+		if (ret < 0)
+			goto error0;
+	}
+	if (ctx->chip.class >= GFX9) {
+		img->desc[0] = img->bo.addr >> 8; // XXX tile swizzle?
+		img->desc[1] =
+			S_00A004_BASE_ADDRESS_HI(img->bo.addr >> 40) |
+			S_00A004_FORMAT(fmt->img_format) |
+			S_00A004_WIDTH_LO(img->stride / fmt->size - 1);
+		img->desc[2] =
+			S_00A008_WIDTH_HI((img->stride / fmt->size - 1) >> 2) |
+			S_00A008_HEIGHT(img->base.height - 1) |
+			S_00A008_RESOURCE_LEVEL(1);
+		img->desc[3] =
+			S_00A00C_DST_SEL_X(fmt->sel[0]) |
+			S_00A00C_DST_SEL_Y(fmt->sel[1]) |
+			S_00A00C_DST_SEL_Z(fmt->sel[2]) |
+			S_00A00C_DST_SEL_W(fmt->sel[3]) |
+			S_00A00C_BASE_LEVEL(0) |
+			S_00A00C_LAST_LEVEL(0) |
+			S_00A00C_SW_MODE(img->swizzle) |
+			S_00A00C_BC_SWIZZLE(fmt->bc_swizzle) |
+			S_00A00C_TYPE(V_008F1C_SQ_RSRC_IMG_2D);
+		img->raw[0] = img->desc[0];
+		img->raw[1] = (img->desc[1] & C_00A004_FORMAT) | S_00A004_FORMAT(raw_formats[log2_size]);
+		img->raw[2] = img->desc[2];
+		img->raw[3] =
+			(img->desc[3] & C_00A00C_DST_SEL_X & C_00A00C_DST_SEL_Y & C_00A00C_DST_SEL_Z & C_00A00C_DST_SEL_W) |
+			S_00A00C_DST_SEL_X(V_008F0C_SQ_SEL_X) |
+			S_00A00C_DST_SEL_Y(V_008F0C_SQ_SEL_Y) |
+			S_00A00C_DST_SEL_Z(V_008F0C_SQ_SEL_Z) |
+			S_00A00C_DST_SEL_W(V_008F0C_SQ_SEL_W);
+	}
+	/* a slab has the tiling of its images from when it was created */
+	if (!img->slab) {
+		metadata.tiling_info = tiling_info(ctx, img->swizzle);
+		ret = amdgpu_bo_set_metadata(img->bo.handle, &metadata);
+		if (ret < 0)
+			goto error1;
+	}
+	img->draw = NULL;
+	img->syncobj = 0;
+	img->wait_pending = 0;
+	img->batch = 0;
+	img->written = 0;
+	img->read = 0;
+	img->drawn = 0;
+	img->sampled = 0;
+	img->queue[QUEUE_SDMA] = 0;
+	img->queue[QUEUE_COMPUTE] = 0;
+	img->last = QUEUE_SDMA;
+	img->dispatched = 0;
+	img->dcc = 0;
+	if (flags & BLT_IMAGE_DST) {
+		img->draw = new_draw(ctx);
+		if (!img->draw)
+			goto error1;
+	}
+
+	return &img->base;
+
+error1:
+	release_memory(ctx, &img->bo, img->slab);
+error0:
+	free(img);
+	return NULL;
+}
+
+static void
+emit(struct cmdbuf *cmd, uint32_t val)
+{
+	assert(cmd->len < cmd->cap);
+	cmd->buf[cmd->len++] = val;
+}
+
+static void
+emit_array(struct cmdbuf *cmd, size_t len, const uint32_t *val)
+{
+	assert(cmd->len + len <= cmd->cap);
+	memcpy(&cmd->buf[cmd->len], val, len * sizeof(val[0]));
+	cmd->len += len;
+}
+
+/* record the length of the current chunk where the submission will find it */
+static void
+end_chunk(struct cmdbuf *cmd)
+{
+	if (cmd->chunk_len == 1)
+		cmd->first_len = cmd->len;
+	else
+		*cmd->chain |= S_3F2_IB_SIZE(cmd->len);
+	cmd->total += cmd->len;
+}
+
+/*
+Make room for len more dwords in cmd, chaining to a new chunk if the
+current one is full. Packets must not be split across chunks, so this
+is called before emitting them with the maximum they may take.
+*/
+static int
+reserve(struct context *ctx, struct cmdbuf *cmd, unsigned len)
+{
+	struct chunk *c;
+	unsigned size, want;
+	void *p;
+	size_t cap;
+
+	/* keep room for padding and the chain packet */
+	len += 12;
+	if (cmd->chunk_len > 0 && cmd->len + len <= cmd->cap)
+		return 0;
+	if (cmd->chunk_len == cmd->chunk_cap) {
+		cap = cmd->chunk_cap ? cmd->chunk_cap * 2 : 4;
+		p = realloc(cmd->chunk, cap * sizeof(cmd->chunk[0]));
+		if (!p)
+			return -1;
+		cmd->chunk = p;
+		cmd->chunk_cap = cap;
+	}
+	/*
+	Start with enough for the last submission so that most streams
+	fit in one chunk, and grow geometrically after that.
+	*/
+	want = cmd->chunk_len == 0 ? cmd->hint + len : cmd->cap * 2;
+	for (size = CHUNK_MIN; size < want && size < CHUNK_MAX; size *= 2)
+		;
+	c = get_chunk(ctx, cmd->pool, size);
+	if (!c)
+		return -1;
+	if (cmd->chunk_len > 0) {
+		while ((cmd->len + 4) % 8)
+			emit(cmd, 0xffff1000);
+		emit(cmd, PKT3(PKT3_INDIRECT_BUFFER_CIK, 2, 0));
+		emit(cmd, c->bo.addr);
+		emit(cmd, c->bo.addr >> 32);
+		emit(cmd, S_3F2_CHAIN(1) | S_3F2_VALID(1));
+		end_chunk(cmd);
+		cmd->chain = &cmd->buf[cmd->len - 1];
+	}
+	cmd->chunk[cmd->chunk_len++] = c;
+	cmd->buf = c->buf;
+	cmd->len = 0;
+	cmd->cap = c->cap;
+	cmd->pkt = NULL;
+	return 0;
+}
+
+static const uint32_t reg_base[] = {
+	[REG_CONTEXT] = SI_CONTEXT_REG_OFFSET,
+	[REG_SH] = SI_SH_REG_OFFSET,
+	[REG_UCONFIG] = CIK_UCONFIG_REG_OFFSET,
+};
+
+static int
+reg_is_set(struct shadow *sh, int space, uint32_t off, uint32_t val)
+{
+	return sh->known[space][off / 32] & 1u << off % 32 && sh->val[space][off] == val;
+}
+
+/*
+Set len consecutive registers starting at reg with a SET_*_REG packet op.
+Values at either end that the stream already set are dropped, and if the
+last packet ended at the register before, it is extended instead of
+starting a new one.
+*/
+static void
+set_regs(struct cmdbuf *cmd, int space, unsigned op, uint32_t reg, int idx, int len, const uint32_t *val)
+{
+	struct shadow *sh = cmd->shadow;
+	uint32_t off = (reg - reg_base[space]) >> 2;
+	int i;
+
+	if (sh && off + len <= LEN(sh->val[space])) {
+		while (len > 0 && reg_is_set(sh, space, off, val[0])) {
+			++off;
+			++val;
+			--len;
+		}
+		while (len > 0 && reg_is_set(sh, space, off + len - 1, val[len - 1]))
+			--len;
+		if (len == 0)
+			return;
+		for (i = 0; i < len; ++i) {
+			sh->val[space][off + i] = val[i];
+			sh->known[space][(off + i) / 32] |= 1u << (off + i) % 32;
+		}
+	}
+	if (idx == 0 && cmd->pkt && cmd->pkt_end == &cmd->buf[cmd->len] &&
+	    cmd->pkt_op == op && cmd->pkt_next == off && PKT_COUNT_G(*cmd->pkt) + len < 0x3fff)
+	{
+		*cmd->pkt += PKT_COUNT_S(len);
+	} else {
+		emit(cmd, PKT3(op, len, 0));
+		emit(cmd, off | idx << 28);
+		cmd->pkt = idx == 0 ? &cmd->buf[cmd->len - 2] : NULL;
+		cmd->pkt_op = op;
+	}
+	emit_array(cmd, len, val);
+	cmd->pkt_end = &cmd->buf[cmd->len];
+	cmd->pkt_next = off + len;
+}
+
+/* emit a table of SET_*_REG packets built with the SET_*_REG macros */
+static void
+emit_regs(struct cmdbuf *cmd, size_t len, const uint32_t *pkt)
+{
+	unsigned op, n;
+	int space;
+
+	while (len > 0) {
+		op = PKT3_IT_OPCODE_G(pkt[0]);
+		n = PKT_COUNT_G(pkt[0]);
+		switch (op) {
+		case PKT3_SET_CONTEXT_REG: space = REG_CONTEXT; break;
+		case PKT3_SET_SH_REG:      space = REG_SH; break;
+		case PKT3_SET_UCONFIG_REG: space = REG_UCONFIG; break;
+		default: assert(0); return;
+		}
+		set_regs(cmd, space, op, reg_base[space] + (pkt[1] & 0xffff) * 4, pkt[1] >> 28, n, &pkt[2]);
+		pkt += n + 2;
+		len -= n + 2;
+	}
+}
+
+static void
+set_context_reg_idx(struct cmdbuf *cmd, uint32_t reg, int idx, uint32_t val)
+{
+	set_regs(cmd, REG_CONTEXT, PKT3_SET_CONTEXT_REG, reg, idx, 1, &val);
+}
+
+static void
+set_context_reg(struct cmdbuf *cmd, uint32_t reg, uint32_t val)
+{
+	set_context_reg_idx(cmd, reg, 0, val);
+}
+
+static void
+set_context_reg_seq(struct cmdbuf *cmd, uint32_t reg, int len, uint32_t *val)
+{
+	set_regs(cmd, REG_CONTEXT, PKT3_SET_CONTEXT_REG, reg, 0, len, val);
+}
+
+static void
+set_sh_reg_idx(struct context *ctx, struct cmdbuf *cmd, uint32_t reg, int idx, uint32_t val)
+{
+	set_regs(cmd, REG_SH, ctx->chip.class >= GFX10 ? PKT3_SET_SH_REG_INDEX : PKT3_SET_SH_REG, reg, idx, 1, &val);
+}
+
+static void
+set_sh_reg(struct cmdbuf *cmd, uint32_t reg, uint32_t val)
+{
+	set_regs(cmd, REG_SH, PKT3_SET_SH_REG, reg, 0, 1, &val);
+}
+
+static void
+set_sh_reg_seq(struct cmdbuf *cmd, uint32_t reg, int len, uint32_t *val)
+{
+	set_regs(cmd, REG_SH, PKT3_SET_SH_REG, reg, 0, len, val);
+}
+
+static void
+set_uconfig_reg_idx(struct context *ctx, struct cmdbuf *cmd, uint32_t reg, int idx, uint32_t val)
+{
+	set_regs(cmd, REG_UCONFIG, ctx->chip.class >= GFX10 ? PKT3_SET_UCONFIG_REG_INDEX : PKT3_SET_UCONFIG_REG, reg, idx, 1, &val);
+}
+
+static void
+set_uconfig_reg(struct context *ctx, struct cmdbuf *cmd, uint32_t reg, uint32_t val)
+{
+	set_regs(cmd, REG_UCONFIG, PKT3_SET_UCONFIG_REG, reg, 0, 1, &val);
+}
+
+static int
+draw(struct context *ctx)
+{
+	struct image *dst = (void *)ctx->base.dst;
+	struct cmdbuf *cmd = &dst->draw->cmd;
+	struct vertbuf *vert = &dst->draw->vert;
+	const struct blt_transform *t = &ctx->base.transform;
+
+	if (vert->len == vert->pos)
+		return 0;
+	if (reserve(ctx, cmd, 32) < 0)
+		return -1;
+	if (0) {
+		set_context_reg_idx(cmd, R_028AA8_IA_MULTI_VGT_PARAM, 1,
+			S_028AA8_PRIMGROUP_SIZE(127) |
+			S_028AA8_WD_SWITCH_ON_EOP(1) |
+			S_028AA8_MAX_PRIMGRP_IN_WAVE(2));
+	}
+	if (ctx->chip.class >= GFX9)
+		set_uconfig_reg(ctx, cmd, R_03092C_VGT_MULTI_PRIM_IB_RESET_EN, 0);
+	else
+		set_context_reg(cmd, R_028A94_VGT_MULTI_PRIM_IB_RESET_EN, 0);
+	set_sh_reg_seq(cmd, R_00B13C_SPI_SHADER_USER_DATA_VS_3, 9, (uint32_t[]){
+		(vert->pos - 4) / 2,
+		ftou(ctx->base.dst_x),
+		ftou(ctx->base.dst_y),
+		ftou(t->xx * ctx->base.src_x + t->xy * ctx->base.src_y + t->x0),
+		ftou(t->yx * ctx->base.src_x + t->yy * ctx->base.src_y + t->y0),
+		ftou(t->xx),
+		ftou(t->yx),
+		ftou(t->xy),
+		ftou(t->yy),
+	});
+	emit(cmd, PKT3(PKT3_NUM_INSTANCES, 0, 0));
+	emit(cmd, 1);
+	emit(cmd, PKT3(PKT3_DRAW_INDEX_AUTO, 1, 0));
+	emit(cmd, (vert->len - vert->pos) / 2); /* vertex count */
+	emit(cmd, V_0287F0_DI_SRC_SEL_AUTO_INDEX | S_0287F0_USE_OPAQUE(0));
+	vert->pos = vert->len;
+
+	return 0;
+}
+
+/*
+Draw the vertices in the current vertex buffer and switch to a new one,
+pointing the vertex shader at its descriptor.
+*/
+static int
+next_vertbuf(struct context *ctx)
+{
+	struct image *dst = (void *)ctx->base.dst;
+	struct cmdbuf *cmd = &dst->draw->cmd;
+	struct vertbuf *vert = &dst->draw->vert;
+	struct chunk *c;
+	void *p;
+	size_t cap;
+
+	if (draw(ctx) < 0 || reserve(ctx, cmd, 3) < 0)
+		return -1;
+	if (vert->chunk_len == vert->chunk_cap) {
+		cap = vert->chunk_cap ? vert->chunk_cap * 2 : 4;
+		p = realloc(vert->chunk, cap * sizeof(vert->chunk[0]));
+		if (!p)
+			return -1;
+		vert->chunk = p;
+		vert->chunk_cap = cap;
+	}
+	c = get_chunk(ctx, &ctx->vert_pool, VERT_SIZE);
+	if (!c)
+		return -1;
+	vert->chunk[vert->chunk_len++] = c;
+	vert->buf = c->buf;
+	vert->cap = c->cap;
+	vert->len = 0;
+	vert->buf[vert->len++] = c->bo.addr + 16;
+	vert->buf[vert->len++] =
+		S_008F04_BASE_ADDRESS_HI((c->bo.addr + 16) >> 32) |
+		S_008F04_STRIDE(8);
+	vert->buf[vert->len++] = c->cap * 4 - 16;
+	vert->buf[vert->len++] =
+		S_008F0C_DST_SEL_X(V_008F0C_SQ_SEL_X) |
+		S_008F0C_DST_SEL_Y(V_008F0C_SQ_SEL_Y) |
+		S_008F0C_DST_SEL_Z(V_008F0C_SQ_SEL_Z) |
+		S_008F0C_DST_SEL_W(V_008F0C_SQ_SEL_W) |
+		S_008F0C_FORMAT(V_008F0C_IMG_FORMAT_32_UINT) |
+		S_008F0C_OOB_SELECT(1) |
+		S_008F0C_RESOURCE_LEVEL(1);
+	vert->pos = vert->len;
+	set_sh_reg(cmd, R_00B138_SPI_SHADER_USER_DATA_VS_2, c->bo.addr);
+	return 0;
+}
+
+/*
+Make the next submission for drw wait for the fence imported into img,
+if there is one.
+*/
+static int
+wait_image(struct draw *drw, struct image *img)
+{
+	void *p;
+	size_t cap;
+
+	if (!img->wait_pending)
+		return 0;
+	if (drw->wait_len == drw->wait_cap) {
+		cap = drw->wait_cap ? drw->wait_cap * 2 : 4;
+		p = realloc(drw->wait, cap * sizeof(drw->wait[0]));
+		if (!p)
+			return -1;
+		drw->wait = p;
+		drw->wait_cap = cap;
+	}
+	drw->wait[drw->wait_len++] = (struct drm_amdgpu_cs_chunk_sem){.handle = img->syncobj};
+	img->wait_pending = 0;
+	return 0;
+}
+
+/* make room in the BO list for len more entries */
+static int
+grow_list(struct context *ctx, size_t len)
+{
+	void *p;
+	size_t cap;
+
+	if (ctx->list_len + len <= ctx->list_cap)
+		return 0;
+	cap = ctx->list_cap * 2;
+	if (cap < ctx->list_len + len)
+		cap = ctx->list_len + len;
+	p = realloc(ctx->list, cap * sizeof(ctx->list[0]));
+	if (!p)
+		return -1;
+	ctx->list = p;
+	ctx->list_cap = cap;
+	return 0;
+}
+
+/* add img to the BO list of the next submission, if it isn't there already */
+static int
+add_image(struct context *ctx, struct image *img)
+{
+	size_t i;
+
+	/* rendering must follow SDMA and compute commands using img */
+	for (i = 0; i < LEN(ctx->queue); ++i) {
+		if (img->queue[i] > ctx->queue_needed[i])
+			ctx->queue_needed[i] = img->queue[i];
+	}
+	if (img->batch == ctx->batch)
+		return 0;
+	/* images in the same slab share its entry */
+	if (!img->slab || img->slab->batch != ctx->batch) {
+		if (grow_list(ctx, 1) < 0)
+			return -1;
+		ctx->list[ctx->list_len++] = (struct drm_amdgpu_bo_list_entry){.bo_handle = img->bo.kms};
+		if (img->slab)
+			img->slab->batch = ctx->batch;
+	}
+	img->batch = ctx->batch;
+	return 0;
+}
+
+/* return the chunks of drw to their pools, to be reused once submission seq completes */
+static void
+release_draw(struct context *ctx, struct draw *drw, uint64_t seq)
+{
+	struct cmdbuf *cmd = &drw->cmd;
+	struct vertbuf *vert = &drw->vert;
+
+	put_chunks(&ctx->cmd_pool, cmd->chunk, cmd->chunk_len, seq);
+	cmd->chunk_len = 0;
+	cmd->total = 0;
+	put_chunks(&ctx->vert_pool, vert->chunk, vert->chunk_len, seq);
+	vert->chunk_len = 0;
+	vert->len = 0;
+	vert->cap = 0;
+	vert->pos = 0;
+}
+
+static const char *const pkt3_name[256] = {
+	[PKT3_NOP] = "NOP",
+	[PKT3_CLEAR_STATE] = "CLEAR_STATE",
+	[PKT3_DRAW_INDEX_AUTO] = "DRAW_INDEX_AUTO",
+	[PKT3_NUM_INSTANCES] = "NUM_INSTANCES",
+	[PKT3_INDIRECT_BUFFER_CIK] = "INDIRECT_BUFFER",
+	[PKT3_PFP_SYNC_ME] = "PFP_SYNC_ME",
+	[PKT3_SURFACE_SYNC] = "SURFACE_SYNC",
+	[PKT3_EVENT_WRITE] = "EVENT_WRITE",
+	[PKT3_ACQUIRE_MEM] = "ACQUIRE_MEM",
+	[PKT3_SET_CONTEXT_REG] = "SET_CONTEXT_REG",
+	[PKT3_SET_SH_REG] = "SET_SH_REG",
+	[PKT3_SET_SH_REG_INDEX] = "SET_SH_REG_INDEX",
+	[PKT3_SET_UCONFIG_REG] = "SET_UCONFIG_REG",
+	[PKT3_SET_UCONFIG_REG_INDEX] = "SET_UCONFIG_REG_INDEX",
+};
+
+/* print the packets of a finished command stream to stderr */
+static void
+dump_ib(struct cmdbuf *cmd)
+{
+	const uint32_t *buf;
+	unsigned op, len, next, i, n;
+	size_t c;
+	uint32_t base;
+
+	fprintf(stderr, "ib: %u dwords in %zu chunks\n", cmd->total, cmd->chunk_len);
+	len = cmd->first_len;
+	for (c = 0; c < cmd->chunk_len; ++c) {
+		buf = cmd->chunk[c]->buf;
+		next = c + 1 < cmd->chunk_len ? G_3F2_IB_SIZE(buf[len - 1]) : 0;
+		for (i = 0; i < len; i += n) {
+			/* padding is a header without a body */
+			if (buf[i] == PKT3_NOP_PAD) {
+				n = 1;
+				continue;
+			}
+			op = PKT3_IT_OPCODE_G(buf[i]);
+			n = PKT_COUNT_G(buf[i]) + 2;
+			if (pkt3_name[op])
+				fprintf(stderr, "  %-22s", pkt3_name[op]);
+			else
+				fprintf(stderr, "  0x%02x%-18s", op, "");
+			switch (op) {
+			case PKT3_SET_CONTEXT_REG:      base = SI_CONTEXT_REG_OFFSET; break;
+			case PKT3_SET_SH_REG:
+			case PKT3_SET_SH_REG_INDEX:     base = SI_SH_REG_OFFSET; break;
+			case PKT3_SET_UCONFIG_REG:
+			case PKT3_SET_UCONFIG_REG_INDEX: base = CIK_UCONFIG_REG_OFFSET; break;
+			default: base = 0;
+			}
+			if (base)
+				fprintf(stderr, " 0x%05x", base + (buf[i + 1] & 0xffff) * 4);
+			fprintf(stderr, " %u\n", n);
+		}
+		len = next;
+	}
+}
+
+#define SDMA_SIZE 0x400
+
+/*
+Submit the commands of queue i. They wait for the last graphics
+submission if there has been one since, since they may use images it
+renders to or samples, and for the commands of the other queue that
+used their images before them.
+*/
+static int
+submit_queue(struct context *ctx, int i)
+{
+	struct queue *q = &ctx->queue[i];
+	struct cmdbuf *cmd = &q->cmd;
+	struct drm_amdgpu_cs_chunk chunks[4];
+	uint32_t chunks_len;
+	uint64_t seq;
+	size_t j, cap;
+	void *p;
+	int ret;
+
+	if (cmd->chunk_len == 0)
+		return 0;
+	if (grow_pool(&q->pool, cmd->chunk_len) < 0)
+		return -1;
+	/* and the compute kernels */
+	if (q->list_len + cmd->chunk_len + 2 > q->list_cap) {
+		cap = q->list_len + cmd->chunk_len + 2;
+		p = realloc(q->list, cap * sizeof(q->list[0]));
+		if (!p)
+			return -1;
+		q->list = p;
+		q->list_cap = cap;
+	}
+	/* room for the graphics and the other queue's syncobjs */
+	if (q->wait_len + 2 > q->wait_cap) {
+		cap = q->wait_cap ? q->wait_cap * 2 : 4;
+		p = realloc(q->wait, cap * sizeof(q->wait[0]));
+		if (!p)
+			return -1;
+		q->wait = p;
+		q->wait_cap = cap;
+	}
+
+	if (q->pool.ip == AMDGPU_HW_IP_DMA) {
+		while (cmd->len % 8)
+			cmd->buf[cmd->len++] = CIK_SDMA_PACKET(CIK_SDMA_OPCODE_NOP, 0, 0);
+		cmd->first_len = cmd->len;
+	} else {
+		while (cmd->len % 8)
+			emit(cmd, PKT3_NOP_PAD);
+		end_chunk(cmd);
+		if (ctx->dump)
+			dump_ib(cmd);
+		q->list[q->list_len++] = (struct drm_amdgpu_bo_list_entry){.bo_handle = ctx->shader.fillcs.kms};
+		q->list[q->list_len++] = (struct drm_amdgpu_bo_list_entry){.bo_handle = ctx->shader.copycs.kms};
+	}
+	for (j = 0; j < cmd->chunk_len; ++j)
+		q->list[q->list_len++] = (struct drm_amdgpu_bo_list_entry){.bo_handle = cmd->chunk[j]->bo.kms};
+	if (q->wait_gfx)
+		q->wait[q->wait_len++] = (struct drm_amdgpu_cs_chunk_sem){.handle = ctx->syncobj};
+	if (q->needed > q->waited)
+		q->wait[q->wait_len++] = (struct drm_amdgpu_cs_chunk_sem){.handle = ctx->queue[!i].syncobj};
+	chunks[0] = (struct drm_amdgpu_cs_chunk){
+		.chunk_id = AMDGPU_CHUNK_ID_IB,
+		.length_dw = sizeof(struct drm_amdgpu_cs_chunk_ib) / 4,
+		.chunk_data = (uintptr_t)&(struct drm_amdgpu_cs_chunk_ib){
+			.ip_type = q->pool.ip,
+			.ring = 0,
+			.va_start = cmd->chunk[0]->bo.addr,
+			.ib_bytes = cmd->first_len * 4,
+		},
+	};
+	chunks[1] = (struct drm_amdgpu_cs_chunk){
+		.chunk_id = AMDGPU_CHUNK_ID_BO_HANDLES,
+		.length_dw = sizeof(struct drm_amdgpu_bo_list_in) / 4,
+		.chunk_data = (uintptr_t)&(struct drm_amdgpu_bo_list_in){
+			.operation = ~0,
+			.list_handle = ~0,
+			.bo_number = q->list_len,
+			.bo_info_size = sizeof(q->list[0]),
+			.bo_info_ptr = (uintptr_t)q->list,
+		},
+	};
+	chunks[2] = (struct drm_amdgpu_cs_chunk){
+		.chunk_id = AMDGPU_CHUNK_ID_SYNCOBJ_OUT,
+		.length_dw = sizeof(struct drm_amdgpu_cs_chunk_sem) / 4,
+		.chunk_data = (uintptr_t)&(struct drm_amdgpu_cs_chunk_sem){.handle = q->syncobj},
+	};
+	chunks_len = 3;
+	if (q->wait_len > 0) {
+		chunks[chunks_len++] = (struct drm_amdgpu_cs_chunk){
+			.chunk_id = AMDGPU_CHUNK_ID_SYNCOBJ_IN,
+			.length_dw = q->wait_len * sizeof(q->wait[0]) / 4,
+			.chunk_data = (uintptr_t)q->wait,
+		};
+	}
+	ret = amdgpu_cs_submit_raw2(ctx->dev, ctx->cs, 0, chunks_len, chunks, &seq);
+
+	/* if the submission failed, the commands are discarded and their chunks are idle */
+	put_chunks(&q->pool, cmd->chunk, cmd->chunk_len, ret < 0 ? 0 : seq);
+	if (ret >= 0) {
+		cmd->hint = cmd->total;
+		q->pool.seq = seq;
+	}
+	cmd->chunk_len = 0;
+	cmd->buf = NULL;
+	cmd->total = 0;
+	q->list_len = 0;
+	q->wait_len = 0;
+	++q->submits;
+	++q->barriers;
+	if (ret < 0) {
+		errno = -ret;
+		return -1;
+	}
+	q->wait_gfx = 0;
+	q->waited = q->needed;
+	return 0;
+}
+
+/* make room for len more dwords of SDMA commands, submitting them if the IB is full */
+static int
+sdma_reserve(struct context *ctx, unsigned len)
+{
+	struct queue *q = &ctx->queue[QUEUE_SDMA];
+	struct chunk *c;
+	void *p;
+	size_t cap;
+
+	/* leave room to pad the IB */
+	if (q->cmd.buf && q->cmd.len + len + 7 > q->cmd.cap && submit_queue(ctx, QUEUE_SDMA) < 0)
+		return -1;
+	if (q->cmd.buf)
+		return 0;
+	if (q->cmd.chunk_cap == 0) {
+		cap = 4;
+		p = realloc(q->cmd.chunk, cap * sizeof(q->cmd.chunk[0]));
+		if (!p)
+			return -1;
+		q->cmd.chunk = p;
+		q->cmd.chunk_cap = cap;
+	}
+	c = get_chunk(ctx, &q->pool, SDMA_SIZE);
+	if (!c)
+		return -1;
+	q->cmd.chunk[q->cmd.chunk_len++] = c;
+	q->cmd.buf = c->buf;
+	q->cmd.len = 0;
+	q->cmd.cap = c->cap;
+	return 0;
+}
+
+/* get a staging buffer of at least size dwords for the SDMA commands to copy from */
+static struct chunk *
+sdma_staging(struct context *ctx, unsigned size)
+{
+	struct queue *q = &ctx->queue[QUEUE_SDMA];
+	struct chunk *c;
+	void *p;
+	size_t cap;
+
+	if (q->cmd.chunk_len == q->cmd.chunk_cap) {
+		cap = q->cmd.chunk_cap * 2;
+		p = realloc(q->cmd.chunk, cap * sizeof(q->cmd.chunk[0]));
+		if (!p)
+			return NULL;
+		q->cmd.chunk = p;
+		q->cmd.chunk_cap = cap;
+	}
+	c = get_chunk(ctx, &q->pool, size);
+	if (!c)
+		return NULL;
+	q->cmd.chunk[q->cmd.chunk_len++] = c;
+	return c;
+}
+
+/*
+Add img to the BO list of the commands of queue i, which wait for a
+fence imported into it, and for commands of the other queue using it.
+*/
+static int
+queue_use_image(struct context *ctx, int i, struct image *img)
+{
+	struct queue *q = &ctx->queue[i];
+	void *p;
+	size_t cap;
+
+	if (img->queue[i] == q->submits + 1 && !img->wait_pending)
+		return 0;
+	if (img->queue[!i] > ctx->queue[!i].submits && submit_queue(ctx, !i) < 0)
+		return -1;
+	if (img->queue[!i] > q->needed)
+		q->needed = img->queue[!i];
+	if (q->list_len == q->list_cap) {
+		cap = q->list_cap ? q->list_cap * 2 : 16;
+		p = realloc(q->list, cap * sizeof(q->list[0]));
+		if (!p)
+			return -1;
+		q->list = p;
+		q->list_cap = cap;
+	}
+	/* two more for the graphics and the other queue's syncobjs */
+	if (q->wait_len + 2 >= q->wait_cap) {
+		cap = q->wait_cap ? q->wait_cap * 2 : 4;
+		p = realloc(q->wait, cap * sizeof(q->wait[0]));
+		if (!p)
+			return -1;
+		q->wait = p;
+		q->wait_cap = cap;
+	}
+	if (img->queue[i] != q->submits + 1)
+		q->list[q->list_len++] = (struct drm_amdgpu_bo_list_entry){.bo_handle = img->bo.kms};
+	if (img->wait_pending) {
+		q->wait[q->wait_len++] = (struct drm_amdgpu_cs_chunk_sem){.handle = img->syncobj};
+		img->wait_pending = 0;
+	}
+	img->queue[i] = q->submits + 1;
+	img->last = i;
+	return 0;
+}
+
+/* fill all of img with a repeated dword */
+static int
+sdma_fill(struct context *ctx, struct image *img, uint32_t val)
+{
+	struct cmdbuf *cmd = &ctx->queue[QUEUE_SDMA].cmd;
+	uint64_t addr, size, n;
+
+	addr = img->bo.addr;
+	/* leave DCC alone, since the image isn't compressed outside its stream */
+	for (size = img->dcc_size ? img->dcc_offset : img->bo.size; size > 0; size -= n, addr += n) {
+		n = size < CIK_SDMA_COPY_MAX_SIZE ? size : CIK_SDMA_COPY_MAX_SIZE;
+		/* the IB may have been submitted to make room */
+		if (sdma_reserve(ctx, 5) < 0 || queue_use_image(ctx, QUEUE_SDMA, img) < 0)
+			return -1;
+		emit(cmd, CIK_SDMA_PACKET(CIK_SDMA_PACKET_CONSTANT_FILL, 0, 0x8000 /* dwords */));
+		emit(cmd, addr);
+		emit(cmd, addr >> 32);
+		emit(cmd, val);
+		emit(cmd, n - 1);
+	}
+	return 0;
+}
+
+/* surface info dword of SDMA sub-window copies */
+static uint32_t
+sdma_info(struct image *img)
+{
+	/* a 2D resource with a single level */
+	return (ffs(img->fmt->size) - 1) | img->swizzle << 3 | 1 << 9;
+}
+
+/*
+Return whether SDMA can copy a w by h rectangle between two images of
+the same format: both must be linear, or tiled with the same micro tile
+mode and the rectangle aligned to T2T blocks, which depend on the size
+of a pixel.
+*/
+static int
+sdma_can_copy(struct image *dst, int dst_x, int dst_y, struct image *src, int src_x, int src_y, int w, int h)
+{
+	static const int align[][2] = {{16, 16}, {16, 8}, {8, 8}, {8, 4}, {4, 4}};
+	int bw, bh;
+
+	if (dst->swizzle == 0 || src->swizzle == 0)
+		return dst->swizzle == src->swizzle;
+	if (dst->swizzle % 4 != src->swizzle % 4)
+		return 0;
+	bw = align[ffs(dst->fmt->size) - 1][0];
+	bh = align[ffs(dst->fmt->size) - 1][1];
+	return (dst_x | src_x | w) % bw == 0 && (dst_y | src_y | h) % bh == 0;
+}
+
+/*
+Copy a w by h rectangle between two images of the same format, which
+sdma_can_copy accepts.
+*/
+static int
+sdma_copy(struct context *ctx, struct image *dst, int dst_x, int dst_y, struct image *src, int src_x, int src_y, int w, int h)
+{
+	if (sdma_reserve(ctx, 15) < 0 || queue_use_image(ctx, QUEUE_SDMA, dst) < 0 || queue_use_image(ctx, QUEUE_SDMA, src) < 0)
+		return -1;
+	if (dst->swizzle == 0) {
+		/* pitches in pixels, and slice pitches for a single slice */
+		emit_array(&ctx->queue[QUEUE_SDMA].cmd, 13, (uint32_t[]){
+			CIK_SDMA_PACKET(CIK_SDMA_OPCODE_COPY, CIK_SDMA_COPY_SUB_OPCODE_LINEAR_SUB_WINDOW, 0) | (ffs(dst->fmt->size) - 1) << 29,
+			src->bo.addr,
+			src->bo.addr >> 32,
+			src_x | src_y << 16,
+			(src->stride / src->fmt->size - 1) << 13,
+			src->stride / src->fmt->size * src->base.height - 1,
+			dst->bo.addr,
+			dst->bo.addr >> 32,
+			dst_x | dst_y << 16,
+			(dst->stride / dst->fmt->size - 1) << 13,
+			dst->stride / dst->fmt->size * dst->base.height - 1,
+			(w - 1) | (h - 1) << 16,
+			0,
+		});
+		return 0;
+	}
+	emit_array(&ctx->queue[QUEUE_SDMA].cmd, 15, (uint32_t[]){
+		CIK_SDMA_PACKET(CIK_SDMA_OPCODE_COPY, CIK_SDMA_COPY_SUB_OPCODE_T2T_SUB_WINDOW, 0),
+		src->bo.addr,
+		src->bo.addr >> 32,
+		src_x | src_y << 16,
+		(src->stride / src->fmt->size - 1) << 16,
+		src->base.height - 1,
+		sdma_info(src),
+		dst->bo.addr,
+		dst->bo.addr >> 32,
+		dst_x | dst_y << 16,
+		(dst->stride / dst->fmt->size - 1) << 16,
+		dst->base.height - 1,
+		sdma_info(dst),
+		(w - 1) | (h - 1) << 16,
+		0,
+	});
+	return 0;
+}
+
+/*
+Make room for len more dwords of compute commands. A new IB starts with
+the dispatch state shared by the kernels, which run in 8x8 workgroups.
+*/
+static int
+compute_reserve(struct context *ctx, unsigned len)
+{
+	struct queue *q = &ctx->queue[QUEUE_COMPUTE];
+	struct cmdbuf *cmd = &q->cmd;
+	int start;
+
+	start = cmd->chunk_len == 0;
+	if (reserve(ctx, cmd, len + 24) < 0)
+		return -1;
+	if (!start)
+		return 0;
+	memset(q->shadow.known, 0, sizeof(q->shadow.known));
+	set_sh_reg_seq(cmd, R_00B810_COMPUTE_START_X, 6, (uint32_t[]){
+		0,
+		0,
+		0,
+		S_00B81C_NUM_THREAD_FULL(8),
+		S_00B820_NUM_THREAD_FULL(8),
+		S_00B824_NUM_THREAD_FULL(1),
+	});
+	set_sh_reg(cmd, R_00B854_COMPUTE_RESOURCE_LIMITS, 0);
+	set_sh_reg_seq(cmd, R_00B858_COMPUTE_STATIC_THREAD_MGMT_SE0, 2, (uint32_t[]){
+		S_00B858_SH0_CU_EN(0xffff) | S_00B858_SH1_CU_EN(0xffff),
+		S_00B858_SH0_CU_EN(0xffff) | S_00B858_SH1_CU_EN(0xffff)
+	});
+	set_sh_reg_seq(cmd, R_00B864_COMPUTE_STATIC_THREAD_MGMT_SE2, 2, (uint32_t[]){
+		S_00B858_SH0_CU_EN(0xffff) | S_00B858_SH1_CU_EN(0xffff),
+		S_00B858_SH0_CU_EN(0xffff) | S_00B858_SH1_CU_EN(0xffff)
+	});
+	set_sh_reg(cmd, R_00B8A0_COMPUTE_PGM_RSRC3, 0);
+	return 0;
+}
+
+/*
+Add dst and src, if not NULL, to the compute commands for a group of
+dispatches. If earlier dispatches in the IB used them, wait for those
+to finish and invalidate the caches above L2, which image stores write
+through, first.
+*/
+static int
+compute_use(struct context *ctx, struct image *dst, struct image *src)
+{
+	struct queue *q = &ctx->queue[QUEUE_COMPUTE];
+
+	if (queue_use_image(ctx, QUEUE_COMPUTE, dst) < 0 || (src && queue_use_image(ctx, QUEUE_COMPUTE, src) < 0))
+		return -1;
+	if (compute_reserve(ctx, 10) < 0)
+		return -1;
+	if (dst->dispatched == q->barriers || (src && src->dispatched == q->barriers)) {
+		emit(&q->cmd, PKT3(PKT3_EVENT_WRITE, 0, 0));
+		emit(&q->cmd, EVENT_TYPE(V_028A90_CS_PARTIAL_FLUSH) | EVENT_INDEX(4));
+		emit_array(&q->cmd, 8, (uint32_t[]){
+			PKT3(PKT3_ACQUIRE_MEM, 6, 0),
+			0,
+			0xffffffff,
+			0x00ffffff,
+			0,
+			0,
+			10,
+			S_586_GL1_INV(1) |
+			S_586_GLV_INV(1),
+		});
+		++q->barriers;
+	}
+	dst->dispatched = q->barriers;
+	if (src)
+		src->dispatched = q->barriers;
+	return 0;
+}
+
+/* run a compute kernel over the rectangle r, with len dwords of user data */
+static int
+dispatch(struct context *ctx, const struct bo *shader, const struct shader_info *info, int len, uint32_t *user, const struct blt_rect *r)
+{
+	struct cmdbuf *cmd = &ctx->queue[QUEUE_COMPUTE].cmd;
+
+	if (compute_reserve(ctx, len + 20) < 0)
+		return -1;
+	set_sh_reg_seq(cmd, R_00B830_COMPUTE_PGM_LO, 2, (uint32_t[]){
+		shader->addr >> 8,
+		S_00B834_DATA(shader->addr >> 40),
+	});
+	set_sh_reg_seq(cmd, R_00B848_COMPUTE_PGM_RSRC1, 2, (uint32_t[]){
+		info->rsrc1 | S_00B848_FLOAT_MODE(V_00B028_FP_64_DENORMS) | S_00B848_DX10_CLAMP(1) | S_00B848_MEM_ORDERED(1),
+		info->rsrc2,
+	});
+	set_sh_reg_seq(cmd, R_00B900_COMPUTE_USER_DATA_0, len, user);
+	emit(cmd, PKT3(PKT3_DISPATCH_DIRECT, 3, 0) | PKT3_SHADER_TYPE_S(1));
+	emit(cmd, (r->x1 - r->x0 + 7) / 8);
+	emit(cmd, (r->y1 - r->y0 + 7) / 8);
+	emit(cmd, 1);
+	emit(cmd, S_00B800_COMPUTE_SHADER_EN(1) | S_00B800_CS_W32_EN(1));
+	return 0;
+}
+
+enum {
+	/* wait for pixel shaders to finish */
+	WAIT_PS = 1 << 0,
+	/* write back CB data and invalidate texture L0 and L1 */
+	FLUSH_CB = 1 << 1,
+};
+
+/*
+Emit the waits and cache operations in flags. Submissions don't need
+them between each other, since the kernel writes back and invalidates
+all caches around each one, but later streams in a batch do.
+*/
+static void
+barrier(struct context *ctx, struct cmdbuf *cmd, unsigned flags)
+{
+	emit(cmd, PKT3(PKT3_EVENT_WRITE, 0, 0));
+	emit(cmd, EVENT_TYPE(V_028A90_PS_PARTIAL_FLUSH) | EVENT_INDEX(4));
+	++ctx->waits;
+	if (!(flags & FLUSH_CB))
+		return;
+	emit(cmd, PKT3(PKT3_EVENT_WRITE, 0, 0));
+	emit(cmd, EVENT_TYPE(V_028A90_CACHE_FLUSH_AND_INV_EVENT) | EVENT_INDEX(0));
+	/* CB and TC share L2, so only the levels above it are invalidated */
+	if (ctx->chip.class >= GFX10) {
+		emit_array(cmd, 8, (uint32_t[]){
+			PKT3(PKT3_ACQUIRE_MEM, 6, 0) | PKT3_SHADER_TYPE_S(0),
+			0,
+			0xffffffff,
+			0x00ffffff,
+			0,
+			0,
+			10,
+			S_586_GL1_INV(1) |
+			S_586_GLV_INV(1),
+		});
+	} else {
+		emit(cmd, PKT3(PKT3_SURFACE_SYNC, 3, 0));
+		emit(cmd, S_0085F0_TCL1_ACTION_ENA(1));
+		emit(cmd, 0xffffffff); /* CP_COHER_SIZE */
+		emit(cmd, 0x00000000); /* CP_COHER_BASE */
+		emit(cmd, 0x0000000a); /* POLL_INTERVAL */
+	}
+	++ctx->flushes;
+}
+
+/*
+Decompress the DCC of dst in place by drawing over all of it in the
+DCC decompress mode of CB, which writes the clear color and compressed
+blocks out as plain pixels, since sampling, SDMA, compute and export
+don't read DCC.
+*/
+static int
+dcc_decompress(struct context *ctx)
+{
+	struct image *dst = (void *)ctx->base.dst;
+	struct cmdbuf *cmd = &dst->draw->cmd;
+	struct vertbuf *vert = &dst->draw->vert;
+	int x0, y0, x1, y1;
+
+	if (draw(ctx) < 0 || reserve(ctx, cmd, 32) < 0)
+		return -1;
+	barrier(ctx, cmd, FLUSH_CB);
+	if (vert->len + 6 > vert->cap && next_vertbuf(ctx) < 0)
+		return -1;
+	x0 = -ctx->base.dst_x;
+	y0 = -ctx->base.dst_y;
+	x1 = dst->base.width - ctx->base.dst_x;
+	y1 = dst->base.height - ctx->base.dst_y;
+	vert->buf[vert->len++] = x0;
+	vert->buf[vert->len++] = y0;
+	vert->buf[vert->len++] = x0;
+	vert->buf[vert->len++] = y1;
+	vert->buf[vert->len++] = x1;
+	vert->buf[vert->len++] = y0;
+	set_context_reg(cmd, R_028808_CB_COLOR_CONTROL, S_028808_MODE(V_028808_CB_DCC_DECOMPRESS) | S_028808_ROP3(V_028808_ROP3_COPY));
+	if (draw(ctx) < 0)
+		return -1;
+	dst->dcc = 0;
+	return 0;
+}
+
+/*
+Decompress the DCC of img, if it has been fast cleared, before sampling,
+SDMA, compute or an importer reads its pixels. This ends the stream of
+the current destination, after drawing the decompress at its end if it
+is img, or else in a new stream of img.
+*/
+static int
+resolve_dcc(struct context *ctx, struct image *img)
+{
+	struct image *dst = (void *)ctx->base.dst;
+	struct blt_solid black = {.base.impl = &blt_solid_image_impl};
+	struct blt_context base = ctx->base;
+	int ret;
+
+	if (!img->dcc)
+		return 0;
+	if (dst == img && dst->draw->recording)
+		return dcc_decompress(ctx) < 0 || end(ctx) < 0 ? -1 : 0;
+	if (dst && dst->draw->recording && end(ctx) < 0)
+		return -1;
+	ctx->base.dst = &img->base;
+	ctx->base.dst_x = 0;
+	ctx->base.dst_y = 0;
+	ctx->base.src = NULL;
+	/* the pixel shader doesn't matter, since CB ignores its output */
+	ret = setup(&ctx->base, BLT_OP_SRC, &img->base, &black.base, NULL) < 0 || dcc_decompress(ctx) < 0 || end(ctx) < 0 ? -1 : 0;
+	ctx->base = base;
+	return ret;
+}
+
+/*
+Finish the stream of the current destination, leaving it to be
+submitted by the next flush.
+*/
+static int
+end(struct context *ctx)
 {
-	struct context *ctx = (void *)ctx_base;
-	struct image *img;
-	size_t size;
+	struct image *dst = (void *)ctx->base.dst;
+	struct draw *drw = dst->draw, **pending;
+	struct cmdbuf *cmd = &drw->cmd;
+	size_t cap;
+
+	if (ctx->pending_len == ctx->pending_cap) {
+		cap = ctx->pending_cap ? ctx->pending_cap * 2 : 8;
+		pending = realloc(ctx->pending, cap * sizeof(ctx->pending[0]));
+		if (!pending)
+			return -1;
+		ctx->pending = pending;
+		ctx->pending_cap = cap;
+	}
+	if (draw(ctx) < 0)
+		return -1;
+	/* a later stream in the batch that samples dst flushes CB first */
+	dst->written = ctx->flushes;
+	dst->drawn = ctx->batch;
+	while (cmd->len % 8)
+		emit(cmd, PKT3_NOP_PAD);
+	end_chunk(cmd);
+	if (ctx->dump)
+		dump_ib(cmd);
+	drw->recording = 0;
+	drw->pending = 1;
+	ctx->pending[ctx->pending_len++] = drw;
+	return 0;
+}
+
+/*
+Destinations submitted by one CS ioctl, each with an IB, well below
+the number of IBs the kernel accepts in a job (192 on GFX).
+*/
+#define SUBMIT_MAX 64
+
+/*
+Submit the streams of the first len pending destinations in one CS
+ioctl, with an IB for each of them in the order they finished. The BO
+list is passed with the submission rather than created as a kernel
+object. If the submission fails, the streams stay pending.
+*/
+static int
+submit_draws(struct context *ctx, size_t len)
+{
+	struct drm_amdgpu_cs_chunk *chunks;
+	struct drm_amdgpu_cs_chunk_ib *ib;
+	struct drm_amdgpu_cs_chunk_sem *wait;
+	struct draw *drw;
+	size_t i, j, cmd_len, vert_len, wait_len, list_len, n;
+	uint64_t seq;
 	int ret;
-	struct amdgpu_bo_metadata metadata = {0};
 
-	img = malloc(sizeof(*img));
-	img->base = (struct blt_image){
-		.impl = &image_impl,
-		.width = w,
-		.height = h,
-		.format = format,
-	};
-	img->swizzle = 21; //flags & BLT_IMAGE_LINEAR ? 0 : 21;
-	img->stride = ALIGN_UP(w, 128) * 4;
-	size = img->stride * ALIGN_UP(h, 128);
-	ret = bo_alloc(ctx, &img->bo, size, 0x40000, AMDGPU_GEM_DOMAIN_VRAM, 0, 0);
-	if (ret < 0)
+	cmd_len = 0;
+	vert_len = 0;
+	wait_len = 0;
+	for (i = 0; i < len; ++i) {
+		drw = ctx->pending[i];
+		cmd_len += drw->cmd.chunk_len;
+		vert_len += drw->vert.chunk_len;
+		wait_len += drw->wait_len;
+	}
+	/* make room to return the chunks to their pools, so that it can't fail later */
+	if (grow_pool(&ctx->cmd_pool, cmd_len) < 0 || grow_pool(&ctx->vert_pool, vert_len) < 0 || grow_list(ctx, cmd_len + vert_len) < 0)
+		return -1;
+
+	ret = -1;
+	chunks = malloc((len + 3) * sizeof(chunks[0]));
+	if (!chunks)
 		goto error0;
-	if (ctx->chip.class >= GFX9) {
-		img->desc[0] = img->bo.addr >> 8; // XXX tile swizzle?
-		img->desc[1] =
-			S_00A004_BASE_ADDRESS_HI(img->bo.addr >> 40) |
-			S_00A004_FORMAT(V_00A004_IMG_FORMAT_8_8_8_8_UNORM) |
-			S_00A004_WIDTH_LO(img->stride / 4 - 1);
-		img->desc[2] =
-			S_00A008_WIDTH_HI((img->stride / 4 - 1) >> 2) |
-			S_00A008_HEIGHT(img->base.height - 1) |
-			S_00A008_RESOURCE_LEVEL(1);
-		img->desc[3] =
-			S_00A00C_DST_SEL_X(V_008F0C_SQ_SEL_Z) |
-			S_00A00C_DST_SEL_Y(V_008F0C_SQ_SEL_Y) |
-			S_00A00C_DST_SEL_Z(V_008F0C_SQ_SEL_X) |
-			S_00A00C_DST_SEL_W(V_008F0C_SQ_SEL_W) |
-			S_00A00C_BASE_LEVEL(0) |
-			S_00A00C_LAST_LEVEL(0) |
-			S_00A00C_SW_MODE(img->swizzle) |
-			S_00A00C_BC_SWIZZLE(V_00A00C_BC_SWIZZLE_ZYXW) |
-			S_00A00C_TYPE(V_008F1C_SQ_RSRC_IMG_2D);
-		metadata.tiling_info = AMDGPU_TILING_SET(SWIZZLE_MODE, img->swizzle);
-	} else {
-		metadata.tiling_info =
-			AMDGPU_TILING_SET(ARRAY_MODE, 4) |
-			AMDGPU_TILING_SET(PIPE_CONFIG, 5) |
-			AMDGPU_TILING_SET(TILE_SPLIT, 3) |
-			AMDGPU_TILING_SET(BANK_WIDTH, 0) |
-			AMDGPU_TILING_SET(BANK_HEIGHT, 2) |
-			AMDGPU_TILING_SET(MACRO_TILE_ASPECT, 2) |
-			AMDGPU_TILING_SET(NUM_BANKS, 3);
-	}
-	ret = amdgpu_bo_set_metadata(img->bo.handle, &metadata);
-	if (ret < 0)
+	ib = malloc(len * sizeof(ib[0]));
+	if (!ib)
 		goto error1;
-	if (flags & BLT_IMAGE_DST) {
-		img->draw = new_draw(ctx);
-		if (!img->draw)
-			goto error1;
+	/* and the syncobjs of the queues */
+	wait = malloc((wait_len + LEN(ctx->queue)) * sizeof(wait[0]));
+	if (!wait)
+		goto error2;
+	/* the chunks are only in the list of this submission */
+	list_len = ctx->list_len;
+	for (i = 0, n = 0; i < len; ++i) {
+		drw = ctx->pending[i];
+		ib[i] = (struct drm_amdgpu_cs_chunk_ib){
+			.ip_type = AMDGPU_HW_IP_GFX,
+			.ring = 0,
+			.va_start = drw->cmd.chunk[0]->bo.addr,
+			.ib_bytes = drw->cmd.first_len * 4,
+		};
+		chunks[i] = (struct drm_amdgpu_cs_chunk){
+			.chunk_id = AMDGPU_CHUNK_ID_IB,
+			.length_dw = sizeof(ib[0]) / 4,
+			.chunk_data = (uintptr_t)&ib[i],
+		};
+		for (j = 0; j < drw->cmd.chunk_len; ++j)
+			ctx->list[ctx->list_len++] = (struct drm_amdgpu_bo_list_entry){.bo_handle = drw->cmd.chunk[j]->bo.kms};
+		for (j = 0; j < drw->vert.chunk_len; ++j)
+			ctx->list[ctx->list_len++] = (struct drm_amdgpu_bo_list_entry){.bo_handle = drw->vert.chunk[j]->bo.kms};
+		for (j = 0; j < drw->wait_len; ++j)
+			wait[n++] = drw->wait[j];
 	}
+	for (i = 0; i < LEN(ctx->queue); ++i) {
+		if (ctx->queue_needed[i] > ctx->queue_waited[i])
+			wait[n++] = (struct drm_amdgpu_cs_chunk_sem){.handle = ctx->queue[i].syncobj};
+	}
+	wait_len = n;
+	n = len;
+	chunks[n++] = (struct drm_amdgpu_cs_chunk){
+		.chunk_id = AMDGPU_CHUNK_ID_BO_HANDLES,
+		.length_dw = sizeof(struct drm_amdgpu_bo_list_in) / 4,
+		.chunk_data = (uintptr_t)&(struct drm_amdgpu_bo_list_in){
+			.operation = ~0,
+			.list_handle = ~0,
+			.bo_number = ctx->list_len,
+			.bo_info_size = sizeof(ctx->list[0]),
+			.bo_info_ptr = (uintptr_t)ctx->list,
+		},
+	};
+	chunks[n++] = (struct drm_amdgpu_cs_chunk){
+		.chunk_id = AMDGPU_CHUNK_ID_SYNCOBJ_OUT,
+		.length_dw = sizeof(struct drm_amdgpu_cs_chunk_sem) / 4,
+		.chunk_data = (uintptr_t)&(struct drm_amdgpu_cs_chunk_sem){.handle = ctx->syncobj},
+	};
+	if (wait_len > 0) {
+		chunks[n++] = (struct drm_amdgpu_cs_chunk){
+			.chunk_id = AMDGPU_CHUNK_ID_SYNCOBJ_IN,
+			.length_dw = wait_len * sizeof(wait[0]) / 4,
+			.chunk_data = (uintptr_t)wait,
+		};
+	}
+	ret = amdgpu_cs_submit_raw2(ctx->dev, ctx->cs, 0, n, chunks, &seq);
+	ctx->list_len = list_len;
+	if (ret < 0) {
+		errno = -ret;
+		goto error3;
+	}
+	ctx->cmd_pool.seq = seq;
+	for (i = 0; i < LEN(ctx->queue); ++i) {
+		ctx->queue_waited[i] = ctx->queue_needed[i];
+		ctx->queue[i].wait_gfx = 1;
+	}
+	for (i = 0; i < len; ++i) {
+		drw = ctx->pending[i];
+		drw->fence = (struct amdgpu_cs_fence){
+			.context = ctx->cs,
+			.ip_type = AMDGPU_HW_IP_GFX,
+			.ring = 0,
+			.fence = seq,
+		};
+		drw->cmd.hint = drw->cmd.total;
+		drw->wait_len = 0;
+		drw->pending = 0;
+		release_draw(ctx, drw, seq);
+	}
+	ctx->pending_len -= len;
+	memmove(ctx->pending, ctx->pending + len, ctx->pending_len * sizeof(ctx->pending[0]));
+	/* the kernel flushes and waits for idle around each submission */
+	++ctx->flushes;
+	++ctx->waits;
 
-	return &img->base;
-
+error3:
+	free(wait);
+error2:
+	free(ib);
 error1:
-	bo_free(&img->bo);
+	free(chunks);
 error0:
-	free(img);
-	return NULL;
+	return ret < 0 ? -1 : 0;
 }
 
-static void
-emit(struct cmdbuf *cmd, uint32_t val)
+/*
+Submit the streams of all destinations that have finished recording,
+in groups of at most SUBMIT_MAX. Those that couldn't be submitted stay
+pending for the next flush.
+*/
+static int
+submit_pending(struct context *ctx)
 {
-	assert(cmd->len < cmd->cap);
-	cmd->buf[cmd->len++] = val;
-}
+	size_t i;
 
-static void
-emit_array(struct cmdbuf *cmd, size_t len, const uint32_t *val)
-{
-	assert(cmd->len + len <= cmd->cap);
-	memcpy(&cmd->buf[cmd->len], val, len * sizeof(val[0]));
-	cmd->len += len;
+	if (ctx->pending_len == 0)
+		return 0;
+	/* SDMA and compute commands that the streams depend on go first */
+	for (i = 0; i < LEN(ctx->queue); ++i) {
+		if (ctx->queue_needed[i] > ctx->queue[i].submits && submit_queue(ctx, i) < 0)
+			return -1;
+	}
+	while (ctx->pending_len > 0) {
+		if (submit_draws(ctx, ctx->pending_len < SUBMIT_MAX ? ctx->pending_len : SUBMIT_MAX) < 0)
+			return -1;
+	}
+	/* the BO list of the batch is shared by its submissions */
+	ctx->list_len = ctx->list_base;
+	++ctx->batch;
+	return 0;
 }
 
-static void
-set_context_reg_idx(struct cmdbuf *cmd, uint32_t reg, int idx, uint32_t val)
+static int
+flush(struct blt_context *ctx_base)
 {
-	emit(cmd, PKT3(PKT3_SET_CONTEXT_REG, 1, 0));
-	emit(cmd, (reg - SI_CONTEXT_REG_OFFSET) >> 2 | idx << 28);
-	emit(cmd, val);
-}
+	struct context *ctx = (void *)ctx_base;
+	struct image *dst = (void *)ctx->base.dst;
 
-static void
-set_context_reg(struct cmdbuf *cmd, uint32_t reg, uint32_t val)
-{
-	set_context_reg_idx(cmd, reg, 0, val);
+	if (dst && dst->draw->recording && end(ctx) < 0)
+		return -1;
+	if (submit_queue(ctx, QUEUE_SDMA) < 0 || submit_queue(ctx, QUEUE_COMPUTE) < 0)
+		return -1;
+	return submit_pending(ctx);
 }
 
-static void
-set_context_reg_seq(struct cmdbuf *cmd, uint32_t reg, int len, uint32_t *val)
+static int
+image_write(struct blt_context *ctx_base, struct blt_image *img_base, const struct blt_rect *rect, const void *data, size_t stride)
 {
-	emit(cmd, PKT3(PKT3_SET_CONTEXT_REG, len, 0));
-	emit(cmd, (reg - SI_CONTEXT_REG_OFFSET) >> 2);
-	for (; len; --len, ++val)
-		emit(cmd, *val);
+	struct context *ctx = (void *)ctx_base;
+	struct image *img = (void *)img_base;
+	struct chunk *c;
+	const char *src;
+	char *dst;
+	size_t len, pitch;
+	int y, w, h;
+
+	/* SDMA doesn't update DCC, and rendering that hasn't been submitted may use img */
+	if (resolve_dcc(ctx, img) < 0)
+		return -1;
+	if (img->batch == ctx->batch && flush(ctx_base) < 0)
+		return -1;
+	w = rect->x1 - rect->x0;
+	h = rect->y1 - rect->y0;
+	len = img->fmt->size * w;
+	pitch = ALIGN_UP(len, 256);
+	if (sdma_reserve(ctx, 14) < 0 || queue_use_image(ctx, QUEUE_SDMA, img) < 0)
+		return -1;
+	c = sdma_staging(ctx, pitch * h / 4);
+	if (!c)
+		return -1;
+	for (src = data, dst = (char *)c->buf, y = 0; y < h; ++y, src += stride, dst += pitch)
+		memcpy(dst, src, len);
+	if (img->swizzle == 0) {
+		/* linear images take the sub-window copy between linear ones */
+		emit_array(&ctx->queue[QUEUE_SDMA].cmd, 13, (uint32_t[]){
+			CIK_SDMA_PACKET(CIK_SDMA_OPCODE_COPY, CIK_SDMA_COPY_SUB_OPCODE_LINEAR_SUB_WINDOW, 0) | (ffs(img->fmt->size) - 1) << 29,
+			c->bo.addr,
+			c->bo.addr >> 32,
+			0,
+			(pitch / img->fmt->size - 1) << 13,
+			pitch / img->fmt->size * h - 1,
+			img->bo.addr,
+			img->bo.addr >> 32,
+			rect->x0 | rect->y0 << 16,
+			(img->stride / img->fmt->size - 1) << 13,
+			img->stride / img->fmt->size * img->base.height - 1,
+			(w - 1) | (h - 1) << 16,
+			0,
+		});
+		return 0;
+	}
+	emit_array(&ctx->queue[QUEUE_SDMA].cmd, 14, (uint32_t[]){
+		CIK_SDMA_PACKET(CIK_SDMA_OPCODE_COPY, CIK_SDMA_COPY_SUB_OPCODE_TILED_SUB_WINDOW, 0),
+		img->bo.addr,
+		img->bo.addr >> 32,
+		rect->x0 | rect->y0 << 16,
+		(img->stride / img->fmt->size - 1) << 16,
+		img->base.height - 1,
+		sdma_info(img),
+		c->bo.addr,
+		c->bo.addr >> 32,
+		0,
+		(pitch / img->fmt->size - 1) << 16,
+		pitch / img->fmt->size * h - 1,
+		(w - 1) | (h - 1) << 16,
+		0,
+	});
+	return 0;
 }
 
-static void
-set_sh_reg_idx(struct context *ctx, struct cmdbuf *cmd, uint32_t reg, int idx, uint32_t val)
+static uint32_t
+unorm(uint16_t val, int bits)
 {
-	emit(cmd, PKT3(ctx->chip.class >= GFX10 ? PKT3_SET_SH_REG_INDEX : PKT3_SET_SH_REG, 1, 0));
-	emit(cmd, (reg - SI_SH_REG_OFFSET) >> 2 | idx << 28);
-	emit(cmd, val);
+	return ((uint32_t)val * ((1u << bits) - 1) + 32767) / 65535;
 }
 
-static void
-set_sh_reg(struct cmdbuf *cmd, uint32_t reg, uint32_t val)
+/*
+Pack a color as the fill shader writes it, with full alpha, into a
+dword that can be repeated over an image, or return -1 if the format
+has no such dword.
+*/
+static int
+pack_color(const struct format *fmt, struct blt_color c, uint32_t *val)
 {
-	emit(cmd, PKT3(PKT3_SET_SH_REG, 1, 0));
-	emit(cmd, (reg - SI_SH_REG_OFFSET) >> 2);
-	emit(cmd, val);
+	switch (fmt->format) {
+	case BLT_FMT('X', 'R', '2', '4'):
+	case BLT_FMT('A', 'R', '2', '4'):
+		*val = 0xffu << 24 | unorm(c.red, 8) << 16 | unorm(c.green, 8) << 8 | unorm(c.blue, 8);
+		return 0;
+	case BLT_FMT('R', 'G', '1', '6'):
+		*val = unorm(c.red, 5) << 11 | unorm(c.green, 6) << 5 | unorm(c.blue, 5);
+		*val |= *val << 16;
+		return 0;
+	case BLT_FMT('A', '8', ' ', ' '):
+		*val = 0xffffffff;
+		return 0;
+	case BLT_FMT('X', 'R', '3', '0'):
+	case BLT_FMT('A', 'R', '3', '0'):
+		*val = 3u << 30 | unorm(c.red, 10) << 20 | unorm(c.green, 10) << 10 | unorm(c.blue, 10);
+		return 0;
+	}
+	return -1;
 }
 
-static void
-set_sh_reg_seq(struct cmdbuf *cmd, uint32_t reg, int len, uint32_t *val)
+/*
+Copies of rectangles this large on average, in pixels, go to the SDMA
+engine, which moves memory at full bandwidth but has a large cost per
+rectangle. Smaller ones are dispatched on the compute ring.
+*/
+#define SDMA_COPY_MIN (256 * 256)
+
+/*
+Do the rectangles with the SDMA engine or compute kernels instead, if
+they fill dst with a color or copy between images without
+transformation, and no earlier rendering in the batch uses dst or
+renders to the source, since the queues run before it. Then
+rendering that follows only needs to wait for the submission of that
+queue. Returns 1 if the rectangles were done and 0 if they must be
+drawn.
+*/
+static int
+rect_async(struct context *ctx, size_t len, const struct blt_rect *rect)
 {
-	emit(cmd, PKT3(PKT3_SET_SH_REG, len, 0));
-	emit(cmd, (reg - SI_SH_REG_OFFSET) >> 2);
-	for (; len; --len, ++val)
-		emit(cmd, *val);
+	struct image *dst = (void *)ctx->base.dst, *src;
+	const struct blt_transform *t = &ctx->base.transform;
+	struct blt_solid *solid;
+	struct blt_rect d, r;
+	uint32_t val;
+	size_t i;
+	long area;
+	int q, sdma;
+
+	/* the stream of dst must not have drawn or waited for a fence yet */
+	if (ctx->base.op != BLT_OP_SRC || !ctx->base.src || dst->draw->vert.chunk_len > 0 || dst->draw->wait_len > 0 || len == 0)
+		return 0;
+	/* nor may earlier streams in the batch have drawn to or sampled it */
+	if (dst->drawn == ctx->batch || dst->sampled == ctx->batch)
+		return 0;
+	if (ctx->base.src->impl == &blt_solid_image_impl) {
+		solid = (void *)ctx->base.src;
+		if (pack_color(dst->fmt, solid->color, &val) < 0)
+			return 0;
+		/* the image is tiled, so SDMA can only fill all of it */
+		if (len == 1 && rect->x0 + ctx->base.dst_x <= 0 && rect->y0 + ctx->base.dst_y <= 0 &&
+		    rect->x1 + ctx->base.dst_x >= dst->base.width && rect->y1 + ctx->base.dst_y >= dst->base.height)
+		{
+			q = QUEUE_SDMA;
+			if (reserve(ctx, &dst->draw->cmd, 8) < 0 || sdma_fill(ctx, dst, val) < 0)
+				return -1;
+			/* every pixel is written, so the fast clear in the DCC is void */
+			if (dst->dcc) {
+				dst->dcc = 0;
+				set_context_reg(&dst->draw->cmd, R_028C70_CB_COLOR0_INFO, cb_info(dst));
+				set_context_reg(&dst->draw->cmd, R_028EE0_CB_COLOR0_ATTRIB3, cb_attrib3(dst));
+			}
+		} else {
+			/* compute doesn't update DCC, so CB must draw the rectangles */
+			if (dst->dcc)
+				return 0;
+			q = QUEUE_COMPUTE;
+			if (compute_use(ctx, dst, NULL) < 0)
+				return -1;
+			for (i = 0; i < len; ++i) {
+				d = (struct blt_rect){
+					rect[i].x0 + ctx->base.dst_x, rect[i].y0 + ctx->base.dst_y,
+					rect[i].x1 + ctx->base.dst_x, rect[i].y1 + ctx->base.dst_y,
+				};
+				/* clip to dst, as the scissor does when drawing */
+				if (d.x0 < 0)
+					d.x0 = 0;
+				if (d.y0 < 0)
+					d.y0 = 0;
+				if (d.x1 > dst->base.width)
+					d.x1 = dst->base.width;
+				if (d.y1 > dst->base.height)
+					d.y1 = dst->base.height;
+				if (d.x1 <= d.x0 || d.y1 <= d.y0)
+					continue;
+				if (dispatch(ctx, &ctx->shader.fillcs, &fillcs_info, 9, (uint32_t[]){
+					dst->raw[0], dst->raw[1], dst->raw[2], dst->raw[3],
+					val, d.x0, d.y0, d.x1, d.y1,
+				}, &d) < 0)
+					return -1;
+			}
+		}
+	} else if (ctx->base.src->impl == &image_impl) {
+		src = (void *)ctx->base.src;
+		/* sources have no DCC once bound, but dst may */
+		if (src == dst || dst->dcc || src->drawn == ctx->batch || src->fmt != dst->fmt || ctx->base.filter != BLT_FILTER_NEAREST ||
+		    t->xx != 1 || t->xy != 0 || t->x0 != 0 || t->yx != 0 || t->yy != 1 || t->y0 != 0)
+			return 0;
+		area = 0;
+		sdma = 1;
+		for (i = 0; i < len; ++i) {
+			d = (struct blt_rect){
+				rect[i].x0 + ctx->base.dst_x, rect[i].y0 + ctx->base.dst_y,
+				rect[i].x1 + ctx->base.dst_x, rect[i].y1 + ctx->base.dst_y,
+			};
+			r = (struct blt_rect){
+				rect[i].x0 + ctx->base.src_x, rect[i].y0 + ctx->base.src_y,
+				rect[i].x1 + ctx->base.src_x, rect[i].y1 + ctx->base.src_y,
+			};
+			if (d.x0 < 0 || d.y0 < 0 || d.x1 > dst->base.width || d.y1 > dst->base.height ||
+			    r.x0 < 0 || r.y0 < 0 || r.x1 > src->base.width || r.y1 > src->base.height)
+				return 0;
+			if (d.x1 > d.x0 && d.y1 > d.y0) {
+				area += (long)(d.x1 - d.x0) * (d.y1 - d.y0);
+				if (!sdma_can_copy(dst, d.x0, d.y0, src, r.x0, r.y0, d.x1 - d.x0, d.y1 - d.y0))
+					sdma = 0;
+			}
+		}
+		/* the rest go to compute, which can copy between any layouts */
+		q = sdma && area / len >= SDMA_COPY_MIN ? QUEUE_SDMA : QUEUE_COMPUTE;
+		if (q == QUEUE_COMPUTE && compute_use(ctx, dst, src) < 0)
+			return -1;
+		for (i = 0; i < len; ++i) {
+			if (rect[i].x1 <= rect[i].x0 || rect[i].y1 <= rect[i].y0)
+				continue;
+			if (q == QUEUE_SDMA) {
+				if (sdma_copy(ctx, dst, rect[i].x0 + ctx->base.dst_x, rect[i].y0 + ctx->base.dst_y,
+				              src, rect[i].x0 + ctx->base.src_x, rect[i].y0 + ctx->base.src_y,
+				              rect[i].x1 - rect[i].x0, rect[i].y1 - rect[i].y0) < 0)
+					return -1;
+				continue;
+			}
+			d = (struct blt_rect){
+				rect[i].x0 + ctx->base.dst_x, rect[i].y0 + ctx->base.dst_y,
+				rect[i].x1 + ctx->base.dst_x, rect[i].y1 + ctx->base.dst_y,
+			};
+			if (dispatch(ctx, &ctx->shader.copycs, &copycs_info, 14, (uint32_t[]){
+				dst->raw[0], dst->raw[1], dst->raw[2], dst->raw[3],
+				src->raw[0], src->raw[1], src->raw[2], src->raw[3],
+				d.x0, d.y0, d.x1, d.y1,
+				ctx->base.src_x - ctx->base.dst_x, ctx->base.src_y - ctx->base.dst_y,
+			}, &d) < 0)
+				return -1;
+		}
+	} else {
+		return 0;
+	}
+	/* the stream of dst has already listed it, so make it wait here */
+	ctx->queue_needed[q] = ctx->queue[q].submits + 1;
+	return 1;
 }
 
-static void
-set_uconfig_reg_idx(struct context *ctx, struct cmdbuf *cmd, uint32_t reg, int idx, uint32_t val)
+/*
+DCC is read and written in independent 64 byte blocks, and 256 bytes of
+pixels compress to one such block at best.
+*/
+#define DCC_CONTROL ( \
+	S_028C78_MAX_UNCOMPRESSED_BLOCK_SIZE(V_028C78_MAX_BLOCK_SIZE_256B) | \
+	S_028C78_MIN_COMPRESSED_BLOCK_SIZE(V_028C78_MIN_BLOCK_SIZE_32B) | \
+	S_028C78_MAX_COMPRESSED_BLOCK_SIZE(V_028C78_MAX_BLOCK_SIZE_64B) | \
+	S_028C78_INDEPENDENT_64B_BLOCKS(1))
+
+/* gfx10 CB_COLOR0_INFO of dst, with DCC enabled once it is fast cleared */
+static uint32_t
+cb_info(struct image *dst)
 {
-	emit(cmd, PKT3(ctx->chip.class >= GFX10 ? PKT3_SET_UCONFIG_REG_INDEX : PKT3_SET_UCONFIG_REG, 1, 0));
-	emit(cmd, (reg - CIK_UCONFIG_REG_OFFSET) >> 2 | idx << 28);
-	emit(cmd, val);
+	return S_028C70_FORMAT(dst->fmt->cb_format) |
+	       S_028C70_NUMBER_TYPE(dst->fmt->cb_number_type) |
+	       S_028C70_COMP_SWAP(dst->fmt->cb_swap) |
+	       S_028C70_BLEND_CLAMP(dst->fmt->cb_number_type == V_028C70_NUMBER_UNORM) |
+	       S_028C70_SIMPLE_FLOAT(1) |
+	       S_028C70_DCC_ENABLE(dst->dcc);
 }
 
-static void
-set_uconfig_reg(struct context *ctx, struct cmdbuf *cmd, uint32_t reg, uint32_t val)
+static uint32_t
+cb_attrib3(struct image *dst)
 {
-	emit(cmd, PKT3(PKT3_SET_UCONFIG_REG, 1, 0));
-	emit(cmd, (reg - CIK_UCONFIG_REG_OFFSET) >> 2);
-	emit(cmd, val);
+	return S_028EE0_COLOR_SW_MODE(dst->swizzle) |
+	       S_028EE0_FMASK_SW_MODE(20) |
+	       S_028EE0_RESOURCE_TYPE(1) |
+	       S_028EE0_RESOURCE_LEVEL(1) |
+	       S_028EE0_DCC_PIPE_ALIGNED(dst->dcc);
 }
 
+/*
+Clear all of dst to black or white by writing the DCC clear code for
+the color over its metadata, instead of drawing the pixels. Returns 1
+if dst was cleared and 0 if the rectangles must be drawn.
+*/
 static int
-draw(struct context *ctx)
+fast_clear(struct context *ctx, size_t len, const struct blt_rect *rect)
 {
 	struct image *dst = (void *)ctx->base.dst;
 	struct cmdbuf *cmd = &dst->draw->cmd;
+	struct vertbuf *vert = &dst->draw->vert;
+	struct blt_solid *solid;
+	struct blt_color c;
+	uint64_t addr, size, n;
+	uint32_t code;
 
-	if (0) {
-		set_context_reg_idx(cmd, R_028AA8_IA_MULTI_VGT_PARAM, 1,
-			S_028AA8_PRIMGROUP_SIZE(127) |
-			S_028AA8_WD_SWITCH_ON_EOP(1) |
-			S_028AA8_MAX_PRIMGRP_IN_WAVE(2));
-	}
-	if (ctx->chip.class >= GFX9)
-		set_uconfig_reg(ctx, cmd, R_03092C_VGT_MULTI_PRIM_IB_RESET_EN, 0);
+	if (!dst->dcc_size || ctx->base.op != BLT_OP_SRC || !ctx->base.src || ctx->base.src->impl != &blt_solid_image_impl || len != 1)
+		return 0;
+	if (rect->x0 + ctx->base.dst_x > 0 || rect->y0 + ctx->base.dst_y > 0 ||
+	    rect->x1 + ctx->base.dst_x < dst->base.width || rect->y1 + ctx->base.dst_y < dst->base.height)
+		return 0;
+	solid = (void *)ctx->base.src;
+	c = solid->color;
+	/* the fill shader writes full alpha, which is the top component of these formats */
+	if (c.red == 0 && c.green == 0 && c.blue == 0)
+		code = 0x40; /* 0001 */
+	else if (c.red == 0xffff && c.green == 0xffff && c.blue == 0xffff)
+		code = 0xc0; /* 1111 */
 	else
-		set_context_reg(cmd, R_028A94_VGT_MULTI_PRIM_IB_RESET_EN, 0);
-	set_sh_reg_seq(cmd, R_00B13C_SPI_SHADER_USER_DATA_VS_3, 5, (uint32_t[]){
-		(dst->draw->vert.pos - 4) / 2,
-		ftou(ctx->base.dst_x),
-		ftou(ctx->base.dst_y),
-		ftou(ctx->base.src_x),
-		ftou(ctx->base.src_y),
-	});
-	emit(cmd, PKT3(PKT3_NUM_INSTANCES, 0, 0));
-	emit(cmd, 1);
-	emit(cmd, PKT3(PKT3_DRAW_INDEX_AUTO, 1, 0));
-	emit(cmd, (dst->draw->vert.len - dst->draw->vert.pos) / 2); /* vertex count */
-	emit(cmd, V_0287F0_DI_SRC_SEL_AUTO_INDEX | S_0287F0_USE_OPAQUE(0));
-	dst->draw->vert.pos = dst->draw->vert.len;
-
-	return 0;
+		return 0;
+	/* the rectangles queued so far are covered, and those drawn must land first */
+	vert->pos = vert->len;
+	size = dst->dcc_size;
+	if (reserve(ctx, cmd, 32 + (size / 0x1ff000 + 1) * 7) < 0)
+		return -1;
+	if (vert->chunk_len > 0)
+		barrier(ctx, cmd, FLUSH_CB);
+	for (addr = dst->bo.addr + dst->dcc_offset; size > 0; size -= n, addr += n) {
+		n = size < 0x1ff000 ? size : 0x1ff000;
+		emit_array(cmd, 7, (uint32_t[]){
+			PKT3(PKT3_DMA_DATA, 5, 0),
+			S_411_SRC_SEL(V_411_DATA) | S_411_DST_SEL(V_411_DST_ADDR_TC_L2) | S_411_CP_SYNC(1),
+			code * 0x01010101,
+			0,
+			addr,
+			addr >> 32,
+			S_414_BYTE_COUNT_GFX9(n),
+		});
+	}
+	dst->dcc = 1;
+	set_context_reg(cmd, R_028C70_CB_COLOR0_INFO, cb_info(dst));
+	set_context_reg(cmd, R_028EE0_CB_COLOR0_ATTRIB3, cb_attrib3(dst));
+	return 1;
 }
 
-static int
-submit(struct context *ctx)
+/*
+Bind the pixel shader that samples src with the given transform and filter.
+*/
+static void
+bind_image(struct context *ctx, struct cmdbuf *cmd, struct image *src, const struct blt_transform *t, int filter)
 {
-	struct image *dst = (void *)ctx->base.dst;
-	struct cmdbuf *cmd = &dst->draw->cmd;
-	amdgpu_bo_list_handle resources;
-	int ret;
-
-	draw(ctx);
-
-	while (cmd->len % 8)
-		emit(cmd, 0xffff1000);
-
-	ret = amdgpu_bo_list_create(ctx->dev, 6, (amdgpu_bo_handle[]){
-		cmd->bo.handle,
-		dst->draw->vert.bo.handle,
-		ctx->shader.vert.handle,
-		ctx->shader.fill.handle,
-		ctx->init.bo.handle,
-		dst->bo.handle,
-	}, NULL, &resources);
-	if (ret < 0)
-		return ret;
-	ret = amdgpu_cs_submit(ctx->cs, 0, &(struct amdgpu_cs_request){
-		.ip_type = AMDGPU_HW_IP_GFX,
-		.ring = 0,
-		.resources = resources,
-		.number_of_dependencies = 0,
-		.dependencies = NULL,
-		.number_of_ibs = 1,
-		.ibs = &(struct amdgpu_cs_ib_info){
-			.ib_mc_address = cmd->bo.addr,
-			.size = cmd->len,
-		},
-	}, 1);
-	if (ret < 0)
-		return ret;
-
-	return 0;
+	const struct shader_info *info;
+	struct bo *shader;
+
+	set_sh_reg_seq(cmd, R_00B030_SPI_SHADER_USER_DATA_PS_0, 4, src->desc);
+	if (filter == BLT_FILTER_BOX) {
+		/* the shader takes a 4x4 grid of samples over each dst pixel */
+		set_sh_reg_seq(cmd, R_00B040_SPI_SHADER_USER_DATA_PS_4, 4, (uint32_t[]){
+			ftou(t->xx / 4),
+			ftou(t->yx / 4),
+			ftou(t->xy / 4),
+			ftou(t->yy / 4),
+		});
+		shader = &ctx->shader.box;
+		info = &box_info;
+	} else {
+		set_sh_reg(cmd, R_00B040_SPI_SHADER_USER_DATA_PS_4,
+			filter == BLT_FILTER_BILINEAR ? S_008F38_XY_MAG_FILTER(V_008F38_SQ_TEX_XY_FILTER_BILINEAR) | S_008F38_XY_MIN_FILTER(V_008F38_SQ_TEX_XY_FILTER_BILINEAR) : 0);
+		shader = &ctx->shader.copy;
+		info = &copy_info;
+	}
+	set_sh_reg_seq(cmd, R_00B020_SPI_SHADER_PGM_LO_PS, 4, (uint32_t[]){
+		shader->addr >> 8,
+		S_00B024_MEM_BASE(shader->addr >> 40),
+		info->rsrc1 | S_00B028_FLOAT_MODE(V_00B028_FP_64_DENORMS) | S_00B028_DX10_CLAMP(1) | S_00B028_MEM_ORDERED(ctx->chip.class >= GFX10),
+		info->rsrc2,
+	});
 }
 
 static int
@@ -669,8 +2861,12 @@ setup(struct blt_context *ctx_base, int op, struct blt_image *dst_base, struct b
 
 	if (mask)
 		return -1;
-	if (ctx->base.dst && dst_base != ctx->base.dst)
-		submit(ctx);
+	/* sampling doesn't read DCC */
+	if (src_base && src_base->impl == &image_impl && resolve_dcc(ctx, (void *)src_base) < 0)
+		return -1;
+	dst = (void *)ctx->base.dst;
+	if (dst && dst_base != &dst->base && dst->draw->recording && end(ctx) < 0)
+		return -1;
 	if (!dst_base)
 		return 0;
 	if (dst_base->impl != &image_impl)
@@ -678,69 +2874,35 @@ setup(struct blt_context *ctx_base, int op, struct blt_image *dst_base, struct b
 	dst = (void *)dst_base;
 	if (!dst->draw)
 		return -1;
+	/* its last stream must be submitted before recording another */
+	if (dst->draw->pending && submit_pending(ctx) < 0)
+		return -1;
 	cmd = &dst->draw->cmd;
+	/* enough for the state of a new destination and source */
+	if (reserve(ctx, cmd, 1024) < 0)
+		return -1;
 
-	if (dst_base != ctx->base.dst) {
+	if (!dst->draw->recording) {
 		ctx->base.src = NULL;
 
+		if (wait_image(dst->draw, dst) < 0 || add_image(ctx, dst) < 0)
+			return -1;
+		dst->draw->recording = 1;
+
 		/* radv_init_graphics_state */
 		emit(cmd, PKT3(PKT3_INDIRECT_BUFFER_CIK, 2, 0));
-		emit(cmd, ctx->init.bo.addr);
-		emit(cmd, ctx->init.bo.addr >> 32);
-		emit(cmd, ctx->init.len);
-
-		/* si_cs_emit_cache_flush */
-		emit(cmd, PKT3(PKT3_EVENT_WRITE, 0, 0));
-		emit(cmd, EVENT_TYPE(V_028A90_PS_PARTIAL_FLUSH) | EVENT_INDEX(4));
-		emit(cmd, PKT3(PKT3_EVENT_WRITE, 0, 0));
-		emit(cmd, EVENT_TYPE(V_028A90_CS_PARTIAL_FLUSH) | EVENT_INDEX(4));
+		emit(cmd, ctx->init->bo.addr);
+		emit(cmd, ctx->init->bo.addr >> 32);
+		emit(cmd, ctx->init_len);
+		*cmd->shadow = ctx->init_shadow;
 
-		if (0) {
-			emit(cmd, PKT3(PKT3_PFP_SYNC_ME, 0, 0));
-			emit(cmd, 0);
-		}
-
-		/* si_emit_acquire_mem */
-		if (1) {
-			emit_array(cmd, 8, (uint32_t[]){
-				PKT3(PKT3_ACQUIRE_MEM, 6, 0) | PKT3_SHADER_TYPE_S(0),
-				S_0301F0_TC_WB_ACTION_ENA(0) |
-				S_0085F0_TCL1_ACTION_ENA(0) |
-				S_0085F0_TC_ACTION_ENA(0) |
-				S_0085F0_SH_KCACHE_ACTION_ENA(0) |
-				S_0085F0_SH_ICACHE_ACTION_ENA(0),
-				0xffffffff,
-				0x00ffffff,
-				0,
-				0,
-				10,
-				S_586_GLI_INV(V_586_GLI_ALL) |
-				S_586_GL1_INV(1) |
-				S_586_GLK_INV(1) |
-				S_586_GL2_INV(1) |
-				S_586_GL2_WB(1) |
-				S_586_GLM_INV(1) |
-				S_586_GLM_WB(1) |
-				S_586_GLV_INV(1),
-			});
-		} else {
-			emit(cmd, PKT3(PKT3_SURFACE_SYNC, 3, 0));
-			emit(cmd,
-			     S_0301F0_TC_WB_ACTION_ENA(1) |
-			     S_0085F0_TCL1_ACTION_ENA(1) |
-			     S_0085F0_TC_ACTION_ENA(1) |
-			     S_0085F0_SH_KCACHE_ACTION_ENA(1) |
-			     S_0085F0_SH_ICACHE_ACTION_ENA(1));
-			emit(cmd, 0xffffffff); /* CP_COHER_SIZE */
-			emit(cmd, 0x00000000); /* CP_COHER_BASE */
-			emit(cmd, 0x0000000a); /* POLL_INTERVAL */
-		}
+		/* earlier streams in the batch may still be sampling dst */
+		if (dst->read == ctx->waits)
+			barrier(ctx, cmd, WAIT_PS);
 
 		emit(cmd, PKT3(PKT3_EVENT_WRITE, 0, 0));
 		emit(cmd, EVENT_TYPE(V_028A90_PIPELINESTAT_START) | EVENT_INDEX(0));
 
-		set_sh_reg(cmd, R_00B138_SPI_SHADER_USER_DATA_VS_2, dst->draw->vert.bo.addr);
-
 		/* radv_update_multisample_state */
 		set_context_reg_seq(cmd, R_028BDC_PA_SC_LINE_CNTL, 2, (uint32_t[]){S_028BDC_DX10_DIAMOND_TEST_ENA(1), 0});
 		set_context_reg(cmd, R_028A48_PA_SC_MODE_CNTL_0,
@@ -781,23 +2943,23 @@ setup(struct blt_context *ctx_base, int op, struct blt_image *dst_base, struct b
 				0,
 				0,
 				0,
-				S_028C70_FORMAT(V_028C70_COLOR_8_8_8_8) | S_028C70_COMP_SWAP(1) | S_028C70_BLEND_CLAMP(1) | S_028C70_SIMPLE_FLOAT(1),
-				0,
+				cb_info(dst),
 				0,
+				dst->dcc_size ? DCC_CONTROL : 0,
 				dst->bo.addr >> 8,
 				0,
 				dst->bo.addr >> 8,
 				0,
 			});
 			set_context_reg_seq(cmd, R_028C94_CB_COLOR0_DCC_BASE, 1, (uint32_t[]){
-				dst->bo.addr >> 8,
+				(dst->bo.addr + dst->dcc_offset) >> 8,
 			});
 			set_context_reg(cmd, R_028E40_CB_COLOR0_BASE_EXT, dst->bo.addr >> 40);
 			set_context_reg(cmd, R_028E60_CB_COLOR0_CMASK_BASE_EXT, dst->bo.addr >> 40);
 			set_context_reg(cmd, R_028E80_CB_COLOR0_FMASK_BASE_EXT, dst->bo.addr >> 40);
-			set_context_reg(cmd, R_028EA0_CB_COLOR0_DCC_BASE_EXT, dst->bo.addr >> 40);
+			set_context_reg(cmd, R_028EA0_CB_COLOR0_DCC_BASE_EXT, (dst->bo.addr + dst->dcc_offset) >> 40);
 			set_context_reg(cmd, R_028EC0_CB_COLOR0_ATTRIB2, S_028EC0_MIP0_WIDTH(dst->base.width - 1) | S_028EC0_MIP0_HEIGHT(dst->base.height - 1));
-			set_context_reg(cmd, R_028EE0_CB_COLOR0_ATTRIB3, S_028EE0_COLOR_SW_MODE(dst->swizzle) | S_028EE0_FMASK_SW_MODE(20) | S_028EE0_RESOURCE_TYPE(1) | S_028EE0_RESOURCE_LEVEL(1));
+			set_context_reg(cmd, R_028EE0_CB_COLOR0_ATTRIB3, cb_attrib3(dst));
 		} else {
 			set_context_reg_seq(cmd, R_028C60_CB_COLOR0_BASE, 11, (uint32_t[]){
 				dst->bo.addr >> 8,
@@ -808,13 +2970,13 @@ setup(struct blt_context *ctx_base, int op, struct blt_image *dst_base, struct b
 
 				0,//S_028C6C_SLICE_START(0) | S_028C6C_SLICE_MAX(0),
 
-				S_028C70_FORMAT(V_028C70_COLOR_8_8_8_8) |
+				S_028C70_FORMAT(dst->fmt->cb_format) |
 				S_028C70_LINEAR_GENERAL(0) |
-				S_028C70_NUMBER_TYPE(V_028C70_NUMBER_UNORM) |
-				S_028C70_COMP_SWAP(V_028C70_SWAP_ALT) |
+				S_028C70_NUMBER_TYPE(dst->fmt->cb_number_type) |
+				S_028C70_COMP_SWAP(dst->fmt->cb_swap) |
 				S_028C70_FAST_CLEAR(0) |
 				S_028C70_COMPRESSION(0) |
-				S_028C70_BLEND_CLAMP(1) |
+				S_028C70_BLEND_CLAMP(dst->fmt->cb_number_type == V_028C70_NUMBER_UNORM) |
 				S_028C70_BLEND_BYPASS(0) |
 				S_028C70_SIMPLE_FLOAT(1) |
 				S_028C70_ROUND_MODE(0) |
@@ -843,7 +3005,7 @@ setup(struct blt_context *ctx_base, int op, struct blt_image *dst_base, struct b
 			set_context_reg(cmd, R_028C94_CB_COLOR0_DCC_BASE, dst->bo.addr >> 8);
 		}
 
-		emit_array(cmd, LEN(pipeline), pipeline);
+		emit_regs(cmd, LEN(pipeline), pipeline);
 
 		set_context_reg(cmd, R_028CAC_CB_COLOR1_INFO, S_028C70_FORMAT(V_028C70_COLOR_INVALID));
 		set_context_reg(cmd, R_028CE8_CB_COLOR2_INFO, S_028C70_FORMAT(V_028C70_COLOR_INVALID));
@@ -886,18 +3048,19 @@ setup(struct blt_context *ctx_base, int op, struct blt_image *dst_base, struct b
 		});
 	}
 	if (src_base != ctx->base.src) {
-		if (ctx->base.dst)
-			draw(ctx);
+		if (ctx->base.dst && draw(ctx) < 0)
+			return -1;
 		if (src_base->impl == &image_impl) {
 			struct image *src = (void *)src_base;
 
-			set_sh_reg_seq(cmd, R_00B030_SPI_SHADER_USER_DATA_PS_0, 4, src->desc);
-			set_sh_reg_seq(cmd, R_00B020_SPI_SHADER_PGM_LO_PS, 4, (uint32_t[]){
-				ctx->shader.copy.addr >> 8,
-				S_00B024_MEM_BASE(ctx->shader.copy.addr >> 40),
-				copy_info.rsrc1 | S_00B028_FLOAT_MODE(V_00B028_FP_64_DENORMS) | S_00B028_DX10_CLAMP(1) | S_00B028_MEM_ORDERED(ctx->chip.class >= GFX10),
-				copy_info.rsrc2,
-			});
+			if (wait_image(dst->draw, src) < 0 || add_image(ctx, src) < 0)
+				return -1;
+			/* an earlier stream in the batch rendered to src */
+			if (src->written == ctx->flushes)
+				barrier(ctx, cmd, FLUSH_CB);
+			src->read = ctx->waits;
+			src->sampled = ctx->batch;
+			bind_image(ctx, cmd, src, &ctx->base.transform, ctx->base.filter);
 		} else if (src_base->impl == &blt_solid_image_impl) {
 			struct blt_solid *src = (void *)src_base;
 
@@ -919,14 +3082,47 @@ setup(struct blt_context *ctx_base, int op, struct blt_image *dst_base, struct b
 	return 0;
 }
 
+static int
+set_transform(struct blt_context *ctx_base, const struct blt_transform *transform, int filter)
+{
+	struct context *ctx = (void *)ctx_base;
+	struct image *dst = (void *)ctx->base.dst;
+
+	/* the next stream binds the transform when it starts */
+	if (!dst || !dst->draw->recording)
+		return 0;
+	if (draw(ctx) < 0 || reserve(ctx, &dst->draw->cmd, 32) < 0)
+		return -1;
+	if (ctx->base.src && ctx->base.src->impl == &image_impl)
+		bind_image(ctx, &dst->draw->cmd, (void *)ctx->base.src, transform, filter);
+
+	return 0;
+}
+
 static int
 rect(struct blt_context *ctx_base, size_t len, const struct blt_rect *rect)
 {
 	struct context *ctx = (void *)ctx_base;
 	struct image *dst = (void *)ctx->base.dst;
 	struct vertbuf *vert = &dst->draw->vert;
+	struct blt_image *src;
+	int ret;
 
-	for (; len; --len) {
+	/* blt_flush ended the stream of dst, so start another */
+	if (!dst->draw->recording) {
+		src = ctx->base.src;
+		if (setup(ctx_base, ctx->base.op, &dst->base, src, NULL) < 0)
+			return -1;
+		ctx->base.src = src;
+	}
+	ret = fast_clear(ctx, len, rect);
+	if (ret == 0)
+		ret = rect_async(ctx, len, rect);
+	if (ret != 0)
+		return ret < 0 ? -1 : 0;
+	for (; len; --len, ++rect) {
+		if (vert->len + 6 > vert->cap && next_vertbuf(ctx) < 0)
+			return -1;
 		vert->buf[vert->len++] = rect->x0;
 		vert->buf[vert->len++] = rect->y0;
 		vert->buf[vert->len++] = rect->x0;
@@ -943,7 +3139,9 @@ static const struct blt_context_impl impl = {
 	.new_image = new_image,
 	.new_solid = blt_new_solid_image,
 	.setup = setup,
+	.set_transform = set_transform,
 	.rect = rect,
+	.flush = flush,
 };
 
 /* XXX: figure out what this stuff does and why (if) it's necessary */
@@ -1058,6 +3256,8 @@ struct blt_context *
 blt_amdgpu_new(int fd)
 {
 	struct context *ctx;
+	struct cmdbuf init;
+	size_t i;
 	int ret;
 	uint32_t maj, min;
 	void *map;
@@ -1075,6 +3275,8 @@ blt_amdgpu_new(int fd)
 	ctx->base.dst = NULL;
 	ctx->base.src = NULL;
 	ctx->base.msk = NULL;
+	ctx->base.transform = (struct blt_transform){.xx = 1, .yy = 1};
+	ctx->base.filter = BLT_FILTER_NEAREST;
 	ctx->fd = fd;
 
 	ret = amdgpu_device_initialize(fd, &maj, &min, &ctx->dev);
@@ -1091,7 +3293,8 @@ blt_amdgpu_new(int fd)
 		ctx->chip.class = GFX8;
 		goto error4;
 	case AMDGPU_FAMILY_NV:
-		ctx->chip.class = GFX10;
+		/* Sienna Cichlid and later are gfx10.3 */
+		ctx->chip.class = ctx->info.chip_external_rev >= 0x28 ? GFX10_3 : GFX10;
 		break;
 	default:
 		goto error4;
@@ -1124,17 +3327,90 @@ blt_amdgpu_new(int fd)
 	memcpy(map, copy_code, sizeof(copy_code));
 	amdgpu_bo_cpu_unmap(ctx->shader.copy.handle);
 
-	ret = bo_alloc(ctx, &ctx->init.bo, 0x4000, 0x1000, AMDGPU_GEM_DOMAIN_GTT, AMDGPU_GEM_CREATE_CPU_ACCESS_REQUIRED, 0);
+	ret = bo_alloc(ctx, &ctx->shader.box, ALIGN_UP(sizeof(box_code) + 0xc0, 0x100), 0x100, AMDGPU_GEM_DOMAIN_VRAM, AMDGPU_GEM_CREATE_CPU_ACCESS_REQUIRED, 0);
+	if (ret < 0)
+		goto error4;
+	ret = amdgpu_bo_cpu_map(ctx->shader.box.handle, &map);
+	if (ret < 0)
+		goto error5;
+	memcpy(map, box_code, sizeof(box_code));
+	amdgpu_bo_cpu_unmap(ctx->shader.box.handle);
+
+	ret = bo_alloc(ctx, &ctx->shader.fillcs, ALIGN_UP(sizeof(fillcs_code) + 0xc0, 0x100), 0x100, AMDGPU_GEM_DOMAIN_VRAM, AMDGPU_GEM_CREATE_CPU_ACCESS_REQUIRED, 0);
+	if (ret < 0)
+		goto error4;
+	ret = amdgpu_bo_cpu_map(ctx->shader.fillcs.handle, &map);
+	if (ret < 0)
+		goto error5;
+	memcpy(map, fillcs_code, sizeof(fillcs_code));
+	amdgpu_bo_cpu_unmap(ctx->shader.fillcs.handle);
+
+	ret = bo_alloc(ctx, &ctx->shader.copycs, ALIGN_UP(sizeof(copycs_code) + 0xc0, 0x100), 0x100, AMDGPU_GEM_DOMAIN_VRAM, AMDGPU_GEM_CREATE_CPU_ACCESS_REQUIRED, 0);
 	if (ret < 0)
+		goto error4;
+	ret = amdgpu_bo_cpu_map(ctx->shader.copycs.handle, &map);
+	if (ret < 0)
+		goto error5;
+	memcpy(map, copycs_code, sizeof(copycs_code));
+	amdgpu_bo_cpu_unmap(ctx->shader.copycs.handle);
+
+	ctx->cmd_pool = (struct pool){.ip = AMDGPU_HW_IP_GFX};
+	ctx->vert_pool = (struct pool){.vaflags = AMDGPU_VA_RANGE_32_BIT, .ip = AMDGPU_HW_IP_GFX};
+	ctx->pending = NULL;
+	ctx->pending_len = 0;
+	ctx->pending_cap = 0;
+	ctx->batch = 1;
+	ctx->flushes = 1;
+	ctx->waits = 1;
+	for (i = 0; i < LEN(ctx->queue); ++i) {
+		ctx->queue[i] = (struct queue){.pool = {.ip = i == QUEUE_SDMA ? AMDGPU_HW_IP_DMA : AMDGPU_HW_IP_COMPUTE}, .barriers = 1};
+		ctx->queue[i].cmd.shadow = &ctx->queue[i].shadow;
+		ctx->queue[i].cmd.pool = &ctx->queue[i].pool;
+		ctx->queue_needed[i] = 0;
+		ctx->queue_waited[i] = 0;
+	}
+	ctx->dump = getenv("BLT_DUMP_IB") != NULL;
+	for (i = 0; i < LEN(ctx->slab); ++i)
+		ctx->slab[i] = NULL;
+	ctx->garbage = NULL;
+	ctx->garbage_len = 0;
+	ctx->garbage_cap = 0;
+	/* gfx_init must fit in a single chunk, since it isn't chained */
+	memset(ctx->init_shadow.known, 0, sizeof(ctx->init_shadow.known));
+	init = (struct cmdbuf){.shadow = &ctx->init_shadow, .pool = &ctx->cmd_pool};
+	if (reserve(ctx, &init, 1024) < 0) {
+		ret = -errno;
 		goto error6;
-	ret = amdgpu_bo_cpu_map(ctx->init.bo.handle, &map);
+	}
+	gfx_init(ctx, &init);
+	ctx->init = init.chunk[0];
+	ctx->init_len = init.len;
+	free(init.chunk);
+
+	/* the BOs used by every submission stay at the start of the list */
+	ctx->list_cap = 16;
+	ctx->list = malloc(ctx->list_cap * sizeof(ctx->list[0]));
+	if (!ctx->list) {
+		ret = -errno;
+		goto error6;
+	}
+	ctx->list[0] = (struct drm_amdgpu_bo_list_entry){.bo_handle = ctx->shader.vert.kms};
+	ctx->list[1] = (struct drm_amdgpu_bo_list_entry){.bo_handle = ctx->shader.fill.kms};
+	ctx->list[2] = (struct drm_amdgpu_bo_list_entry){.bo_handle = ctx->shader.copy.kms};
+	ctx->list[3] = (struct drm_amdgpu_bo_list_entry){.bo_handle = ctx->shader.box.kms};
+	ctx->list[4] = (struct drm_amdgpu_bo_list_entry){.bo_handle = ctx->init->bo.kms};
+	ctx->list_len = 5;
+	ctx->list_base = 5;
+
+	/* signalled, so that the first submission to each ring can wait for them */
+	ret = amdgpu_cs_create_syncobj2(ctx->dev, DRM_SYNCOBJ_CREATE_SIGNALED, &ctx->syncobj);
 	if (ret < 0)
 		goto error6;
-	ctx->init.buf = map;
-	ctx->init.len = 0;
-	ctx->init.cap = ctx->init.bo.size / 4;
-	gfx_init(ctx, &ctx->init);
-	amdgpu_bo_cpu_unmap(ctx->init.bo.handle);
+	for (i = 0; i < LEN(ctx->queue); ++i) {
+		ret = amdgpu_cs_create_syncobj2(ctx->dev, DRM_SYNCOBJ_CREATE_SIGNALED, &ctx->queue[i].syncobj);
+		if (ret < 0)
+			goto error6;
+	}
 
 	return &ctx->base;
 
@@ -5,6 +5,10 @@
 ; s5 = dst_y
 ; s6 = src_x
 ; s7 = src_y
+; s8 = src x offset of one dst pixel in x
+; s9 = src y offset of one dst pixel in x
+; s10 = src x offset of one dst pixel in y
+; s11 = src y offset of one dst pixel in y
 vert:
 	v_add_nc_u32 v0, s3, v0
 
@@ -27,8 +31,12 @@ vert:
 	exp pos0 v0, v1, v2, v3 done vm
 
 	; compute src coordinates
-	v_add_f32 v0, s6, v4
-	v_add_f32 v1, s7, v5
+	v_mul_f32 v0, s8, v4
+	v_fmac_f32 v0, s10, v5
+	v_add_f32 v0, s6, v0
+	v_mul_f32 v1, s9, v4
+	v_fmac_f32 v1, s11, v5
+	v_add_f32 v1, s7, v1
 	exp param0 v0, v1, off, off
 
 	s_endpgm
@@ -1,3 +1,4 @@
+#include <errno.h>
 #include <pixman.h>
 #include "blt.h"
 #include "priv.h"
@@ -8,10 +9,26 @@ blt_destroy(struct blt_context *ctx)
 	ctx->impl->destroy(ctx);
 }
 
+struct blt_context *
+blt_new_stream(struct blt_context *ctx)
+{
+	if (!ctx->impl->new_stream) {
+		errno = ENOTSUP;
+		return NULL;
+	}
+	return ctx->impl->new_stream(ctx);
+}
+
 struct blt_image *
 blt_new_image(struct blt_context *ctx, int width, int height, uint32_t format, int flags)
 {
-	return ctx->impl->new_image(ctx, width, height, format, flags);
+	return ctx->impl->new_image(ctx, width, height, format, flags, 0, NULL);
+}
+
+struct blt_image *
+blt_new_image_with_modifiers(struct blt_context *ctx, int width, int height, uint32_t format, int flags, size_t mods_len, const uint64_t *mods)
+{
+	return ctx->impl->new_image(ctx, width, height, format, flags, mods_len, mods);
 }
 
 struct blt_image *
@@ -82,8 +99,68 @@ blt_mask(struct blt_context *ctx, struct blt_image *msk, int x, int y)
 	return 0;
 }
 
+int
+blt_src_transform(struct blt_context *ctx, const struct blt_transform *transform, int filter)
+{
+	static const struct blt_transform identity = {.xx = 1, .yy = 1};
+
+	if (!ctx->impl->set_transform) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	if (filter < BLT_FILTER_NEAREST || filter > BLT_FILTER_BOX) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (!transform)
+		transform = &identity;
+	if (ctx->impl->set_transform(ctx, transform, filter) < 0)
+		return -1;
+	ctx->transform = *transform;
+	ctx->filter = filter;
+	return 0;
+}
+
 int
 blt_rect(struct blt_context *ctx, size_t len, const struct blt_rect *rect)
 {
 	return ctx->impl->rect(ctx, len, rect);
 }
+
+int
+blt_trapezoids(struct blt_context *ctx, size_t len, const struct blt_trapezoid *trap)
+{
+	if (!ctx->impl->trapezoids) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	return ctx->impl->trapezoids(ctx, len, trap);
+}
+
+int
+blt_triangles(struct blt_context *ctx, size_t len, const struct blt_triangle *tri)
+{
+	if (!ctx->impl->triangles) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	return ctx->impl->triangles(ctx, len, tri);
+}
+
+int
+blt_flush(struct blt_context *ctx)
+{
+	if (!ctx->impl->flush)
+		return 0;
+	return ctx->impl->flush(ctx);
+}
+
+int
+blt_get_gpu_timings(struct blt_context *ctx, struct blt_gpu_timing *timing, size_t len)
+{
+	if (!ctx->impl->get_gpu_timings) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	return ctx->impl->get_gpu_timings(ctx, timing, len);
+}
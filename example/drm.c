@@ -12,6 +12,8 @@
 #include <blt-drm.h>
 #include <pixman.h>
 
+#define LEN(a) (sizeof(a) / sizeof((a)[0]))
+
 struct framebuffer {
 	uint32_t id;
 	struct blt_image *image;
@@ -86,15 +88,20 @@ dumpmod(struct drm_format_modifier *fmtmod)
 }
 
 static int
-checkplane(int fd, uint32_t id, uint32_t crtc_index)
+checkplane(int fd, uint32_t id, uint32_t crtc_index, uint32_t format, uint64_t *mods, size_t *mods_len)
 {
-	size_t i, j;
+	size_t i, j, k;
 	int type = -1, ret = 0;
 	drmModePlane *plane;
 	drmModeObjectProperties *props;
 	drmModePropertyRes *prop;
 	drmModePropertyBlobRes *blob;
 	struct drm_format_modifier_blob *fmtmod;
+	struct drm_format_modifier *mod;
+	uint32_t *fmts;
+	size_t fmt_index, max_mods = *mods_len;
+
+	*mods_len = 0;
 
 	plane = drmModeGetPlane(fd, id);
 	if (!plane)
@@ -117,12 +124,25 @@ checkplane(int fd, uint32_t id, uint32_t crtc_index)
 			if (!blob)
 				fatal("drmModeGetPropertyBlob:");
 			fmtmod = blob->data;
+			fmts = (uint32_t *)((char *)blob->data + fmtmod->formats_offset);
+			fmt_index = -1;
 			for (j = 0; j < fmtmod->count_formats; ++j) {
-				uint32_t fmt = ((uint32_t *)((char *)blob->data + fmtmod->formats_offset))[j];
+				uint32_t fmt = fmts[j];
 				printf("format[%zu]: %c%c%c%c\n", j, fmt & 0xff, fmt >> 8 & 0xff, fmt >> 16 & 0xff, fmt >> 24);
+				if (fmt == format)
+					fmt_index = j;
+			}
+			k = 0;
+			for (j = 0; j < fmtmod->count_modifiers; ++j) {
+				mod = &((struct drm_format_modifier *)((char *)blob->data + fmtmod->modifiers_offset))[j];
+				dumpmod(mod);
+				if (fmt_index < mod->offset || fmt_index >= mod->offset + 64)
+					continue;
+				if (mod->formats >> (fmt_index - mod->offset) & 1 && k < max_mods)
+					mods[k++] = mod->modifier;
 			}
-			for (j = 0; j < fmtmod->count_modifiers; ++j)
-				dumpmod(&((struct drm_format_modifier *)((char *)blob->data + fmtmod->modifiers_offset))[j]);
+			*mods_len = k;
+			drmModeFreePropertyBlob(blob);
 		}
 	}
 	if (type == DRM_PLANE_TYPE_PRIMARY)
@@ -144,7 +164,8 @@ main(int argc, char *argv[])
 	uint32_t handle[4] = {0}, offset[4] = {0}, stride[4] = {0};
 	uint32_t flags;
 	size_t i;
-	uint64_t mod[4] = {0};
+	uint64_t mod[4] = {0}, mods[64];
+	size_t mods_len;
 	struct blt_context *ctx;
 	struct blt_image *color, *black;
 	struct blt_plane plane[4];
@@ -185,7 +206,8 @@ main(int argc, char *argv[])
 	if (!planes)
 		fatal("drmModeGetPlaneRes:");
 	for (i = 0; i < planes->count_planes; ++i) {
-		if (checkplane(fd, planes->planes[i], crtc_index))
+		mods_len = LEN(mods);
+		if (checkplane(fd, planes->planes[i], crtc_index, DRM_FORMAT_XRGB8888, mods, &mods_len))
 			break;
 	}
 	if (i == planes->count_planes)
@@ -196,8 +218,7 @@ main(int argc, char *argv[])
 	if (!ctx)
 		fatal("blt_drm_new:");
 	printf("created context\n");
-	//fb.image = blt_new_image(ctx, crtc->mode.hdisplay, crtc->mode.vdisplay, BLT_IMAGE_DST | BLT_IMAGE_SCANOUT, BLT_FMT('X', 'R', '2', '4'), BLT_MOD_INVALID, NULL);
-	fb.image = blt_new_image(ctx, crtc->mode.hdisplay, crtc->mode.vdisplay, BLT_FMT('X', 'R', '2', '4'), BLT_IMAGE_DST | BLT_IMAGE_DMABUF);
+	fb.image = blt_new_image_with_modifiers(ctx, crtc->mode.hdisplay, crtc->mode.vdisplay, BLT_FMT('X', 'R', '2', '4'), BLT_IMAGE_DST | BLT_IMAGE_DMABUF, mods_len, mods_len ? mods : NULL);
 	if (!fb.image)
 		fatal("blt_new_image:");
 	printf("created image\n");
@@ -232,6 +253,8 @@ main(int argc, char *argv[])
 	blt_src(ctx, color, 0, 0);
 	blt_rect(ctx, 1, (struct blt_rect[]){{100, 100, 800, 600}});
 	blt_dst(ctx, NULL, 0, 0);
+	if (blt_flush(ctx) < 0)
+		fatal("blt_flush failed");
 
 	if (drmModeSetCrtc(fd, crtc->crtc_id, fb.id, 0, 0, &con->connector_id, 1, &crtc->mode) != 0)
 		fatal("drmModeSetCrtc:");
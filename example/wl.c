@@ -99,7 +99,7 @@ main(void)
 	blt_src(ctx, green, 0, 0);
 	blt_rect(ctx, 1, &(struct blt_rect){0, 0, 100, 200});
 	blt_dst(ctx, NULL, 0, 0);
-	blt_present(ctx, srf, img);
+	blt_present(ctx, srf, img, NULL);
 	wl_display_flush(dpy);
 
 	pause();
@@ -66,7 +66,7 @@ main(int argc, char *argv[])
 	blt_src(ctx, blue, 0, 0);
 	blt_rect(ctx, 1, &(struct blt_rect){0, 0, 100, 200});
 	blt_dst(ctx, NULL, 0, 0);
-	blt_present(ctx, srf, dst);
+	blt_present(ctx, srf, dst, NULL);
 
 	sleep(1);
 
@@ -0,0 +1,378 @@
+#define _GNU_SOURCE  /* needed for reallocarray (POSIX.1-2024) */
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <blt.h>
+#include "priv.h"
+
+/*
+Glyphs are packed into rows of the atlas called shelves. A glyph goes
+on the shortest shelf that it fits, or on a new shelf below the others.
+When the atlas is full, the least recently drawn shelf that is tall
+enough is emptied and reused.
+*/
+
+struct glyph {
+	uint32_t id;
+	/* next glyph in the same bucket or on the free list, or -1 */
+	int next;
+	int shelf;
+	/* position in the atlas */
+	struct blt_rect rect;
+	/* offset of the glyph origin from the top left */
+	int x, y;
+};
+
+/* a glyph waiting to be uploaded, and the offset of its pixels */
+struct upload {
+	int glyph;
+	size_t offset;
+};
+
+struct shelf {
+	int y, height;
+	/* width taken by glyphs */
+	int width;
+	/* value of the use counter when the shelf was last used */
+	uint64_t use;
+};
+
+struct blt_glyph_cache {
+	struct blt_image *atlas;
+	/* top of the space below the shelves */
+	int y;
+	struct shelf *shelf;
+	size_t shelf_len, shelf_cap;
+	struct glyph *glyph;
+	size_t glyph_cap;
+	int free;
+	/* hash table of glyph indices, with a power of two size */
+	int *bucket;
+	size_t bucket_len;
+	/* incremented by each blt_glyphs, so that glyphs used since then are kept */
+	uint64_t use;
+	struct blt_glyph_rect *draw;
+	size_t draw_cap;
+	/*
+	Glyphs added since the last blt_glyphs, which are uploaded
+	together before it draws, and their pixels, in rows of their
+	width of bpp bytes per pixel.
+	*/
+	struct upload *upload;
+	size_t upload_len, upload_cap;
+	char *pixels;
+	size_t pixels_len, pixels_cap;
+	int bpp;
+};
+
+static int *
+find_bucket(struct blt_glyph_cache *cache, uint32_t id)
+{
+	return &cache->bucket[(id * 2654435761u) & (cache->bucket_len - 1)];
+}
+
+static struct glyph *
+find_glyph(struct blt_glyph_cache *cache, uint32_t id)
+{
+	int i;
+
+	for (i = *find_bucket(cache, id); i != -1; i = cache->glyph[i].next) {
+		if (cache->glyph[i].id == id)
+			return &cache->glyph[i];
+	}
+	return NULL;
+}
+
+struct blt_glyph_cache *
+blt_new_glyph_cache(struct blt_context *ctx, uint32_t format, int width, int height)
+{
+	struct blt_glyph_cache *cache;
+	size_t i;
+
+	if (format != BLT_FMT('A', '8', ' ', ' ') && format != BLT_FMT('A', 'R', '2', '4')) {
+		errno = EINVAL;
+		goto error0;
+	}
+	cache = malloc(sizeof(*cache));
+	if (!cache)
+		goto error0;
+	cache->atlas = blt_new_image(ctx, width, height, format, BLT_IMAGE_SRC);
+	if (!cache->atlas)
+		goto error1;
+	cache->bucket_len = 1024;
+	cache->bucket = malloc(cache->bucket_len * sizeof(cache->bucket[0]));
+	if (!cache->bucket)
+		goto error2;
+	for (i = 0; i < cache->bucket_len; ++i)
+		cache->bucket[i] = -1;
+	cache->y = 0;
+	cache->shelf = NULL;
+	cache->shelf_len = 0;
+	cache->shelf_cap = 0;
+	cache->glyph = NULL;
+	cache->glyph_cap = 0;
+	cache->free = -1;
+	cache->use = 1;
+	cache->draw = NULL;
+	cache->draw_cap = 0;
+	cache->upload = NULL;
+	cache->upload_len = 0;
+	cache->upload_cap = 0;
+	cache->pixels = NULL;
+	cache->pixels_len = 0;
+	cache->pixels_cap = 0;
+	cache->bpp = format == BLT_FMT('A', '8', ' ', ' ') ? 1 : 4;
+	return cache;
+
+error2:
+	blt_image_destroy(ctx, cache->atlas);
+error1:
+	free(cache);
+error0:
+	return NULL;
+}
+
+void
+blt_glyph_cache_destroy(struct blt_context *ctx, struct blt_glyph_cache *cache)
+{
+	blt_image_destroy(ctx, cache->atlas);
+	free(cache->shelf);
+	free(cache->glyph);
+	free(cache->bucket);
+	free(cache->draw);
+	free(cache->upload);
+	free(cache->pixels);
+	free(cache);
+}
+
+int
+blt_glyph_cached(struct blt_glyph_cache *cache, uint32_t id)
+{
+	struct glyph *g;
+
+	g = find_glyph(cache, id);
+	if (!g)
+		return 0;
+	cache->shelf[g->shelf].use = cache->use;
+	return 1;
+}
+
+/* remove the glyphs on a shelf, so that it can be reused */
+static void
+empty_shelf(struct blt_glyph_cache *cache, int shelf)
+{
+	struct glyph *g;
+	size_t i;
+	int *p;
+
+	for (i = 0; i < cache->bucket_len; ++i) {
+		for (p = &cache->bucket[i]; *p != -1;) {
+			g = &cache->glyph[*p];
+			if (g->shelf == shelf) {
+				*p = g->next;
+				g->next = cache->free;
+				cache->free = g - cache->glyph;
+			} else {
+				p = &g->next;
+			}
+		}
+	}
+	cache->shelf[shelf].width = 0;
+}
+
+/* find a shelf with room for a glyph, or -1 */
+static int
+find_shelf(struct blt_context *ctx, struct blt_glyph_cache *cache, int width, int height)
+{
+	struct shelf *s;
+	void *p;
+	size_t cap;
+	int i, best;
+
+	best = -1;
+	for (i = 0; i < cache->shelf_len; ++i) {
+		s = &cache->shelf[i];
+		if (s->height >= height && cache->atlas->width - s->width >= width &&
+		    (best == -1 || s->height < cache->shelf[best].height))
+			best = i;
+	}
+	if (best != -1)
+		return best;
+	/* round up the height so that shelves are more likely to be reused */
+	height = (height + 3) & ~3;
+	if (cache->atlas->height - cache->y >= height) {
+		if (cache->shelf_len == cache->shelf_cap) {
+			cap = cache->shelf_cap ? cache->shelf_cap * 2 : 16;
+			p = reallocarray(cache->shelf, cap, sizeof(cache->shelf[0]));
+			if (!p)
+				return -1;
+			cache->shelf = p;
+			cache->shelf_cap = cap;
+		}
+		cache->shelf[cache->shelf_len] = (struct shelf){.y = cache->y, .height = height};
+		cache->y += height;
+		return cache->shelf_len++;
+	}
+	for (i = 0; i < cache->shelf_len; ++i) {
+		s = &cache->shelf[i];
+		if (s->height >= height && s->use < cache->use &&
+		    (best == -1 || s->use < cache->shelf[best].use))
+			best = i;
+	}
+	if (best == -1) {
+		errno = ENOSPC;
+		return -1;
+	}
+	/* rendering that hasn't been submitted may still use the old glyphs */
+	if (blt_flush(ctx) < 0)
+		return -1;
+	empty_shelf(cache, best);
+	return best;
+}
+
+/*
+Queue the pixels of a glyph for the next upload. Glyphs added since the
+last blt_glyphs are never evicted, so their place stays theirs.
+*/
+static int
+queue_upload(struct blt_glyph_cache *cache, int glyph, int width, int height, const void *data, size_t stride)
+{
+	const char *src;
+	size_t len, cap;
+	void *p;
+	int y;
+
+	len = (size_t)width * cache->bpp;
+	if (cache->upload_len == cache->upload_cap) {
+		cap = cache->upload_cap ? cache->upload_cap * 2 : 64;
+		p = reallocarray(cache->upload, cap, sizeof(cache->upload[0]));
+		if (!p)
+			return -1;
+		cache->upload = p;
+		cache->upload_cap = cap;
+	}
+	if (cache->pixels_cap - cache->pixels_len < len * height) {
+		cap = cache->pixels_cap ? cache->pixels_cap * 2 : 0x10000;
+		while (cap - cache->pixels_len < len * height)
+			cap *= 2;
+		p = realloc(cache->pixels, cap);
+		if (!p)
+			return -1;
+		cache->pixels = p;
+		cache->pixels_cap = cap;
+	}
+	cache->upload[cache->upload_len++] = (struct upload){glyph, cache->pixels_len};
+	for (src = data, y = 0; y < height; ++y, src += stride, cache->pixels_len += len)
+		memcpy(cache->pixels + cache->pixels_len, src, len);
+	return 0;
+}
+
+/*
+Upload the queued glyphs, with a write for each. Contexts that batch
+writes make a single copy of them.
+*/
+static int
+upload_glyphs(struct blt_context *ctx, struct blt_glyph_cache *cache)
+{
+	struct upload *u;
+	struct glyph *g;
+
+	for (u = cache->upload; u < cache->upload + cache->upload_len; ++u) {
+		g = &cache->glyph[u->glyph];
+		if (blt_image_write(ctx, cache->atlas, &g->rect, cache->pixels + u->offset, (size_t)(g->rect.x1 - g->rect.x0) * cache->bpp) < 0)
+			return -1;
+	}
+	cache->upload_len = 0;
+	cache->pixels_len = 0;
+	return 0;
+}
+
+int
+blt_add_glyph(struct blt_context *ctx, struct blt_glyph_cache *cache, uint32_t id, int width, int height, int x, int y, const void *data, size_t stride)
+{
+	struct glyph *g;
+	struct shelf *s;
+	void *p;
+	size_t i, cap;
+	int shelf, *bucket;
+
+	if (width <= 0 || height <= 0 || width > cache->atlas->width || height > cache->atlas->height) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (find_glyph(cache, id)) {
+		errno = EEXIST;
+		return -1;
+	}
+	if (cache->free == -1) {
+		cap = cache->glyph_cap ? cache->glyph_cap * 2 : 256;
+		p = reallocarray(cache->glyph, cap, sizeof(cache->glyph[0]));
+		if (!p)
+			return -1;
+		cache->glyph = p;
+		for (i = cap; i > cache->glyph_cap; --i) {
+			cache->glyph[i - 1].next = cache->free;
+			cache->free = i - 1;
+		}
+		cache->glyph_cap = cap;
+	}
+	shelf = find_shelf(ctx, cache, width, height);
+	if (shelf == -1)
+		return -1;
+	s = &cache->shelf[shelf];
+	g = &cache->glyph[cache->free];
+	g->id = id;
+	g->shelf = shelf;
+	g->rect = (struct blt_rect){s->width, s->y, s->width + width, s->y + height};
+	g->x = x;
+	g->y = y;
+	if (queue_upload(cache, g - cache->glyph, width, height, data, stride) < 0)
+		return -1;
+	s->width += width;
+	s->use = cache->use;
+	cache->free = g->next;
+	bucket = find_bucket(cache, id);
+	g->next = *bucket;
+	*bucket = g - cache->glyph;
+	return 0;
+}
+
+int
+blt_glyphs(struct blt_context *ctx, struct blt_glyph_cache *cache, size_t len, const struct blt_glyph *glyph)
+{
+	struct blt_glyph_rect *r;
+	struct glyph *g;
+	void *p;
+	size_t n;
+	int ret;
+
+	if (!ctx->impl->glyphs) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	if (upload_glyphs(ctx, cache) < 0)
+		return -1;
+	if (len > cache->draw_cap) {
+		p = reallocarray(cache->draw, len, sizeof(cache->draw[0]));
+		if (!p)
+			return -1;
+		cache->draw = p;
+		cache->draw_cap = len;
+	}
+	for (n = 0; len > 0; --len, ++glyph) {
+		g = find_glyph(cache, glyph->id);
+		if (!g)
+			continue;
+		cache->shelf[g->shelf].use = cache->use;
+		r = &cache->draw[n++];
+		r->dst.x0 = glyph->x - g->x;
+		r->dst.y0 = glyph->y - g->y;
+		r->dst.x1 = r->dst.x0 + g->rect.x1 - g->rect.x0;
+		r->dst.y1 = r->dst.y0 + g->rect.y1 - g->rect.y0;
+		r->atlas_x = g->rect.x0;
+		r->atlas_y = g->rect.y0;
+	}
+	ret = ctx->impl->glyphs(ctx, cache->atlas, n, cache->draw);
+	++cache->use;
+	return ret;
+}
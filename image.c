@@ -1,3 +1,4 @@
+#include <errno.h>
 #include <blt.h>
 #include "priv.h"
 
@@ -38,3 +39,58 @@ blt_image_export_dmabuf(struct blt_context *ctx, struct blt_image *img, struct b
 {
 	return img->impl->export_dmabuf(ctx, img, plane, mod);
 }
+
+int
+blt_image_export_fence(struct blt_context *ctx, struct blt_image *img)
+{
+	if (!img->impl->export_fence) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	return img->impl->export_fence(ctx, img);
+}
+
+int
+blt_image_import_fence(struct blt_context *ctx, struct blt_image *img, int fd)
+{
+	if (!img->impl->import_fence) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	return img->impl->import_fence(ctx, img, fd);
+}
+
+static int
+check_rect(struct blt_image *img, const struct blt_rect *rect)
+{
+	if (rect->x0 < 0 || rect->y0 < 0 || rect->x1 > img->width || rect->y1 > img->height ||
+	    rect->x0 >= rect->x1 || rect->y0 >= rect->y1) {
+		errno = EINVAL;
+		return -1;
+	}
+	return 0;
+}
+
+int
+blt_image_write(struct blt_context *ctx, struct blt_image *img, const struct blt_rect *rect, const void *data, size_t stride)
+{
+	if (!img->impl->write) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	if (check_rect(img, rect) < 0)
+		return -1;
+	return img->impl->write(ctx, img, rect, data, stride);
+}
+
+int
+blt_image_read(struct blt_context *ctx, struct blt_image *img, const struct blt_rect *rect, void *data, size_t stride)
+{
+	if (!img->impl->read) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	if (check_rect(img, rect) < 0)
+		return -1;
+	return img->impl->read(ctx, img, rect, data, stride);
+}
@@ -0,0 +1,10 @@
+#ifndef BLT_VULKAN_H
+#define BLT_VULKAN_H
+
+#include <vulkan/vulkan.h>
+
+struct blt_context *blt_vulkan_wrap(VkInstance, VkPhysicalDevice, VkDevice, VkQueue, uint32_t);
+struct blt_image *blt_image_from_vkimage(struct blt_context *, VkImage, int, int, uint32_t, VkImageUsageFlags, VkImageLayout);
+VkImage blt_image_get_vkimage(struct blt_image *, VkImageLayout *);
+
+#endif
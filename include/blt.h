@@ -5,7 +5,8 @@
 #include <stdint.h>
 
 #define BLT_FMT(a, b, c, d) ((uint32_t)(a) | (uint32_t)(b) << 8 | (uint32_t)(c) << 16 | (uint32_t)(d) << 24)
-#define BLT_MOD_INVALID (1ull << 56 - 1)
+#define BLT_MOD_INVALID ((1ull << 56) - 1)
+#define BLT_MOD_LINEAR 0
 
 /* damage */
 struct blt_damage *blt_new_damage(int max);
@@ -13,11 +14,20 @@ struct pixman_region32 *blt_damage(struct blt_damage *dmg, int age, struct pixma
 void blt_cycle_damage(struct blt_damage *dmg);
 
 /* context */
+struct blt_transform {
+	/* source x = xx * x + xy * y + x0, source y = yx * x + yy * y + y0 */
+	float xx, xy, x0;
+	float yx, yy, y0;
+};
+
 struct blt_context {
 	const struct blt_context_impl *impl;
 	int op;
 	struct blt_image *dst, *src, *msk;
 	int dst_x, dst_y, src_x, src_y, msk_x, msk_y;
+	/* applied to source coordinates, and how the source is sampled */
+	struct blt_transform transform;
+	int filter;
 	struct blt_x11 *x11;
 	struct blt_wl *wl;
 };
@@ -28,6 +38,24 @@ struct blt_rect {
 	int x1, y1;
 };
 
+struct blt_point {
+	float x, y;
+};
+
+struct blt_line {
+	struct blt_point p1, p2;
+};
+
+/* the area between top and bottom, and between the left and right lines */
+struct blt_trapezoid {
+	float top, bottom;
+	struct blt_line left, right;
+};
+
+struct blt_triangle {
+	struct blt_point p1, p2, p3;
+};
+
 struct blt_userdata {
 	void (*destroy)(struct blt_userdata *);
 	struct blt_userdata *next;
@@ -64,21 +92,42 @@ enum {
 };
 
 void blt_destroy(struct blt_context *ctx);
+struct blt_context *blt_new_stream(struct blt_context *ctx);
 
 struct blt_image *blt_new_image(struct blt_context *ctx, int x, int y, uint32_t format, int flags);
+struct blt_image *blt_new_image_with_modifiers(struct blt_context *ctx, int x, int y, uint32_t format, int flags, size_t mods_len, const uint64_t *mods);
 struct blt_image *blt_new_solid(struct blt_context *ctx, struct blt_color color);
 
 void blt_image_destroy(struct blt_context *ctx, struct blt_image *img);
 void blt_image_add_userdata(struct blt_image *img, struct blt_userdata *data);
 struct blt_userdata *blt_image_get_userdata(struct blt_image *img, void destroy(struct blt_userdata *));
 int blt_image_export_dmabuf(struct blt_context *ctx, struct blt_image *img, struct blt_plane plane[static 4], uint64_t *mod);
+int blt_image_export_fence(struct blt_context *ctx, struct blt_image *img);
+int blt_image_import_fence(struct blt_context *ctx, struct blt_image *img, int fd);
+int blt_image_write(struct blt_context *ctx, struct blt_image *img, const struct blt_rect *rect, const void *data, size_t stride);
+int blt_image_read(struct blt_context *ctx, struct blt_image *img, const struct blt_rect *rect, void *data, size_t stride);
 
 /* surface */
 struct blt_surface;
 
+enum blt_present_mode {
+	/* wait for vertical blank, queueing images */
+	BLT_PRESENT_FIFO,
+	/* like FIFO, but late images are shown immediately */
+	BLT_PRESENT_FIFO_RELAXED,
+	/* wait for vertical blank, replacing the queued image */
+	BLT_PRESENT_MAILBOX,
+	/* show images immediately, which may tear */
+	BLT_PRESENT_IMMEDIATE,
+};
+
 void blt_surface_destroy(struct blt_context *ctx, struct blt_surface *srf);
+int blt_surface_set_present_mode(struct blt_context *ctx, struct blt_surface *srf, int mode, int images);
+int blt_surface_resize(struct blt_context *ctx, struct blt_surface *srf, int width, int height);
 struct blt_image *blt_acquire(struct blt_context *ctx, struct blt_surface *srf, int *age);
-int blt_present(struct blt_context *ctx, struct blt_surface *srf, struct blt_image *img);
+int blt_present(struct blt_context *ctx, struct blt_surface *srf, struct blt_image *img, struct pixman_region32 *damage);
+int blt_present_ex(struct blt_context *ctx, struct blt_surface *srf, struct blt_image *img, struct pixman_region32 *damage, uint64_t *id);
+int blt_wait_presented(struct blt_context *ctx, struct blt_surface *srf, uint64_t id, uint64_t timeout, uint64_t *time);
 
 /* rendering */
 enum blt_op {
@@ -86,6 +135,13 @@ enum blt_op {
 	BLT_OP_OVER,
 };
 
+enum blt_filter {
+	BLT_FILTER_NEAREST,
+	BLT_FILTER_BILINEAR,
+	/* average over the destination pixel, for downscaling */
+	BLT_FILTER_BOX,
+};
+
 int blt_setup(struct blt_context *ctx, int op,
               struct blt_image *dst, int dst_x, int dst_y,
               struct blt_image *src, int src_x, int src_y,
@@ -93,7 +149,39 @@ int blt_setup(struct blt_context *ctx, int op,
 int blt_src(struct blt_context *ctx, struct blt_image *src, int src_x, int src_y);
 int blt_dst(struct blt_context *ctx, struct blt_image *dst, int dst_x, int dst_y);
 int blt_msk(struct blt_context *ctx, struct blt_image *msk, int msk_x, int msk_y);
+int blt_src_transform(struct blt_context *ctx, const struct blt_transform *transform, int filter);
 
 int blt_rect(struct blt_context *ctx, size_t len, const struct blt_rect *rect);
+int blt_trapezoids(struct blt_context *ctx, size_t len, const struct blt_trapezoid *trap);
+int blt_triangles(struct blt_context *ctx, size_t len, const struct blt_triangle *tri);
+int blt_flush(struct blt_context *ctx);
+
+/* glyphs */
+struct blt_glyph_cache;
+
+struct blt_glyph {
+	uint32_t id;
+	/* position of the glyph origin */
+	int x, y;
+};
+
+struct blt_glyph_cache *blt_new_glyph_cache(struct blt_context *ctx, uint32_t format, int width, int height);
+void blt_glyph_cache_destroy(struct blt_context *ctx, struct blt_glyph_cache *cache);
+int blt_glyph_cached(struct blt_glyph_cache *cache, uint32_t id);
+int blt_add_glyph(struct blt_context *ctx, struct blt_glyph_cache *cache, uint32_t id, int width, int height, int x, int y, const void *data, size_t stride);
+int blt_glyphs(struct blt_context *ctx, struct blt_glyph_cache *cache, size_t len, const struct blt_glyph *glyph);
+
+/* profiling */
+struct blt_gpu_timing {
+	/* destination image and number of rectangles drawn */
+	struct blt_image *dst;
+	size_t rects;
+	/* number of flushes before this rendering was submitted */
+	uint64_t frame;
+	/* GPU timestamps in nanoseconds */
+	uint64_t start, end;
+};
+
+int blt_get_gpu_timings(struct blt_context *ctx, struct blt_gpu_timing *timing, size_t len);
 
 #endif
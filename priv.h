@@ -2,25 +2,45 @@
 
 #define LEN(a) (sizeof(a) / sizeof((a)[0]))
 
+/* a glyph to draw, and the position of its top left in the atlas */
+struct blt_glyph_rect {
+	struct blt_rect dst;
+	int atlas_x, atlas_y;
+};
+
 struct blt_context_impl {
 	void (*destroy)(struct blt_context *);
+	struct blt_context *(*new_stream)(struct blt_context *);
 
-	struct blt_image *(*new_image)(struct blt_context *, int, int, uint32_t, int);
+	struct blt_image *(*new_image)(struct blt_context *, int, int, uint32_t, int, size_t, const uint64_t *);
 	struct blt_image *(*new_solid)(struct blt_context *, struct blt_color);
 
 	int (*setup)(struct blt_context *, int, struct blt_image *, struct blt_image *, struct blt_image *);
 	int (*rect)(struct blt_context *, size_t, const struct blt_rect *);
+	int (*trapezoids)(struct blt_context *, size_t, const struct blt_trapezoid *);
+	int (*triangles)(struct blt_context *, size_t, const struct blt_triangle *);
+	int (*glyphs)(struct blt_context *, struct blt_image *, size_t, const struct blt_glyph_rect *);
+	int (*flush)(struct blt_context *);
+	int (*get_gpu_timings)(struct blt_context *, struct blt_gpu_timing *, size_t);
+	int (*set_transform)(struct blt_context *, const struct blt_transform *, int);
 };
 
 struct blt_image_impl {
 	void (*destroy)(struct blt_context *, struct blt_image *);
 	int (*export_dmabuf)(struct blt_context *, struct blt_image *, struct blt_plane[static 4], uint64_t *mod);
+	int (*export_fence)(struct blt_context *, struct blt_image *);
+	int (*import_fence)(struct blt_context *, struct blt_image *, int);
+	int (*write)(struct blt_context *, struct blt_image *, const struct blt_rect *, const void *, size_t);
+	int (*read)(struct blt_context *, struct blt_image *, const struct blt_rect *, void *, size_t);
 };
 
 struct blt_surface_impl {
 	void (*destroy)(struct blt_context *, struct blt_surface *);
 	struct blt_image *(*acquire)(struct blt_context *, struct blt_surface *, int *);
-	int (*present)(struct blt_context *, struct blt_surface *, struct blt_image *);
+	int (*present)(struct blt_context *, struct blt_surface *, struct blt_image *, struct pixman_region32 *, uint64_t *);
+	int (*set_present_mode)(struct blt_context *, struct blt_surface *, int, int);
+	int (*resize)(struct blt_context *, struct blt_surface *, int, int);
+	int (*wait_presented)(struct blt_context *, struct blt_surface *, uint64_t, uint64_t, uint64_t *);
 };
 
 struct blt_surface {
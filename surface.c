@@ -1,3 +1,4 @@
+#include <errno.h>
 #include <blt.h>
 #include "priv.h"
 
@@ -7,6 +8,26 @@ blt_surface_destroy(struct blt_context *ctx, struct blt_surface *srf)
 	srf->impl->destroy(ctx, srf);
 }
 
+int
+blt_surface_set_present_mode(struct blt_context *ctx, struct blt_surface *srf, int mode, int images)
+{
+	if (!srf->impl->set_present_mode) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	return srf->impl->set_present_mode(ctx, srf, mode, images);
+}
+
+int
+blt_surface_resize(struct blt_context *ctx, struct blt_surface *srf, int width, int height)
+{
+	if (!srf->impl->resize) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	return srf->impl->resize(ctx, srf, width, height);
+}
+
 struct blt_image *
 blt_acquire(struct blt_context *ctx, struct blt_surface *srf, int *age)
 {
@@ -14,7 +35,23 @@ blt_acquire(struct blt_context *ctx, struct blt_surface *srf, int *age)
 }
 
 int
-blt_present(struct blt_context *ctx, struct blt_surface *srf, struct blt_image *img)
+blt_present(struct blt_context *ctx, struct blt_surface *srf, struct blt_image *img, struct pixman_region32 *damage)
+{
+	return srf->impl->present(ctx, srf, img, damage, NULL);
+}
+
+int
+blt_present_ex(struct blt_context *ctx, struct blt_surface *srf, struct blt_image *img, struct pixman_region32 *damage, uint64_t *id)
+{
+	return srf->impl->present(ctx, srf, img, damage, id);
+}
+
+int
+blt_wait_presented(struct blt_context *ctx, struct blt_surface *srf, uint64_t id, uint64_t timeout, uint64_t *time)
 {
-	return srf->impl->present(ctx, srf, img);
+	if (!srf->impl->wait_presented) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	return srf->impl->wait_presented(ctx, srf, id, timeout, time);
 }
@@ -0,0 +1,23 @@
+#version 450
+
+layout(binding = 0) uniform sampler2D src;
+layout(location = 0) in noperspective vec2 src_pos;
+layout(location = 0) out vec4 color;
+
+/*
+Average a 4x4 grid of bilinear samples spread over the area of the
+destination pixel in the source, which filters downscales of up to 8:1
+without needing mipmaps.
+*/
+void main() {
+	vec2 dx = dFdx(src_pos) / 4;
+	vec2 dy = dFdy(src_pos) / 4;
+	vec2 pos = src_pos - 1.5 * (dx + dy);
+	vec4 sum = vec4(0);
+
+	for (int i = 0; i < 4; ++i) {
+		for (int j = 0; j < 4; ++j)
+			sum += textureLod(src, pos + i * dx + j * dy, 0);
+	}
+	color = sum / 16;
+}
@@ -5,5 +5,6 @@ layout(location = 0) in noperspective vec2 src_pos;
 layout(location = 0) out vec4 color;
 
 void main() {
-	color = texture(src, src_pos);
+	/* implicit LOD isn't allowed with unnormalized coordinates */
+	color = textureLod(src, src_pos, 0);
 }
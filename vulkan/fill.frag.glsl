@@ -1,7 +1,7 @@
 #version 450
 
 layout(push_constant) uniform push {
-	layout(offset = 32) vec4 in_color;
+	layout(offset = 48) vec4 in_color;
 };
 
 layout(location = 0) out vec4 color;
@@ -0,0 +1,13 @@
+#version 450
+
+layout(push_constant) uniform push {
+	layout(offset = 48) vec4 in_color;
+};
+
+layout(binding = 0) uniform sampler2D atlas;
+layout(location = 0) in noperspective vec2 glyph_pos;
+layout(location = 0) out vec4 color;
+
+void main() {
+	color = in_color * textureLod(atlas, glyph_pos, 0);
+}
@@ -0,0 +1,20 @@
+#version 450
+
+layout(push_constant) uniform push {
+	layout(offset = 0) vec2 dst_origin;
+	layout(offset = 16) vec2 dst_scale;
+};
+
+/* per-instance destination rect and position in the atlas */
+layout(location = 0) in ivec4 rect;
+layout(location = 1) in ivec2 atlas_pos;
+layout(location = 0) out vec2 glyph_pos;
+
+void main() {
+	/* cover the rect with two triangles, in the same order as rects */
+	vec2 corner = vec2(uint(gl_VertexIndex - 1) < 3u, uint(gl_VertexIndex - 2) < 3u);
+	vec2 pos = mix(vec2(rect.xy), vec2(rect.zw), corner);
+
+	gl_Position = vec4(dst_scale * (dst_origin + pos) - vec2(1, 1), 0, 1);
+	glyph_pos = atlas_pos + pos - rect.xy;
+}
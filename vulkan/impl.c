@@ -3,12 +3,15 @@
 #include <limits.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #ifndef makedev
 # include <sys/sysmacros.h>
 #endif
@@ -16,14 +19,97 @@
 #include <pixman.h>
 #include <vulkan/vulkan.h>
 #include <blt.h>
+#include <blt-vulkan.h>
 #include "../priv.h"
 #include "priv.h"
 
-struct pipeline {
-	VkPipeline vk;
-	VkPipelineLayout layout;
-	VkDescriptorSet desc;
-	VkDescriptorSetLayout desc_layout;
+struct format {
+	uint32_t format;
+	VkFormat vk;
+	/* bytes per pixel */
+	size_t size;
+	/* components of the image when it is used as a source */
+	VkComponentMapping src;
+};
+
+/* pipelines for rendering to one attachment format */
+struct pipelines {
+	VkFormat format;
+	VkPipeline fill, copy, box;
+	VkPipeline shape_fill, shape_copy;
+	VkPipeline glyph;
+};
+
+struct timing {
+	struct blt_image *dst;
+	size_t rects;
+	uint64_t frame;
+	/* timeline value of the submission, or 0 if not yet submitted */
+	uint64_t seq;
+};
+
+/* a value of a timeline semaphore */
+struct sync_point {
+	VkSemaphore timeline;
+	uint64_t seq;
+};
+
+/* a binary semaphore and the timeline value after which it is unused */
+struct spare_semaphore {
+	VkSemaphore semaphore;
+	uint64_t seq;
+};
+
+/*
+Command buffers of a transfer submission: the copies, and if the
+transfer queue is in another family, the ownership transfers of the
+images to it and back on the graphics queue.
+*/
+struct transfer {
+	VkCommandBuffer cmd, release, acquire;
+	/*
+	Transfer timeline value after which they can be reused, and the
+	timeline value of the acquire.
+	*/
+	uint64_t seq, acquire_seq;
+	struct transfer *next;
+};
+
+/* bytes in a staging buffer, which larger copies get one of their own for */
+#define STAGING_SIZE 0x400000
+
+/* persistently mapped buffer that uploads and readbacks are staged in */
+struct staging {
+	VkBuffer buffer;
+	VkDeviceMemory memory;
+	char *map;
+	size_t size;
+	/* transfer timeline value after which it can be reused */
+	uint64_t seq;
+	struct staging *next;
+};
+
+/*
+Copies between staging buffers and an image in the next transfer
+submission, which either all write to it or all read from it, and the
+layout of the image before them.
+*/
+struct transfer_image {
+	struct image *img;
+	VkImageLayout layout;
+	bool write;
+	VkBuffer *buffer;
+	VkBufferImageCopy *copy;
+	size_t copy_len, copy_cap;
+};
+
+struct vertex_buffer {
+	VkBuffer buffer;
+	VkDeviceMemory memory;
+	int32_t *map;
+	/* timeline value after which it can be reused */
+	uint64_t seq;
+	struct vertex_buffer *next;
 };
 
 struct context {
@@ -34,44 +120,250 @@ struct context {
 	VkDevice dev;
 	VkQueue queue;
 	uint32_t queue_index;
-	VkDescriptorPool desc_pool;
+	/*
+	Command buffers allocated from cmd_pool, and the timeline value
+	after which each one can be reused, or UINT64_MAX while it is
+	recording or waiting to be submitted.
+	*/
 	VkCommandPool cmd_pool;
-	VkShaderModule vert_shader, fill_shader, copy_shader;
-	struct pipeline fill_pipeline, copy_rgb_pipeline;
-	VkSampler rgb_sampler;
+	VkCommandBuffer *cmd;
+	uint64_t *cmd_seq;
+	size_t cmd_len;
+	/* queue for uploads and readbacks, possibly the same as queue */
+	VkQueue xfer_queue;
+	uint32_t xfer_index;
+	VkCommandPool xfer_pool;
+	VkSemaphore xfer_timeline;
+	uint64_t xfer_seq;
+	struct transfer *transfer;
+	/*
+	Copies for the next transfer submission, which flush makes, and
+	the staging buffers that aren't being suballocated from, and the
+	one that is, starting staging_used bytes into it.
+	*/
+	struct transfer_image *xfer_img;
+	size_t xfer_img_len, xfer_img_cap;
+	struct staging *staging_pool;
+	struct staging *staging;
+	size_t staging_used;
+	VkShaderModule vert_shader, fill_shader, copy_shader, box_shader;
+	VkShaderModule shape_shader, shape_fill_shader, shape_copy_shader;
+	VkShaderModule glyph_vert_shader, glyph_frag_shader;
+	VkDescriptorSetLayout copy_desc_layout;
+	VkPipelineLayout fill_layout, copy_layout;
+	/* created on first use for each destination format */
+	struct pipelines pipelines[8];
+	size_t pipelines_len;
+	VkSampler nearest_sampler, linear_sampler;
+
+	/* signalled once each flush and everything before it completes */
+	VkSemaphore timeline;
+	uint64_t seq;
+	/*
+	Timeline semaphores of destroyed draw contexts and their last
+	values, which are reused so that waits on them remain valid.
+	*/
+	struct sync_point *spare;
+	size_t spare_len, spare_cap;
+	/*
+	Semaphores that imported fences were waited on with, which can
+	be imported into again once the wait completes.
+	*/
+	struct spare_semaphore *spare_wait;
+	size_t spare_wait_len, spare_wait_cap;
+	/* draw contexts that have finished recording, in order */
+	struct draw_context **pending;
+	size_t pending_len, pending_cap;
+	/*
+	Vertex buffers that aren't being recorded into, and the one
+	that is. The draw contexts recorded by a context use successive
+	parts of its buffer, starting vertex_used words into it, and
+	a full buffer is returned to the pool when the draw context
+	that filled it is submitted, after all its earlier users.
+	*/
+	struct vertex_buffer *vertex_pool;
+	struct vertex_buffer *vertex_buffer;
+	size_t vertex_used;
+	/* destroyed images that the GPU may still use */
+	struct image *destroyed;
+
+	/*
+	A stream records separately from its parent, with its own
+	rendering state and command buffers, and uses the device objects
+	and pipelines of the parent. The parent submits the pending draw
+	contexts of its streams after its own, in the order the streams
+	were created. The lock of the parent protects the pending lists,
+	command buffers, pipelines and image state, which streams on
+	other threads share.
+	*/
+	struct context *parent;
+	struct context **stream;
+	size_t stream_len, stream_cap;
+	pthread_mutex_t lock;
+
+	/*
+	Ring of timings for blt_get_gpu_timings. Each entry uses two
+	queries in query_pool, for the start and end timestamps.
+	*/
+	VkQueryPool query_pool;
+	struct timing timing[128];
+	size_t timing_pos, timing_len;
+	uint64_t frame;
+	uint64_t timestamp_mask;
+	float timestamp_period;
 
 	PFN_vkGetMemoryFdKHR get_memory_fd;
 	PFN_vkGetImageDrmFormatModifierPropertiesEXT get_image_drm_format_modifier_properties;
+	PFN_vkGetSemaphoreFdKHR get_semaphore_fd;
+	PFN_vkImportSemaphoreFdKHR import_semaphore_fd;
+	PFN_vkCmdPushDescriptorSetKHR push_descriptor_set;
+	/* optional extensions */
+	bool incremental_present;
+	bool present_wait;
+	bool display_timing;
+	PFN_vkWaitForPresentKHR wait_for_present;
+	PFN_vkGetPastPresentationTimingGOOGLE get_past_presentation_timing;
+};
+
+/* words in a shape instance: bounding box, then its two trapezoids */
+#define SHAPE_SIZE 16
+/* words in a glyph instance: destination rect, then atlas position and padding */
+#define GLYPH_SIZE 8
+/* words in a vertex buffer, a multiple of SHAPE_SIZE, enough for 4096 glyphs */
+#define VERTEX_SIZE 0x8000
+
+enum {
+	DRAW_RECTS,
+	DRAW_SHAPES,
+	DRAW_GLYPHS,
 };
 
 struct draw_context {
+	/* command buffer of the context recording it, and its index there */
 	VkCommandBuffer cmd;
-	VkSemaphore semaphore;
-	VkFence fence;
-	VkDeviceMemory vertex_memory;
-	VkBuffer vertex_buffer;
+	size_t cmd_index;
+	/* signalled with seq by the last submission */
+	VkSemaphore timeline;
+	uint64_t seq;
+	bool recording, pending;
+	/* index of the current timing, or -1 */
+	int timing;
+	/* part of the vertex buffer of the context recording it */
 	int32_t *vertex;
 	size_t vertex_len, vertex_pos, vertex_cap;
+	/* vertex buffers to return to the pool when it is submitted */
+	struct vertex_buffer *used;
+	/* what the vertices since vertex_pos are */
+	int mode;
+	/* semaphores to wait on in the next submission */
+	VkSemaphoreSubmitInfo *wait;
+	size_t wait_len, wait_cap;
 };
 
 struct image {
 	struct blt_image base;
+	const struct format *fmt;
 	VkImage vk;
 	VkDeviceMemory memory;
-	VkImageView view;
+	/*
+	View used as a color attachment, and views used as a source,
+	the latter with only alpha for destinations without color.
+	*/
+	VkImageView view, src_view, alpha_view;
 	VkImageLayout layout;
+	VkImageUsageFlags usage;
 	struct draw_context *draw_ctx;
+	/*
+	Submissions that sample the image since it was last drawn to,
+	which must complete before it is drawn to again.
+	*/
+	struct sync_point *reader;
+	size_t reader_len, reader_cap;
+	/*
+	Transfer timeline value of the submission with the last copy to
+	or from the image, and the timeline value that the last fence
+	import or swapchain acquisition signals, which all later uses
+	wait for.
+	*/
+	uint64_t xfer_seq;
+	uint64_t ready;
+	/*
+	Frame after the last one whose draw contexts use the image, so
+	that transfers can tell if rendering that isn't submitted yet
+	uses it.
+	*/
+	uint64_t used;
+	/*
+	Exported and imported sync_file semaphores, created on demand,
+	and the timeline value after which the latter has no pending
+	waits.
+	*/
+	VkSemaphore signal, wait;
+	uint64_t wait_seq;
+	/*
+	Swapchain image semaphores signalled by acquisition and waited
+	on by presentation, and the timeline value after which the
+	acquire semaphore has no pending waits.
+	*/
+	VkSemaphore acquired, present;
+	uint64_t acquire_seq;
+	/*
+	Once destroyed, the timeline value after which the GPU is done
+	with the image, or 0 until the draw contexts that were waiting
+	to be submitted then are, and the next destroyed image.
+	*/
+	uint64_t destroy_seq;
+	struct image *next;
 };
 
-struct surface {
-	struct blt_surface base;
-	VkSurfaceKHR vk;
-	VkSwapchainKHR swapchain;
+struct swapchain {
+	VkSwapchainKHR vk;
 	struct image *img;
 	int *age;
 	uint32_t img_len;
+	/* first present id used with this swapchain */
+	uint64_t first_id;
+	/* timeline value after which a retired swapchain can be destroyed */
+	uint64_t seq;
+	struct swapchain *next;
+};
+
+struct surface {
+	struct blt_surface base;
+	VkSurfaceKHR vk;
+	VkSwapchainCreateInfoKHR info;
+	uint32_t format;
+	/* requested extent, used if the surface doesn't determine it */
+	int width, height;
+	uint32_t images;
+	struct swapchain *swapchain, *retired;
+	/* swapchain must be recreated before the next acquire */
+	bool stale;
+	/* acquire semaphore not currently owned by an image */
+	VkSemaphore spare;
+	uint64_t spare_seq;
+	/*
+	Last present id, and the timeline values of the most recent
+	presentations, indexed by id.
+	*/
+	uint64_t present_id;
+	uint64_t present_seq[16];
+	/*
+	When each of those presentations was shown, as reported by
+	VK_GOOGLE_display_timing, or 0 if it hasn't been yet.
+	*/
+	uint64_t present_time[16];
 };
 
+static int flush(struct blt_context *);
+static void destroy_stream(struct context *);
+static int create_swapchain(struct context *, struct surface *);
+static int alloc_buffer(struct context *, size_t, VkBufferUsageFlags, VkBuffer *, VkDeviceMemory *);
+static int make_pipelines(struct context *, struct pipelines *);
+static int get_command_buffer(struct context *, size_t *);
+static int submit_transfers(struct context *);
+static struct context *new_context(void);
+
 static const uint32_t vert_spv[] = {
 #include "vert.vert.inc"
 };
@@ -84,21 +376,121 @@ static const uint32_t copy_spv[] = {
 #include "copy.frag.inc"
 };
 
+static const uint32_t box_spv[] = {
+#include "box.frag.inc"
+};
+
+static const uint32_t shape_spv[] = {
+#include "shape.vert.inc"
+};
+
+static const uint32_t shape_fill_spv[] = {
+#include "shapefill.frag.inc"
+};
+
+static const uint32_t shape_copy_spv[] = {
+#include "shapecopy.frag.inc"
+};
+
+static const uint32_t glyph_vert_spv[] = {
+#include "glyph.vert.inc"
+};
+
+static const uint32_t glyph_frag_spv[] = {
+#include "glyph.frag.inc"
+};
+
+/* the context that owns the state shared with its streams */
+static struct context *
+owner(struct context *ctx)
+{
+	return ctx->parent ? ctx->parent : ctx;
+}
+
 static void
 destroy(struct blt_context *ctx_base)
 {
 	struct context *ctx = (void *)ctx_base;
 
+	if (ctx->parent)
+		destroy_stream(ctx);
 	/* TODO */
 	free(ctx);
 }
 
+/*
+Destroy img once the GPU is done with it. Streams may use it in draw
+contexts that only the parent submits, so it goes on the destroyed
+list of the parent, which flush reaps.
+*/
 static void
 image_destroy(struct blt_context *ctx_base, struct blt_image *img_base)
 {
+	struct context *ctx = (void *)ctx_base, *shared = owner(ctx);
 	struct image *img = (void *)img_base;
+	size_t i;
 
-	free(img);
+	/* finish the rendering that uses img, and submit it if we can */
+	flush(ctx_base);
+	if (ctx->base.dst == img_base)
+		ctx->base.dst = NULL;
+	if (ctx->base.src == img_base)
+		ctx->base.src = NULL;
+	pthread_mutex_lock(&shared->lock);
+	img->destroy_seq = shared->seq;
+	if (shared->pending_len > 0)
+		img->destroy_seq = 0;
+	for (i = 0; i < shared->stream_len; ++i) {
+		if (shared->stream[i]->pending_len > 0)
+			img->destroy_seq = 0;
+	}
+	img->next = shared->destroyed;
+	shared->destroyed = img;
+	pthread_mutex_unlock(&shared->lock);
+}
+
+/*
+Submit cmd, if any, after wait and all work submitted so far, and
+signal the next value of the timeline. Binary semaphores can only be
+waited on once, and an image can only be acquired from another queue
+family once, so they get a submission of their own, which any number
+of later ones can wait for. The lock must be held.
+*/
+static int
+submit_ready(struct context *ctx, const VkSemaphoreSubmitInfo *wait, VkCommandBuffer cmd)
+{
+	VkResult res;
+
+	/* timeline values must be signalled in order */
+	res = vkQueueSubmit2(ctx->queue, 1, &(VkSubmitInfo2){
+		.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO_2,
+		.waitSemaphoreInfoCount = 2,
+		.pWaitSemaphoreInfos = (VkSemaphoreSubmitInfo[]){
+			*wait,
+			{
+				.sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+				.semaphore = ctx->timeline,
+				.value = ctx->seq,
+				.stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+			},
+		},
+		.commandBufferInfoCount = cmd ? 1 : 0,
+		.pCommandBufferInfos = &(VkCommandBufferSubmitInfo){
+			.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_SUBMIT_INFO,
+			.commandBuffer = cmd,
+		},
+		.signalSemaphoreInfoCount = 1,
+		.pSignalSemaphoreInfos = &(VkSemaphoreSubmitInfo){
+			.sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+			.semaphore = ctx->timeline,
+			.value = ctx->seq + 1,
+			.stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+		},
+	}, VK_NULL_HANDLE);
+	if (res != VK_SUCCESS)
+		return -1;
+	++ctx->seq;
+	return 0;
 }
 
 static int
@@ -112,6 +504,11 @@ image_export_dmabuf(struct blt_context *ctx_base, struct blt_image *img_base, st
 		.sType = VK_STRUCTURE_TYPE_IMAGE_DRM_FORMAT_MODIFIER_PROPERTIES_EXT,
 	};
 
+	/* swapchain images and those of the application have no memory of ours */
+	if (img->memory == VK_NULL_HANDLE) {
+		errno = ENOTSUP;
+		return -1;
+	}
 	res = ctx->get_memory_fd(ctx->dev, &(VkMemoryGetFdInfoKHR){
 		.sType = VK_STRUCTURE_TYPE_MEMORY_GET_FD_INFO_KHR,
 		.memory = img->memory,
@@ -134,233 +531,1597 @@ image_export_dmabuf(struct blt_context *ctx_base, struct blt_image *img_base, st
 	return 1;
 }
 
-static const struct blt_image_impl image_impl = {
-	.destroy = image_destroy,
-	.export_dmabuf = image_export_dmabuf,
-};
+static int
+image_export_fence(struct blt_context *ctx_base, struct blt_image *img_base)
+{
+	struct context *ctx = (void *)ctx_base;
+	struct image *img = (void *)img_base;
+	VkResult res;
+	int fd;
 
-static void
-surface_destroy(struct blt_context *ctx_base, struct blt_surface *srf_base)
+	/* streams can only draw */
+	if (ctx->parent) {
+		errno = EINVAL;
+		return -1;
+	}
+	/* commands for the current destination haven't been recorded yet */
+	if (img_base == ctx->base.dst) {
+		errno = EBUSY;
+		return -1;
+	}
+	if (flush(ctx_base) < 0)
+		return -1;
+	if (!img->signal) {
+		res = vkCreateSemaphore(ctx->dev, &(VkSemaphoreCreateInfo){
+			.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+			.pNext = &(VkExportSemaphoreCreateInfo){
+				.sType = VK_STRUCTURE_TYPE_EXPORT_SEMAPHORE_CREATE_INFO,
+				.handleTypes = VK_EXTERNAL_SEMAPHORE_HANDLE_TYPE_SYNC_FD_BIT,
+			},
+		}, NULL, &img->signal);
+		if (res != VK_SUCCESS)
+			return -1;
+	}
+	/*
+	The queue executes in submission order, so an empty submission
+	signals once all previously submitted work has completed.
+	*/
+	res = vkQueueSubmit(ctx->queue, 1, &(VkSubmitInfo){
+		.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+		.signalSemaphoreCount = 1,
+		.pSignalSemaphores = &img->signal,
+	}, VK_NULL_HANDLE);
+	if (res != VK_SUCCESS)
+		return -1;
+	/* exporting a sync_file resets the semaphore, so it can be reused */
+	res = ctx->get_semaphore_fd(ctx->dev, &(VkSemaphoreGetFdInfoKHR){
+		.sType = VK_STRUCTURE_TYPE_SEMAPHORE_GET_FD_INFO_KHR,
+		.semaphore = img->signal,
+		.handleType = VK_EXTERNAL_SEMAPHORE_HANDLE_TYPE_SYNC_FD_BIT,
+	}, &fd);
+	if (res != VK_SUCCESS)
+		return -1;
+	return fd;
+}
+
+/* keep sem until the timeline reaches seq, then reuse it */
+static int
+put_semaphore(struct context *ctx, VkSemaphore sem, uint64_t seq)
 {
-	struct surface *srf = (void *)srf_base;
+	struct spare_semaphore *spare;
+	size_t cap;
 
-	free(srf->img);
-	free(srf->age);
-	free(srf);
+	if (ctx->spare_wait_len == ctx->spare_wait_cap) {
+		cap = ctx->spare_wait_cap ? ctx->spare_wait_cap * 2 : 4;
+		spare = reallocarray(ctx->spare_wait, cap, sizeof(ctx->spare_wait[0]));
+		if (!spare)
+			return -1;
+		ctx->spare_wait = spare;
+		ctx->spare_wait_cap = cap;
+	}
+	ctx->spare_wait[ctx->spare_wait_len++] = (struct spare_semaphore){sem, seq};
+	return 0;
 }
 
-static struct blt_image *
-acquire(struct blt_context *ctx_base, struct blt_surface *srf_base, int *age)
+/* get a semaphore without pending waits, given the signalled timeline value */
+static VkSemaphore
+get_semaphore(struct context *ctx, uint64_t done)
 {
-	struct context *ctx = (void *)ctx_base;
-	struct surface *srf = (void *)srf_base;
-	uint32_t idx;
-	VkResult res;
+	VkSemaphore sem;
+	size_t i;
 
-	/* XXX: use semaphore */
-	res = vkAcquireNextImageKHR(ctx->dev, srf->swapchain, -1, VK_NULL_HANDLE, VK_NULL_HANDLE, &idx);
-	if (res != VK_SUCCESS)
-		return NULL;
-	if (age)
-		*age = srf->age[idx];
-	return &srf->img[idx].base;
+	for (i = 0; i < ctx->spare_wait_len; ++i) {
+		if (ctx->spare_wait[i].seq <= done) {
+			sem = ctx->spare_wait[i].semaphore;
+			ctx->spare_wait[i] = ctx->spare_wait[--ctx->spare_wait_len];
+			return sem;
+		}
+	}
+	if (vkCreateSemaphore(ctx->dev, &(VkSemaphoreCreateInfo){
+		.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+	}, NULL, &sem) != VK_SUCCESS)
+		return VK_NULL_HANDLE;
+	return sem;
 }
 
 static int
-present(struct blt_context *ctx_base, struct blt_surface *srf_base, struct blt_image *img_base)
+image_import_fence(struct blt_context *ctx_base, struct blt_image *img_base, int fd)
 {
 	struct context *ctx = (void *)ctx_base;
-	struct surface *srf = (void *)srf_base;
 	struct image *img = (void *)img_base;
+	uint64_t done;
 	VkResult res;
-	uint32_t i, idx;
 
-	idx = img - srf->img;
-	res = vkQueuePresentKHR(ctx->queue, &(VkPresentInfoKHR){
-		.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR,
-		.swapchainCount = 1,
-		.pSwapchains = &srf->swapchain,
-		.pImageIndices = (uint32_t[]){idx},
+	if (ctx->parent) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (fd == -1)
+		return 0;
+	if (vkGetSemaphoreCounterValue(ctx->dev, ctx->timeline, &done) != VK_SUCCESS)
+		return -1;
+	/*
+	A semaphore can't be imported into while a wait on it is
+	pending, so the earlier fence keeps its semaphore until then,
+	and this one gets another.
+	*/
+	if (img->wait && img->wait_seq > done) {
+		if (put_semaphore(ctx, img->wait, img->wait_seq) < 0)
+			return -1;
+		img->wait = VK_NULL_HANDLE;
+	}
+	if (!img->wait) {
+		img->wait = get_semaphore(ctx, done);
+		if (!img->wait)
+			return -1;
+	}
+	res = ctx->import_semaphore_fd(ctx->dev, &(VkImportSemaphoreFdInfoKHR){
+		.sType = VK_STRUCTURE_TYPE_IMPORT_SEMAPHORE_FD_INFO_KHR,
+		.semaphore = img->wait,
+		.flags = VK_SEMAPHORE_IMPORT_TEMPORARY_BIT,
+		.handleType = VK_EXTERNAL_SEMAPHORE_HANDLE_TYPE_SYNC_FD_BIT,
+		.fd = fd,
 	});
 	if (res != VK_SUCCESS)
 		return -1;
-	for (i = 0; i < srf->img_len; ++i)
-		++srf->age[i];
-	srf->age[idx] = 0;
+	pthread_mutex_lock(&ctx->lock);
+	if (submit_ready(ctx, &(VkSemaphoreSubmitInfo){
+		.sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+		.semaphore = img->wait,
+		.stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+	}, VK_NULL_HANDLE) < 0) {
+		pthread_mutex_unlock(&ctx->lock);
+		return -1;
+	}
+	img->ready = ctx->seq;
+	img->wait_seq = ctx->seq;
+	pthread_mutex_unlock(&ctx->lock);
 	return 0;
 }
 
-static const struct blt_surface_impl surface_impl = {
-	.destroy = surface_destroy,
-	.acquire = acquire,
-	.present = present,
+static const struct format formats[] = {
+	{BLT_FMT('X', 'R', '2', '4'), VK_FORMAT_B8G8R8A8_UNORM, 4, {.a = VK_COMPONENT_SWIZZLE_ONE}},
+	{BLT_FMT('A', 'R', '2', '4'), VK_FORMAT_B8G8R8A8_UNORM, 4},
+	{BLT_FMT('R', 'G', '1', '6'), VK_FORMAT_R5G6B5_UNORM_PACK16, 2},
+	/* alpha is stored in the red component */
+	{BLT_FMT('A', '8', ' ', ' '), VK_FORMAT_R8_UNORM, 1, {
+		VK_COMPONENT_SWIZZLE_ZERO, VK_COMPONENT_SWIZZLE_ZERO,
+		VK_COMPONENT_SWIZZLE_ZERO, VK_COMPONENT_SWIZZLE_R,
+	}},
+	{BLT_FMT('X', 'R', '3', '0'), VK_FORMAT_A2R10G10B10_UNORM_PACK32, 4, {.a = VK_COMPONENT_SWIZZLE_ONE}},
+	{BLT_FMT('A', 'R', '3', '0'), VK_FORMAT_A2R10G10B10_UNORM_PACK32, 4},
+	{BLT_FMT('A', 'B', '4', 'H'), VK_FORMAT_R16G16B16A16_SFLOAT, 8},
 };
 
-static uint32_t
-find_memory_type(struct context *ctx, uint32_t bits, VkMemoryPropertyFlags flags)
+static const struct format *
+find_format(uint32_t format)
 {
-	VkPhysicalDeviceMemoryProperties props;
-	uint32_t i;
+	const struct format *fmt;
 
-	vkGetPhysicalDeviceMemoryProperties(ctx->phys, &props);
-	for (i = 0; i < props.memoryTypeCount; ++i) {
-		if (bits & (1 << i) && (props.memoryTypes[i].propertyFlags & flags) == flags)
-			return i;
+	for (fmt = formats; fmt < formats + LEN(formats); ++fmt) {
+		if (fmt->format == format)
+			return fmt;
 	}
-	return -1;
+	return NULL;
 }
 
-static int
-alloc_buffer(struct context *ctx, size_t size, VkBufferUsageFlags usage, VkBuffer *buf, VkDeviceMemory *mem)
+/*
+Layout of an image between uses. Destinations that can be sampled are
+left ready for it, so that drawing with them doesn't change the layout.
+*/
+static VkImageLayout
+resting_layout(struct image *img)
 {
-	VkResult res;
-	VkMemoryRequirements reqs;
-	VkMemoryPropertyFlags props = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
-	uint32_t mem_type;
+	return img->draw_ctx && !img->src_view ? VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL : VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+}
 
-	res = vkCreateBuffer(ctx->dev, &(VkBufferCreateInfo){
-		.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
-		.size = size,
-		.usage = usage,
-		.sharingMode = VK_SHARING_MODE_EXCLUSIVE,
-	}, NULL, buf);
-	if (res != VK_SUCCESS)
-		goto error0;
-	vkGetBufferMemoryRequirements(ctx->dev, *buf, &reqs);
-	mem_type = find_memory_type(ctx, reqs.memoryTypeBits, props);
-	if (mem_type == -1)
-		goto error1;
-	res = vkAllocateMemory(ctx->dev, &(VkMemoryAllocateInfo){
-		.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-		.allocationSize = reqs.size,
-		.memoryTypeIndex = mem_type,
-	}, NULL, mem);
-	if (res != VK_SUCCESS)
-		goto error1;
-	res = vkBindBufferMemory(ctx->dev, *buf, *mem, 0);
-	if (res != VK_SUCCESS)
-		goto error2;
-	return VK_SUCCESS;
+/*
+Free the staging buffers that have completed and are too large to be
+reused, which only large copies allocate. The lock must be held.
+*/
+static void
+reap_transfers(struct context *ctx)
+{
+	struct staging **p, *st;
+	uint64_t done;
 
-error2:
-	vkFreeMemory(ctx->dev, *mem, NULL);
-error1:
-	vkDestroyBuffer(ctx->dev, *buf, NULL);
-error0:
-	return -1;
+	if (vkGetSemaphoreCounterValue(ctx->dev, ctx->xfer_timeline, &done) != VK_SUCCESS)
+		return;
+	for (p = &ctx->staging_pool; *p;) {
+		st = *p;
+		if (st->size == STAGING_SIZE || st->seq > done) {
+			p = &st->next;
+			continue;
+		}
+		*p = st->next;
+		vkDestroyBuffer(ctx->dev, st->buffer, NULL);
+		vkFreeMemory(ctx->dev, st->memory, NULL);
+		free(st);
+	}
 }
 
-static struct draw_context *
-make_draw_context(struct context *ctx, struct image *img)
+static struct staging *
+new_staging(struct context *ctx, size_t size)
 {
-	struct draw_context *dc;
-	VkResult res;
-	void *data;
+	struct staging *st;
+	void *map;
 
-	dc = malloc(sizeof(*dc));
-	if (!dc)
+	st = malloc(sizeof(*st));
+	if (!st)
 		goto error0;
-	dc->vertex_len = 0;
-	dc->vertex_pos = 0;
-	dc->vertex_cap = 0x400;
-	res = vkAllocateCommandBuffers(ctx->dev, &(VkCommandBufferAllocateInfo){
-		.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
-		.commandPool = ctx->cmd_pool,
-		.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
-		.commandBufferCount = 1,
-	}, &dc->cmd);
-	if (res != VK_SUCCESS)
+	if (alloc_buffer(ctx, size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, &st->buffer, &st->memory) < 0)
 		goto error1;
-	res = alloc_buffer(ctx, dc->vertex_cap * sizeof(dc->vertex[0]), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, &dc->vertex_buffer, &dc->vertex_memory);
-	if (res != VK_SUCCESS)
+	if (vkMapMemory(ctx->dev, st->memory, 0, VK_WHOLE_SIZE, 0, &map) != VK_SUCCESS)
 		goto error2;
-	res = vkMapMemory(ctx->dev, dc->vertex_memory, 0, VK_WHOLE_SIZE, 0, &data);
-	if (res != VK_SUCCESS)
-		goto error3;
-	dc->vertex = data;
-	res = vkCreateSemaphore(ctx->dev, &(VkSemaphoreCreateInfo){
-		.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
-	}, NULL, &dc->semaphore);
-	if (res != VK_SUCCESS)
-		goto error4;
-	return dc;
+	st->map = map;
+	st->size = size;
+	st->seq = 0;
+	return st;
 
-error4:
-	vkUnmapMemory(ctx->dev, dc->vertex_memory);
-error3:
-	vkDestroyBuffer(ctx->dev, dc->vertex_buffer, NULL);
-	vkFreeMemory(ctx->dev, dc->vertex_memory, NULL);
 error2:
-	vkFreeCommandBuffers(ctx->dev, ctx->cmd_pool, 1, (VkCommandBuffer[]){dc->cmd});
+	vkDestroyBuffer(ctx->dev, st->buffer, NULL);
+	vkFreeMemory(ctx->dev, st->memory, NULL);
 error1:
-	free(dc);
+	free(st);
 error0:
 	return NULL;
 }
 
-static int
-init_image(struct context *ctx, struct image *img, VkFormat format, int flags)
+/*
+Suballocate size bytes of staging memory for the next transfer
+submission from the current staging buffer, continuing in one the GPU
+is done with, or a new one, once it is full. The lock must be held.
+*/
+static char *
+alloc_staging(struct context *ctx, size_t size, VkBuffer *buffer, VkDeviceSize *offset)
 {
-	VkResult res;
+	struct staging **p, *st;
+	uint64_t done;
 
-	if (flags & (BLT_IMAGE_SRC|BLT_IMAGE_DST)) {
-		res = vkCreateImageView(ctx->dev, &(VkImageViewCreateInfo){
-			.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+	if (size > STAGING_SIZE) {
+		st = new_staging(ctx, size);
+		if (!st)
+			return NULL;
+		st->seq = ctx->xfer_seq + 1;
+		st->next = ctx->staging_pool;
+		ctx->staging_pool = st;
+		*buffer = st->buffer;
+		*offset = 0;
+		return st->map;
+	}
+	if (!ctx->staging || ctx->staging_used + size > STAGING_SIZE) {
+		if (vkGetSemaphoreCounterValue(ctx->dev, ctx->xfer_timeline, &done) != VK_SUCCESS)
+			return NULL;
+		for (p = &ctx->staging_pool; *p; p = &(*p)->next) {
+			if ((*p)->size == STAGING_SIZE && (*p)->seq <= done)
+				break;
+		}
+		if (*p) {
+			st = *p;
+			*p = st->next;
+		} else {
+			st = new_staging(ctx, STAGING_SIZE);
+			if (!st)
+				return NULL;
+		}
+		/* the full one is in use until the next transfer submission completes */
+		if (ctx->staging) {
+			ctx->staging->seq = ctx->xfer_seq + 1;
+			ctx->staging->next = ctx->staging_pool;
+			ctx->staging_pool = ctx->staging;
+		}
+		ctx->staging = st;
+		ctx->staging_used = 0;
+	}
+	*buffer = ctx->staging->buffer;
+	*offset = ctx->staging_used;
+	/* copies must start at a multiple of the pixel size */
+	ctx->staging_used = (ctx->staging_used + size + 15) & ~(size_t)15;
+	return ctx->staging->map + *offset;
+}
+
+/*
+Find command buffers for a transfer submission that the GPU is done
+with, or allocate new ones. The lock must be held.
+*/
+static struct transfer *
+get_transfer(struct context *ctx)
+{
+	struct transfer *t;
+	uint64_t done, acquire_done;
+	VkResult res;
+
+	if (vkGetSemaphoreCounterValue(ctx->dev, ctx->xfer_timeline, &done) != VK_SUCCESS)
+		return NULL;
+	if (vkGetSemaphoreCounterValue(ctx->dev, ctx->timeline, &acquire_done) != VK_SUCCESS)
+		return NULL;
+	for (t = ctx->transfer; t; t = t->next) {
+		if (t->seq <= done && t->acquire_seq <= acquire_done)
+			return t;
+	}
+	t = malloc(sizeof(*t));
+	if (!t)
+		return NULL;
+	res = vkAllocateCommandBuffers(ctx->dev, &(VkCommandBufferAllocateInfo){
+		.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+		.commandPool = ctx->xfer_pool,
+		.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+		.commandBufferCount = 1,
+	}, &t->cmd);
+	if (res != VK_SUCCESS) {
+		free(t);
+		return NULL;
+	}
+	t->release = VK_NULL_HANDLE;
+	t->acquire = VK_NULL_HANDLE;
+	t->next = ctx->transfer;
+	ctx->transfer = t;
+	return t;
+}
+
+/* record a command buffer of ctx with image barriers, allocating it if necessary */
+static int
+record_barriers(struct context *ctx, VkCommandBuffer *cmd, uint32_t len, const VkImageMemoryBarrier2 *barrier)
+{
+	VkResult res;
+
+	if (!*cmd) {
+		res = vkAllocateCommandBuffers(ctx->dev, &(VkCommandBufferAllocateInfo){
+			.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+			.commandPool = ctx->cmd_pool,
+			.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+			.commandBufferCount = 1,
+		}, cmd);
+		if (res != VK_SUCCESS)
+			return -1;
+	}
+	res = vkBeginCommandBuffer(*cmd, &(VkCommandBufferBeginInfo){
+		.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+		.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+	});
+	if (res != VK_SUCCESS)
+		return -1;
+	vkCmdPipelineBarrier2(*cmd, &(VkDependencyInfo){
+		.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+		.imageMemoryBarrierCount = len,
+		.pImageMemoryBarriers = barrier,
+	});
+	res = vkEndCommandBuffer(*cmd);
+	if (res != VK_SUCCESS)
+		return -1;
+	return 0;
+}
+
+/*
+Add a copy between rect of img and staging memory to the next transfer
+submission, and return the staging memory, in rows of the width of
+rect. A write to img that overlaps an earlier one submits that first.
+Later uses of img wait for the transfer submission, and find it in
+its resting layout. The lock must be held.
+*/
+static char *
+add_copy(struct context *ctx, struct image *img, const struct blt_rect *rect, bool write)
+{
+	struct transfer_image *ti;
+	const VkBufferImageCopy *c;
+	VkBuffer buffer;
+	VkDeviceSize offset;
+	size_t i, cap;
+	char *map;
+	void *p;
+
+	for (ti = ctx->xfer_img; ti < ctx->xfer_img + ctx->xfer_img_len; ++ti) {
+		if (ti->img == img)
+			break;
+	}
+	if (ti < ctx->xfer_img + ctx->xfer_img_len && ti->write && write) {
+		for (i = 0; i < ti->copy_len; ++i) {
+			c = &ti->copy[i];
+			if (rect->x0 < c->imageOffset.x + (int)c->imageExtent.width && c->imageOffset.x < rect->x1 &&
+			    rect->y0 < c->imageOffset.y + (int)c->imageExtent.height && c->imageOffset.y < rect->y1)
+				break;
+		}
+		if (i < ti->copy_len) {
+			if (submit_transfers(ctx) < 0)
+				return NULL;
+			ti = ctx->xfer_img;
+		}
+	} else if (ti < ctx->xfer_img + ctx->xfer_img_len) {
+		if (submit_transfers(ctx) < 0)
+			return NULL;
+		ti = ctx->xfer_img;
+	}
+	map = alloc_staging(ctx, (size_t)img->fmt->size * (rect->x1 - rect->x0) * (rect->y1 - rect->y0), &buffer, &offset);
+	if (!map)
+		return NULL;
+	if (ti == ctx->xfer_img + ctx->xfer_img_len) {
+		if (ctx->xfer_img_len == ctx->xfer_img_cap) {
+			cap = ctx->xfer_img_cap ? ctx->xfer_img_cap * 2 : 4;
+			p = reallocarray(ctx->xfer_img, cap, sizeof(ctx->xfer_img[0]));
+			if (!p)
+				return NULL;
+			ctx->xfer_img = p;
+			/* the copies of each entry are kept for later submissions */
+			memset(ctx->xfer_img + ctx->xfer_img_cap, 0, (cap - ctx->xfer_img_cap) * sizeof(ctx->xfer_img[0]));
+			ctx->xfer_img_cap = cap;
+			ti = ctx->xfer_img + ctx->xfer_img_len;
+		}
+		ti->img = img;
+		ti->layout = img->layout;
+		ti->write = write;
+		ti->copy_len = 0;
+		++ctx->xfer_img_len;
+	}
+	if (ti->copy_len == ti->copy_cap) {
+		cap = ti->copy_cap ? ti->copy_cap * 2 : 4;
+		p = reallocarray(ti->copy, cap, sizeof(ti->copy[0]));
+		if (!p)
+			return NULL;
+		ti->copy = p;
+		p = reallocarray(ti->buffer, cap, sizeof(ti->buffer[0]));
+		if (!p)
+			return NULL;
+		ti->buffer = p;
+		ti->copy_cap = cap;
+	}
+	ti->buffer[ti->copy_len] = buffer;
+	ti->copy[ti->copy_len++] = (VkBufferImageCopy){
+		.bufferOffset = offset,
+		.imageSubresource = {
+			.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+			.layerCount = 1,
+		},
+		.imageOffset = {rect->x0, rect->y0, 0},
+		.imageExtent = {rect->x1 - rect->x0, rect->y1 - rect->y0, 1},
+	};
+	img->layout = resting_layout(img);
+	img->xfer_seq = ctx->xfer_seq + 1;
+	return map;
+}
+
+/*
+Submit the copies added since the last transfer submission on the
+transfer queue, after all rendering submitted so far, with a copy
+command for each run of regions of an image in the same staging
+buffer. If the transfer queue is in another family, the images are
+released from the graphics queue family before, and acquired back in
+their resting layouts after, by submissions of their own, which the
+draw contexts that use them follow on the graphics queue. The lock
+must be held.
+*/
+static int
+submit_transfers(struct context *ctx)
+{
+	VkImageSubresourceRange range = {
+		.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+		.levelCount = 1,
+		.layerCount = 1,
+	};
+	bool other = ctx->xfer_index != ctx->queue_index, host = false;
+	struct transfer_image *ti, *end = ctx->xfer_img + ctx->xfer_img_len;
+	VkImageMemoryBarrier2 *barrier;
+	VkImageLayout layout;
+	struct transfer *t;
+	size_t i, j, n;
+	VkResult res;
+
+	if (ctx->xfer_img_len == 0)
+		return 0;
+	t = get_transfer(ctx);
+	if (!t)
+		return -1;
+	barrier = reallocarray(NULL, ctx->xfer_img_len, sizeof(barrier[0]));
+	if (!barrier)
+		return -1;
+	/* from here on, t may be in use until the current timeline values */
+	t->seq = ctx->xfer_seq;
+	t->acquire_seq = ctx->seq;
+	/*
+	Images with undefined contents have no owner, so the transfer
+	queue can use them without an acquire, but it owns them after.
+	*/
+	n = 0;
+	for (ti = ctx->xfer_img; other && ti < end; ++ti) {
+		if (ti->layout == VK_IMAGE_LAYOUT_UNDEFINED)
+			continue;
+		barrier[n++] = (VkImageMemoryBarrier2){
+			.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
+			.srcStageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+			.srcAccessMask = VK_ACCESS_2_MEMORY_WRITE_BIT,
+			.oldLayout = ti->layout,
+			.newLayout = ti->write ? VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL : VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+			.srcQueueFamilyIndex = ctx->queue_index,
+			.dstQueueFamilyIndex = ctx->xfer_index,
+			.image = ti->img->vk,
+			.subresourceRange = range,
+		};
+	}
+	/* the last transfer may still use them */
+	if (n > 0 && (record_barriers(ctx, &t->release, n, barrier) < 0 || submit_ready(ctx, &(VkSemaphoreSubmitInfo){
+		.sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+		.semaphore = ctx->xfer_timeline,
+		.value = ctx->xfer_seq,
+		.stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+	}, t->release) < 0))
+		goto error0;
+
+	res = vkBeginCommandBuffer(t->cmd, &(VkCommandBufferBeginInfo){
+		.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+		.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+	});
+	if (res != VK_SUCCESS)
+		goto error0;
+	for (ti = ctx->xfer_img, n = 0; ti < end; ++ti, ++n) {
+		barrier[n] = (VkImageMemoryBarrier2){
+			.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
+			.srcStageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+			.srcAccessMask = VK_ACCESS_2_MEMORY_WRITE_BIT,
+			.dstStageMask = VK_PIPELINE_STAGE_2_COPY_BIT,
+			.dstAccessMask = ti->write ? VK_ACCESS_2_TRANSFER_WRITE_BIT : VK_ACCESS_2_TRANSFER_READ_BIT,
+			.oldLayout = ti->layout,
+			.newLayout = ti->write ? VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL : VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+			.srcQueueFamilyIndex = other && ti->layout != VK_IMAGE_LAYOUT_UNDEFINED ? ctx->queue_index : VK_QUEUE_FAMILY_IGNORED,
+			.dstQueueFamilyIndex = other && ti->layout != VK_IMAGE_LAYOUT_UNDEFINED ? ctx->xfer_index : VK_QUEUE_FAMILY_IGNORED,
+			.image = ti->img->vk,
+			.subresourceRange = range,
+		};
+	}
+	vkCmdPipelineBarrier2(t->cmd, &(VkDependencyInfo){
+		.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+		.imageMemoryBarrierCount = n,
+		.pImageMemoryBarriers = barrier,
+	});
+	for (ti = ctx->xfer_img; ti < end; ++ti) {
+		layout = ti->write ? VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL : VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+		for (i = 0; i < ti->copy_len; i = j) {
+			for (j = i + 1; j < ti->copy_len && ti->buffer[j] == ti->buffer[i]; ++j)
+				;
+			if (ti->write)
+				vkCmdCopyBufferToImage(t->cmd, ti->buffer[i], ti->img->vk, layout, j - i, &ti->copy[i]);
+			else
+				vkCmdCopyImageToBuffer(t->cmd, ti->img->vk, layout, ti->buffer[i], j - i, &ti->copy[i]);
+		}
+		host |= !ti->write;
+	}
+	for (ti = ctx->xfer_img, n = 0; ti < end; ++ti, ++n) {
+		barrier[n] = (VkImageMemoryBarrier2){
+			.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
+			.srcStageMask = VK_PIPELINE_STAGE_2_COPY_BIT,
+			.srcAccessMask = ti->write ? VK_ACCESS_2_TRANSFER_WRITE_BIT : 0,
+			.dstStageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+			.dstAccessMask = VK_ACCESS_2_MEMORY_READ_BIT | VK_ACCESS_2_MEMORY_WRITE_BIT,
+			.oldLayout = ti->write ? VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL : VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+			.newLayout = resting_layout(ti->img),
+			.srcQueueFamilyIndex = other ? ctx->xfer_index : VK_QUEUE_FAMILY_IGNORED,
+			.dstQueueFamilyIndex = other ? ctx->queue_index : VK_QUEUE_FAMILY_IGNORED,
+			.image = ti->img->vk,
+			.subresourceRange = range,
+		};
+	}
+	vkCmdPipelineBarrier2(t->cmd, &(VkDependencyInfo){
+		.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+		.memoryBarrierCount = host ? 1 : 0,
+		.pMemoryBarriers = &(VkMemoryBarrier2){
+			.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER_2,
+			.srcStageMask = VK_PIPELINE_STAGE_2_COPY_BIT,
+			.srcAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT,
+			.dstStageMask = VK_PIPELINE_STAGE_2_HOST_BIT,
+			.dstAccessMask = VK_ACCESS_2_HOST_READ_BIT,
+		},
+		.imageMemoryBarrierCount = n,
+		.pImageMemoryBarriers = barrier,
+	});
+	res = vkEndCommandBuffer(t->cmd);
+	if (res != VK_SUCCESS)
+		goto error0;
+	res = vkQueueSubmit2(ctx->xfer_queue, 1, &(VkSubmitInfo2){
+		.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO_2,
+		.waitSemaphoreInfoCount = 1,
+		.pWaitSemaphoreInfos = &(VkSemaphoreSubmitInfo){
+			.sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+			.semaphore = ctx->timeline,
+			.value = ctx->seq,
+			.stageMask = VK_PIPELINE_STAGE_2_COPY_BIT,
+		},
+		.commandBufferInfoCount = 1,
+		.pCommandBufferInfos = &(VkCommandBufferSubmitInfo){
+			.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_SUBMIT_INFO,
+			.commandBuffer = t->cmd,
+		},
+		.signalSemaphoreInfoCount = 1,
+		.pSignalSemaphoreInfos = &(VkSemaphoreSubmitInfo){
+			.sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+			.semaphore = ctx->xfer_timeline,
+			.value = ctx->xfer_seq + 1,
+			.stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+		},
+	}, VK_NULL_HANDLE);
+	if (res != VK_SUCCESS)
+		goto error0;
+	t->seq = ++ctx->xfer_seq;
+	/* the staging memory used so far is free once this completes */
+	if (ctx->staging)
+		ctx->staging->seq = t->seq;
+	ctx->xfer_img_len = 0;
+	/* the graphics queue must acquire them before their next use */
+	if (other) {
+		for (i = 0; i < n; ++i) {
+			barrier[i].srcStageMask = 0;
+			barrier[i].srcAccessMask = 0;
+		}
+		if (record_barriers(ctx, &t->acquire, n, barrier) < 0 || submit_ready(ctx, &(VkSemaphoreSubmitInfo){
+			.sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+			.semaphore = ctx->xfer_timeline,
+			.value = t->seq,
+			.stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+		}, t->acquire) < 0)
+			goto error1;
+		t->acquire_seq = ctx->seq;
+	}
+	free(barrier);
+	return 0;
+
+error0:
+	/* the copies are dropped, since the images may be destroyed before another attempt */
+	ctx->xfer_img_len = 0;
+error1:
+	t->acquire_seq = ctx->seq;
+	free(barrier);
+	return -1;
+}
+
+static int
+image_write(struct blt_context *ctx_base, struct blt_image *img_base, const struct blt_rect *rect, const void *data, size_t stride)
+{
+	struct context *ctx = (void *)ctx_base;
+	struct image *img = (void *)img_base;
+	const char *src;
+	char *dst, *map;
+	size_t len;
+	bool used;
+	int y;
+
+	if (ctx->parent) {
+		errno = EINVAL;
+		return -1;
+	}
+	len = img->fmt->size * (rect->x1 - rect->x0);
+	if (!(img->usage & VK_IMAGE_USAGE_TRANSFER_DST_BIT)) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	/* the copy follows the rendering submitted before it, which must include what uses img */
+	pthread_mutex_lock(&ctx->lock);
+	used = img->used == ctx->frame + 1;
+	pthread_mutex_unlock(&ctx->lock);
+	if (used && flush(ctx_base) < 0)
+		return -1;
+	pthread_mutex_lock(&ctx->lock);
+	reap_transfers(ctx);
+	map = add_copy(ctx, img, rect, true);
+	pthread_mutex_unlock(&ctx->lock);
+	if (!map)
+		return -1;
+	for (src = data, dst = map, y = rect->y0; y < rect->y1; ++y, src += stride, dst += len)
+		memcpy(dst, src, len);
+	return 0;
+}
+
+static int
+image_read(struct blt_context *ctx_base, struct blt_image *img_base, const struct blt_rect *rect, void *data, size_t stride)
+{
+	struct context *ctx = (void *)ctx_base;
+	struct image *img = (void *)img_base;
+	const char *src, *map;
+	char *dst;
+	size_t len;
+	uint64_t seq;
+	int y;
+	VkResult res;
+
+	if (ctx->parent) {
+		errno = EINVAL;
+		return -1;
+	}
+	len = img->fmt->size * (rect->x1 - rect->x0);
+	if (!(img->usage & VK_IMAGE_USAGE_TRANSFER_SRC_BIT)) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	if (flush(ctx_base) < 0)
+		return -1;
+	pthread_mutex_lock(&ctx->lock);
+	reap_transfers(ctx);
+	map = add_copy(ctx, img, rect, false);
+	if (!map || submit_transfers(ctx) < 0) {
+		pthread_mutex_unlock(&ctx->lock);
+		return -1;
+	}
+	seq = ctx->xfer_seq;
+	pthread_mutex_unlock(&ctx->lock);
+	res = vkWaitSemaphores(ctx->dev, &(VkSemaphoreWaitInfo){
+		.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+		.semaphoreCount = 1,
+		.pSemaphores = &ctx->xfer_timeline,
+		.pValues = &seq,
+	}, UINT64_MAX);
+	if (res != VK_SUCCESS)
+		return -1;
+	for (src = map, dst = data, y = rect->y0; y < rect->y1; ++y, src += len, dst += stride)
+		memcpy(dst, src, len);
+	return 0;
+}
+
+static const struct blt_image_impl image_impl = {
+	.destroy = image_destroy,
+	.export_dmabuf = image_export_dmabuf,
+	.export_fence = image_export_fence,
+	.import_fence = image_import_fence,
+	.write = image_write,
+	.read = image_read,
+};
+
+/* destroy the Vulkan objects owned by img, but not the image itself */
+static void
+finish_image(struct context *ctx, struct image *img)
+{
+	struct draw_context *dc = img->draw_ctx;
+	struct context *shared = owner(ctx);
+	struct sync_point *spare;
+	struct vertex_buffer *vb;
+	size_t cap;
+
+	if (dc) {
+		pthread_mutex_lock(&shared->lock);
+		if (shared->spare_len == shared->spare_cap) {
+			cap = shared->spare_cap ? shared->spare_cap * 2 : 8;
+			spare = reallocarray(shared->spare, cap, sizeof(shared->spare[0]));
+			if (spare) {
+				shared->spare = spare;
+				shared->spare_cap = cap;
+			}
+		}
+		if (shared->spare_len < shared->spare_cap)
+			shared->spare[shared->spare_len++] = (struct sync_point){dc->timeline, dc->seq};
+		else
+			vkDestroySemaphore(ctx->dev, dc->timeline, NULL);
+		while (dc->used) {
+			vb = dc->used;
+			dc->used = vb->next;
+			vb->seq = shared->seq + 1;
+			vb->next = shared->vertex_pool;
+			shared->vertex_pool = vb;
+		}
+		pthread_mutex_unlock(&shared->lock);
+		free(dc->wait);
+		free(dc);
+	}
+	free(img->reader);
+	vkDestroyImageView(ctx->dev, img->view, NULL);
+	vkDestroyImageView(ctx->dev, img->src_view, NULL);
+	vkDestroyImageView(ctx->dev, img->alpha_view, NULL);
+	vkDestroySemaphore(ctx->dev, img->signal, NULL);
+	vkDestroySemaphore(ctx->dev, img->wait, NULL);
+	vkDestroySemaphore(ctx->dev, img->acquired, NULL);
+	vkDestroySemaphore(ctx->dev, img->present, NULL);
+}
+
+/* destroy the images on the destroyed list that the GPU is done with */
+static void
+reap_images(struct context *ctx)
+{
+	struct image **p, *img, *done = NULL;
+	uint64_t seq, xfer_seq;
+
+	if (vkGetSemaphoreCounterValue(ctx->dev, ctx->timeline, &seq) != VK_SUCCESS)
+		return;
+	if (vkGetSemaphoreCounterValue(ctx->dev, ctx->xfer_timeline, &xfer_seq) != VK_SUCCESS)
+		return;
+	pthread_mutex_lock(&ctx->lock);
+	for (p = &ctx->destroyed; *p;) {
+		img = *p;
+		if (img->destroy_seq == 0 || img->destroy_seq > seq || img->xfer_seq > xfer_seq) {
+			p = &img->next;
+			continue;
+		}
+		*p = img->next;
+		img->next = done;
+		done = img;
+	}
+	pthread_mutex_unlock(&ctx->lock);
+	/* finish_image takes the lock */
+	while (done) {
+		img = done;
+		done = img->next;
+		finish_image(ctx, img);
+		/* images of the application have no memory of ours, and aren't ours */
+		if (img->memory) {
+			vkDestroyImage(ctx->dev, img->vk, NULL);
+			vkFreeMemory(ctx->dev, img->memory, NULL);
+		}
+		free(img);
+	}
+}
+
+static void
+destroy_swapchain(struct context *ctx, struct swapchain *sc)
+{
+	uint32_t i;
+
+	for (i = 0; i < sc->img_len; ++i)
+		finish_image(ctx, &sc->img[i]);
+	vkDestroySwapchainKHR(ctx->dev, sc->vk, NULL);
+	free(sc->img);
+	free(sc->age);
+	free(sc);
+}
+
+/* destroy the retired swapchains that the GPU is done with */
+static void
+reap_swapchains(struct context *ctx, struct surface *srf)
+{
+	struct swapchain **sc, *done;
+	uint64_t seq;
+
+	if (vkGetSemaphoreCounterValue(ctx->dev, ctx->timeline, &seq) != VK_SUCCESS)
+		return;
+	for (sc = &srf->retired; *sc;) {
+		if ((*sc)->seq > seq) {
+			sc = &(*sc)->next;
+			continue;
+		}
+		done = *sc;
+		*sc = done->next;
+		destroy_swapchain(ctx, done);
+	}
+}
+
+static void
+surface_destroy(struct blt_context *ctx_base, struct blt_surface *srf_base)
+{
+	struct context *ctx = (void *)ctx_base;
+	struct surface *srf = (void *)srf_base;
+	struct swapchain *sc;
+
+	flush(ctx_base);
+	vkWaitSemaphores(ctx->dev, &(VkSemaphoreWaitInfo){
+		.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+		.semaphoreCount = 1,
+		.pSemaphores = &ctx->timeline,
+		.pValues = &ctx->seq,
+	}, UINT64_MAX);
+	while (srf->retired) {
+		sc = srf->retired;
+		srf->retired = sc->next;
+		destroy_swapchain(ctx, sc);
+	}
+	if (srf->swapchain)
+		destroy_swapchain(ctx, srf->swapchain);
+	vkDestroySemaphore(ctx->dev, srf->spare, NULL);
+	vkDestroySurfaceKHR(ctx->instance, srf->vk, NULL);
+	free(srf);
+}
+
+static struct blt_image *
+acquire(struct blt_context *ctx_base, struct blt_surface *srf_base, int *age)
+{
+	struct context *ctx = (void *)ctx_base;
+	struct surface *srf = (void *)srf_base;
+	struct image *img;
+	VkSemaphore sem;
+	uint32_t idx;
+	VkResult res;
+
+	if (ctx->parent) {
+		errno = EINVAL;
+		return NULL;
+	}
+	reap_swapchains(ctx, srf);
+	if (srf->stale && create_swapchain(ctx, srf) < 0)
+		return NULL;
+	if (!srf->spare) {
+		res = vkCreateSemaphore(ctx->dev, &(VkSemaphoreCreateInfo){
+			.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+		}, NULL, &srf->spare);
+		if (res != VK_SUCCESS)
+			return NULL;
+	} else {
+		/* the last submission that waited on it was a few frames ago */
+		res = vkWaitSemaphores(ctx->dev, &(VkSemaphoreWaitInfo){
+			.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+			.semaphoreCount = 1,
+			.pSemaphores = &ctx->timeline,
+			.pValues = &srf->spare_seq,
+		}, UINT64_MAX);
+		if (res != VK_SUCCESS)
+			return NULL;
+	}
+	res = vkAcquireNextImageKHR(ctx->dev, srf->swapchain->vk, -1, srf->spare, VK_NULL_HANDLE, &idx);
+	if (res == VK_ERROR_OUT_OF_DATE_KHR) {
+		if (create_swapchain(ctx, srf) < 0)
+			return NULL;
+		res = vkAcquireNextImageKHR(ctx->dev, srf->swapchain->vk, -1, srf->spare, VK_NULL_HANDLE, &idx);
+	}
+	if (res == VK_SUBOPTIMAL_KHR)
+		srf->stale = true;
+	else if (res != VK_SUCCESS)
+		return NULL;
+	img = &srf->swapchain->img[idx];
+	/* all uses of the image wait for a single wait on the semaphore */
+	pthread_mutex_lock(&ctx->lock);
+	if (submit_ready(ctx, &(VkSemaphoreSubmitInfo){
+		.sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+		.semaphore = srf->spare,
+		.stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+	}, VK_NULL_HANDLE) < 0) {
+		pthread_mutex_unlock(&ctx->lock);
+		return NULL;
+	}
+	img->ready = ctx->seq;
+	pthread_mutex_unlock(&ctx->lock);
+	sem = img->acquired;
+	img->acquired = srf->spare;
+	srf->spare = sem;
+	srf->spare_seq = img->acquire_seq;
+	img->acquire_seq = img->ready;
+	if (age)
+		*age = srf->swapchain->age[idx];
+	return &img->base;
+}
+
+/*
+Convert damage to present regions clipped to img. If there are too
+many rectangles, use their bounding box instead.
+*/
+static uint32_t
+present_rects(struct image *img, struct pixman_region32 *damage, VkRectLayerKHR *rect, size_t len)
+{
+	pixman_box32_t *box;
+	int i, n;
+	uint32_t rect_len = 0;
+	int32_t x0, y0, x1, y1;
+
+	box = pixman_region32_rectangles(damage, &n);
+	if (n > len) {
+		box = pixman_region32_extents(damage);
+		n = 1;
+	}
+	for (i = 0; i < n; ++i) {
+		x0 = box[i].x1 > 0 ? box[i].x1 : 0;
+		y0 = box[i].y1 > 0 ? box[i].y1 : 0;
+		x1 = box[i].x2 < img->base.width ? box[i].x2 : img->base.width;
+		y1 = box[i].y2 < img->base.height ? box[i].y2 : img->base.height;
+		if (x0 >= x1 || y0 >= y1)
+			continue;
+		rect[rect_len++] = (VkRectLayerKHR){
+			.offset = {x0, y0},
+			.extent = {x1 - x0, y1 - y0},
+		};
+	}
+	return rect_len;
+}
+
+static int
+present(struct blt_context *ctx_base, struct blt_surface *srf_base, struct blt_image *img_base, struct pixman_region32 *damage, uint64_t *id)
+{
+	struct context *ctx = (void *)ctx_base;
+	struct surface *srf = (void *)srf_base;
+	struct image *img = (void *)img_base;
+	struct swapchain *sc;
+	VkRectLayerKHR rect[32];
+	VkPresentRegionKHR region;
+	VkPresentRegionsKHR regions = {
+		.sType = VK_STRUCTURE_TYPE_PRESENT_REGIONS_KHR,
+		.swapchainCount = 1,
+		.pRegions = &region,
+	};
+	VkPresentIdKHR present_id = {
+		.sType = VK_STRUCTURE_TYPE_PRESENT_ID_KHR,
+		.swapchainCount = 1,
+	};
+	VkPresentTimeGOOGLE present_time;
+	VkPresentTimesInfoGOOGLE present_times = {
+		.sType = VK_STRUCTURE_TYPE_PRESENT_TIMES_INFO_GOOGLE,
+		.swapchainCount = 1,
+		.pTimes = &present_time,
+	};
+	const void *next = NULL;
+	uint64_t next_id;
+	VkCommandBuffer cmd;
+	VkResult res;
+	uint32_t i, idx;
+	size_t index;
+
+	if (ctx->parent) {
+		errno = EINVAL;
+		return -1;
+	}
+	/* the image may be from a swapchain retired since it was acquired */
+	for (sc = srf->swapchain; sc; sc = sc == srf->swapchain ? srf->retired : sc->next) {
+		if (img >= sc->img && img < sc->img + sc->img_len)
+			break;
+	}
+	if (!sc) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (flush(ctx_base) < 0)
+		return -1;
+	if (!img->present) {
+		res = vkCreateSemaphore(ctx->dev, &(VkSemaphoreCreateInfo){
+			.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+		}, NULL, &img->present);
+		if (res != VK_SUCCESS)
+			return -1;
+	}
+	/* the image must be in the layout for presentation */
+	pthread_mutex_lock(&ctx->lock);
+	if (get_command_buffer(ctx, &index) < 0) {
+		pthread_mutex_unlock(&ctx->lock);
+		return -1;
+	}
+	cmd = ctx->cmd[index];
+	res = vkBeginCommandBuffer(cmd, &(VkCommandBufferBeginInfo){
+		.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+		.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+	});
+	if (res != VK_SUCCESS)
+		goto error0;
+	vkCmdPipelineBarrier2(cmd, &(VkDependencyInfo){
+		.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+		.imageMemoryBarrierCount = 1,
+		.pImageMemoryBarriers = &(VkImageMemoryBarrier2){
+			.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
+			.srcStageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+			.srcAccessMask = VK_ACCESS_2_MEMORY_WRITE_BIT,
+			.oldLayout = img->layout,
+			.newLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
 			.image = img->vk,
-			.viewType = VK_IMAGE_VIEW_TYPE_2D,
-			.format = format,
 			.subresourceRange = {
 				.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
 				.levelCount = 1,
 				.layerCount = 1,
 			},
-		}, NULL, &img->view);
+		},
+	});
+	res = vkEndCommandBuffer(cmd);
+	if (res != VK_SUCCESS)
+		goto error0;
+	/*
+	Presentation can only wait on binary semaphores, so signal one
+	from the submission of the transition, after the rendering,
+	which also comes after the acquisition.
+	*/
+	res = vkQueueSubmit2(ctx->queue, 1, &(VkSubmitInfo2){
+		.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO_2,
+		.waitSemaphoreInfoCount = 1,
+		.pWaitSemaphoreInfos = &(VkSemaphoreSubmitInfo){
+			.sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+			.semaphore = ctx->timeline,
+			.value = ctx->seq,
+			.stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+		},
+		.commandBufferInfoCount = 1,
+		.pCommandBufferInfos = &(VkCommandBufferSubmitInfo){
+			.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_SUBMIT_INFO,
+			.commandBuffer = cmd,
+		},
+		.signalSemaphoreInfoCount = 2,
+		.pSignalSemaphoreInfos = (VkSemaphoreSubmitInfo[]){
+			{
+				.sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+				.semaphore = img->present,
+				.stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+			},
+			{
+				.sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+				.semaphore = ctx->timeline,
+				.value = ctx->seq + 1,
+				.stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+			},
+		},
+	}, VK_NULL_HANDLE);
+	if (res != VK_SUCCESS)
+		goto error0;
+	ctx->cmd_seq[index] = ++ctx->seq;
+	pthread_mutex_unlock(&ctx->lock);
+	/* the next draw to it transitions it back */
+	img->layout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+	if (sc != srf->swapchain)
+		sc->seq = ctx->seq;
+	idx = img - sc->img;
+	next_id = srf->present_id + 1;
+	if (ctx->present_wait) {
+		present_id.pPresentIds = &next_id;
+		next = &present_id;
+	}
+	/* the same id, truncated, identifies the timing of the presentation */
+	if (ctx->display_timing) {
+		present_time = (VkPresentTimeGOOGLE){.presentID = next_id};
+		present_times.pNext = next;
+		next = &present_times;
+	}
+	/* zero rectangles means that the whole image changed */
+	if (damage && ctx->incremental_present) {
+		region.rectangleCount = present_rects(img, damage, rect, LEN(rect));
+		region.pRectangles = rect;
+		regions.pNext = next;
+		next = &regions;
+	}
+	res = vkQueuePresentKHR(ctx->queue, &(VkPresentInfoKHR){
+		.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR,
+		.pNext = next,
+		.waitSemaphoreCount = 1,
+		.pWaitSemaphores = &img->present,
+		.swapchainCount = 1,
+		.pSwapchains = &sc->vk,
+		.pImageIndices = (uint32_t[]){idx},
+	});
+	switch (res) {
+	case VK_SUCCESS:
+		break;
+	case VK_SUBOPTIMAL_KHR:
+	case VK_ERROR_OUT_OF_DATE_KHR:
+		/* the next acquire recreates the swapchain */
+		if (sc == srf->swapchain)
+			srf->stale = true;
+		/*
+		An out of date frame is dropped, which isn't an error, but
+		it isn't given an id since it will never be shown.
+		*/
+		if (res == VK_ERROR_OUT_OF_DATE_KHR) {
+			if (id)
+				*id = 0;
+			return 0;
+		}
+		break;
+	default:
+		return -1;
+	}
+	srf->present_id = next_id;
+	srf->present_seq[next_id % LEN(srf->present_seq)] = ctx->seq;
+	srf->present_time[next_id % LEN(srf->present_time)] = 0;
+	if (id)
+		*id = next_id;
+	if (!sc->first_id)
+		sc->first_id = next_id;
+	for (i = 0; i < sc->img_len; ++i)
+		++sc->age[i];
+	sc->age[idx] = 0;
+	return 0;
+
+error0:
+	ctx->cmd_seq[index] = ctx->seq;
+	pthread_mutex_unlock(&ctx->lock);
+	return -1;
+}
+
+/*
+Record the times that the presentations to the current swapchain of
+srf were shown at, which VK_GOOGLE_display_timing reports once.
+*/
+static void
+get_present_times(struct context *ctx, struct surface *srf)
+{
+	VkPastPresentationTimingGOOGLE timing[8];
+	uint32_t i, len;
+	uint64_t id;
+	VkResult res;
+
+	do {
+		len = LEN(timing);
+		res = ctx->get_past_presentation_timing(ctx->dev, srf->swapchain->vk, &len, timing);
+		if (res != VK_SUCCESS && res != VK_INCOMPLETE)
+			return;
+		for (i = 0; i < len; ++i) {
+			/* the id was truncated to 32 bits, and is at most the last one */
+			id = srf->present_id - (uint32_t)(srf->present_id - timing[i].presentID);
+			if (srf->present_id - id < LEN(srf->present_time))
+				srf->present_time[id % LEN(srf->present_time)] = timing[i].actualPresentTime;
+		}
+	} while (res == VK_INCOMPLETE);
+}
+
+/*
+Wait until the presentation with the given id has been shown. Without
+VK_KHR_present_wait, or if the swapchain it was presented to has been
+retired, estimate it by when rendering completed instead. The time it
+was shown is the one VK_GOOGLE_display_timing reports, or else an
+estimate of it by when the wait returned.
+*/
+static int
+wait_presented(struct blt_context *ctx_base, struct blt_surface *srf_base, uint64_t id, uint64_t timeout, uint64_t *time)
+{
+	struct context *ctx = (void *)ctx_base;
+	struct surface *srf = (void *)srf_base;
+	struct timespec ts;
+	VkResult res = VK_ERROR_OUT_OF_DATE_KHR;
+	bool current;
+
+	if (id == 0 || id > srf->present_id) {
+		errno = EINVAL;
+		return -1;
+	}
+	current = srf->swapchain->first_id && id >= srf->swapchain->first_id;
+	if (ctx->present_wait && current)
+		res = ctx->wait_for_present(ctx->dev, srf->swapchain->vk, id, timeout);
+	if (res == VK_ERROR_OUT_OF_DATE_KHR) {
+		/* presentations older than that have completed long ago */
+		if (srf->present_id - id < LEN(srf->present_seq)) {
+			res = vkWaitSemaphores(ctx->dev, &(VkSemaphoreWaitInfo){
+				.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+				.semaphoreCount = 1,
+				.pSemaphores = &ctx->timeline,
+				.pValues = &srf->present_seq[id % LEN(srf->present_seq)],
+			}, timeout);
+		} else {
+			res = VK_SUCCESS;
+		}
+	}
+	switch (res) {
+	case VK_SUCCESS:
+	case VK_SUBOPTIMAL_KHR:
+		break;
+	case VK_TIMEOUT:
+		errno = ETIMEDOUT;
+		return -1;
+	default:
+		return -1;
+	}
+	if (!time)
+		return 0;
+	if (ctx->display_timing && current && srf->present_id - id < LEN(srf->present_time)) {
+		get_present_times(ctx, srf);
+		/* on Linux, the presentation engine uses CLOCK_MONOTONIC */
+		*time = srf->present_time[id % LEN(srf->present_time)];
+		if (*time)
+			return 0;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	*time = ts.tv_sec * 1000000000ull + ts.tv_nsec;
+	return 0;
+}
+
+static const VkPresentModeKHR present_modes[] = {
+	[BLT_PRESENT_FIFO] = VK_PRESENT_MODE_FIFO_KHR,
+	[BLT_PRESENT_FIFO_RELAXED] = VK_PRESENT_MODE_FIFO_RELAXED_KHR,
+	[BLT_PRESENT_MAILBOX] = VK_PRESENT_MODE_MAILBOX_KHR,
+	[BLT_PRESENT_IMMEDIATE] = VK_PRESENT_MODE_IMMEDIATE_KHR,
+};
+
+static int
+set_present_mode(struct blt_context *ctx_base, struct blt_surface *srf_base, int mode, int images)
+{
+	struct context *ctx = (void *)ctx_base;
+	struct surface *srf = (void *)srf_base;
+	VkPresentModeKHR *modes;
+	uint32_t i, modes_len;
+	VkResult res;
+
+	if (ctx->parent) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (mode < 0 || mode >= LEN(present_modes) || images < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	res = vkGetPhysicalDeviceSurfacePresentModesKHR(ctx->phys, srf->vk, &modes_len, NULL);
+	if (res != VK_SUCCESS)
+		return -1;
+	modes = reallocarray(NULL, modes_len, sizeof(modes[0]));
+	if (!modes)
+		return -1;
+	res = vkGetPhysicalDeviceSurfacePresentModesKHR(ctx->phys, srf->vk, &modes_len, modes);
+	if (res != VK_SUCCESS) {
+		free(modes);
+		return -1;
+	}
+	for (i = 0; i < modes_len; ++i) {
+		if (modes[i] == present_modes[mode])
+			break;
+	}
+	free(modes);
+	if (i == modes_len) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	srf->info.presentMode = present_modes[mode];
+	srf->images = images;
+	return create_swapchain(ctx, srf);
+}
+
+static int
+resize(struct blt_context *ctx_base, struct blt_surface *srf_base, int width, int height)
+{
+	struct context *ctx = (void *)ctx_base;
+	struct surface *srf = (void *)srf_base;
+
+	if (ctx->parent) {
+		errno = EINVAL;
+		return -1;
+	}
+	srf->width = width;
+	srf->height = height;
+	return create_swapchain(ctx, srf);
+}
+
+static const struct blt_surface_impl surface_impl = {
+	.destroy = surface_destroy,
+	.acquire = acquire,
+	.present = present,
+	.set_present_mode = set_present_mode,
+	.resize = resize,
+	.wait_presented = wait_presented,
+};
+
+static uint32_t
+find_memory_type(struct context *ctx, uint32_t bits, VkMemoryPropertyFlags flags)
+{
+	VkPhysicalDeviceMemoryProperties props;
+	uint32_t i;
+
+	vkGetPhysicalDeviceMemoryProperties(ctx->phys, &props);
+	for (i = 0; i < props.memoryTypeCount; ++i) {
+		if (bits & (1 << i) && (props.memoryTypes[i].propertyFlags & flags) == flags)
+			return i;
+	}
+	return -1;
+}
+
+static int
+alloc_buffer(struct context *ctx, size_t size, VkBufferUsageFlags usage, VkBuffer *buf, VkDeviceMemory *mem)
+{
+	VkResult res;
+	VkMemoryRequirements reqs;
+	VkMemoryPropertyFlags props = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+	uint32_t mem_type;
+
+	res = vkCreateBuffer(ctx->dev, &(VkBufferCreateInfo){
+		.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+		.size = size,
+		.usage = usage,
+		.sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+	}, NULL, buf);
+	if (res != VK_SUCCESS)
+		goto error0;
+	vkGetBufferMemoryRequirements(ctx->dev, *buf, &reqs);
+	mem_type = find_memory_type(ctx, reqs.memoryTypeBits, props);
+	if (mem_type == -1)
+		goto error1;
+	res = vkAllocateMemory(ctx->dev, &(VkMemoryAllocateInfo){
+		.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+		.allocationSize = reqs.size,
+		.memoryTypeIndex = mem_type,
+	}, NULL, mem);
+	if (res != VK_SUCCESS)
+		goto error1;
+	res = vkBindBufferMemory(ctx->dev, *buf, *mem, 0);
+	if (res != VK_SUCCESS)
+		goto error2;
+	return VK_SUCCESS;
+
+error2:
+	vkFreeMemory(ctx->dev, *mem, NULL);
+error1:
+	vkDestroyBuffer(ctx->dev, *buf, NULL);
+error0:
+	return -1;
+}
+
+static struct draw_context *
+make_draw_context(struct context *ctx, struct image *img)
+{
+	struct context *shared = owner(ctx);
+	struct draw_context *dc;
+	VkResult res;
+
+	dc = malloc(sizeof(*dc));
+	if (!dc)
+		goto error0;
+	dc->vertex = NULL;
+	dc->vertex_len = 0;
+	dc->vertex_pos = 0;
+	dc->vertex_cap = 0;
+	dc->used = NULL;
+	pthread_mutex_lock(&shared->lock);
+	if (shared->spare_len > 0) {
+		--shared->spare_len;
+		dc->timeline = shared->spare[shared->spare_len].timeline;
+		dc->seq = shared->spare[shared->spare_len].seq;
+	} else {
+		dc->timeline = VK_NULL_HANDLE;
+	}
+	pthread_mutex_unlock(&shared->lock);
+	if (!dc->timeline) {
+		res = vkCreateSemaphore(ctx->dev, &(VkSemaphoreCreateInfo){
+			.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+			.pNext = &(VkSemaphoreTypeCreateInfo){
+				.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO,
+				.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE,
+				.initialValue = 0,
+			},
+		}, NULL, &dc->timeline);
+		if (res != VK_SUCCESS)
+			goto error1;
+		dc->seq = 0;
+	}
+	dc->cmd = VK_NULL_HANDLE;
+	dc->recording = false;
+	dc->pending = false;
+	dc->timing = -1;
+	dc->wait = NULL;
+	dc->wait_len = 0;
+	dc->wait_cap = 0;
+	return dc;
+
+error1:
+	free(dc);
+error0:
+	return NULL;
+}
+
+static VkResult
+create_view(struct context *ctx, struct image *img, const VkComponentMapping *components, VkImageView *view)
+{
+	return vkCreateImageView(ctx->dev, &(VkImageViewCreateInfo){
+		.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+		.image = img->vk,
+		.viewType = VK_IMAGE_VIEW_TYPE_2D,
+		.format = img->fmt->vk,
+		.components = *components,
+		.subresourceRange = {
+			.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+			.levelCount = 1,
+			.layerCount = 1,
+		},
+	}, NULL, view);
+}
+
+static int
+init_image(struct context *ctx, struct image *img, const struct format *fmt, int flags)
+{
+	VkComponentSwizzle alpha;
+	VkResult res;
+
+	img->fmt = fmt;
+	img->layout = VK_IMAGE_LAYOUT_UNDEFINED;
+	img->xfer_seq = 0;
+	img->ready = 0;
+	img->used = 0;
+	img->signal = VK_NULL_HANDLE;
+	img->wait = VK_NULL_HANDLE;
+	img->wait_seq = 0;
+	img->acquired = VK_NULL_HANDLE;
+	img->present = VK_NULL_HANDLE;
+	img->acquire_seq = 0;
+	img->view = VK_NULL_HANDLE;
+	img->src_view = VK_NULL_HANDLE;
+	img->alpha_view = VK_NULL_HANDLE;
+	img->draw_ctx = NULL;
+	img->reader = NULL;
+	img->reader_len = 0;
+	img->reader_cap = 0;
+	if (flags & BLT_IMAGE_DST) {
+		res = create_view(ctx, img, &(VkComponentMapping){0}, &img->view);
 		if (res != VK_SUCCESS)
 			goto error0;
-	} else {
-		img->view = VK_NULL_HANDLE;
+	}
+	if (flags & BLT_IMAGE_SRC) {
+		res = create_view(ctx, img, &fmt->src, &img->src_view);
+		if (res != VK_SUCCESS)
+			goto error1;
+		alpha = fmt->src.a == VK_COMPONENT_SWIZZLE_IDENTITY ? VK_COMPONENT_SWIZZLE_A : fmt->src.a;
+		res = create_view(ctx, img, &(VkComponentMapping){alpha, alpha, alpha, alpha}, &img->alpha_view);
+		if (res != VK_SUCCESS)
+			goto error2;
 	}
 	if (flags & BLT_IMAGE_DST) {
 		img->draw_ctx = make_draw_context(ctx, img);
 		if (!img->draw_ctx)
-			goto error1;
-	} else {
-		img->draw_ctx = NULL;
+			goto error3;
 	}
 	return 0;
 
+error3:
+	vkDestroyImageView(ctx->dev, img->alpha_view, NULL);
+error2:
+	vkDestroyImageView(ctx->dev, img->src_view, NULL);
 error1:
-	if (img->view)
-		vkDestroyImageView(ctx->dev, img->view, NULL);
+	vkDestroyImageView(ctx->dev, img->view, NULL);
 error0:
 	return -1;
 }
 
-static VkFormat
-vulkan_format(uint32_t format)
+/*
+Remove any modifiers from mods that can't be used to create an image
+described by info, and return the number remaining. If there are
+none, errno is set.
+*/
+static size_t
+filter_modifiers(struct context *ctx, const VkImageCreateInfo *info, VkFormatFeatureFlags features, size_t mods_len, uint64_t *mods)
 {
-	switch (format) {
-	case BLT_FMT('X', 'R', '2', '4'):
-	case BLT_FMT('A', 'R', '2', '4'):
-		return VK_FORMAT_B8G8R8A8_UNORM;
-	default:
-		return VK_FORMAT_UNDEFINED;
+	VkResult res;
+	VkDrmFormatModifierPropertiesListEXT list = {
+		.sType = VK_STRUCTURE_TYPE_DRM_FORMAT_MODIFIER_PROPERTIES_LIST_EXT,
+	};
+	VkFormatProperties2 format_props = {
+		.sType = VK_STRUCTURE_TYPE_FORMAT_PROPERTIES_2,
+		.pNext = &list,
+	};
+	VkPhysicalDeviceImageDrmFormatModifierInfoEXT mod_info = {
+		.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_IMAGE_DRM_FORMAT_MODIFIER_INFO_EXT,
+		.sharingMode = info->sharingMode,
+		.queueFamilyIndexCount = info->queueFamilyIndexCount,
+		.pQueueFamilyIndices = info->pQueueFamilyIndices,
+	};
+	VkPhysicalDeviceExternalImageFormatInfo extern_info = {
+		.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTERNAL_IMAGE_FORMAT_INFO,
+		.pNext = &mod_info,
+		.handleType = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT,
+	};
+	VkPhysicalDeviceImageFormatInfo2 format_info = {
+		.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_IMAGE_FORMAT_INFO_2,
+		.pNext = &extern_info,
+		.format = info->format,
+		.type = info->imageType,
+		.tiling = VK_IMAGE_TILING_DRM_FORMAT_MODIFIER_EXT,
+		.usage = info->usage,
+		.flags = info->flags,
+	};
+	VkImageFormatProperties2 image_props = {
+		.sType = VK_STRUCTURE_TYPE_IMAGE_FORMAT_PROPERTIES_2,
+	};
+	size_t i, j, len;
+
+	vkGetPhysicalDeviceFormatProperties2(ctx->phys, info->format, &format_props);
+	if (list.drmFormatModifierCount == 0) {
+		errno = ENOTSUP;
+		return 0;
 	}
+	list.pDrmFormatModifierProperties = reallocarray(NULL, list.drmFormatModifierCount, sizeof(list.pDrmFormatModifierProperties[0]));
+	if (!list.pDrmFormatModifierProperties) {
+		errno = ENOMEM;
+		return 0;
+	}
+	vkGetPhysicalDeviceFormatProperties2(ctx->phys, info->format, &format_props);
+	len = 0;
+	for (i = 0; i < mods_len; ++i) {
+		for (j = 0; j < list.drmFormatModifierCount; ++j) {
+			if (list.pDrmFormatModifierProperties[j].drmFormatModifier == mods[i])
+				break;
+		}
+		if (j == list.drmFormatModifierCount)
+			continue;
+		if ((list.pDrmFormatModifierProperties[j].drmFormatModifierTilingFeatures & features) != features)
+			continue;
+		/* XXX: image_export_dmabuf only handles a single plane */
+		if (list.pDrmFormatModifierProperties[j].drmFormatModifierPlaneCount != 1)
+			continue;
+		mod_info.drmFormatModifier = mods[i];
+		res = vkGetPhysicalDeviceImageFormatProperties2(ctx->phys, &format_info, &image_props);
+		if (res != VK_SUCCESS)
+			continue;
+		if (image_props.imageFormatProperties.maxExtent.width < info->extent.width ||
+		    image_props.imageFormatProperties.maxExtent.height < info->extent.height)
+			continue;
+		mods[len++] = mods[i];
+	}
+	free(list.pDrmFormatModifierProperties);
+	if (len == 0)
+		errno = ENOTSUP;
+	return len;
 }
 
 static struct blt_image *
-new_image(struct blt_context *ctx_base, int width, int height, uint32_t format, int flags)
+new_image(struct blt_context *ctx_base, int width, int height, uint32_t format, int flags, size_t mods_len, const uint64_t *mods_in)
 {
 	struct context *ctx = (void *)ctx_base;
 	struct image *img;
-	uint64_t mods[] = {
-		0,
-	};
+	uint64_t *mods = NULL;
 	VkResult res;
 	VkImageDrmFormatModifierListCreateInfoEXT image_mods = {
 		.sType = VK_STRUCTURE_TYPE_IMAGE_DRM_FORMAT_MODIFIER_LIST_CREATE_INFO_EXT,
-		.drmFormatModifierCount = LEN(mods),
-		.pDrmFormatModifiers = mods,
 	};
 	VkExternalMemoryImageCreateInfo image_extern = {
 		.sType = VK_STRUCTURE_TYPE_EXTERNAL_MEMORY_IMAGE_CREATE_INFO,
@@ -389,19 +2150,62 @@ new_image(struct blt_context *ctx_base, int width, int height, uint32_t format,
 	};
 	VkMemoryPropertyFlags memory_flags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
 	VkMemoryRequirements reqs;
+	VkFormatFeatureFlags features = 0;
+	VkFormatProperties props;
+	const struct format *fmt;
+	static const uint64_t linear[] = {BLT_MOD_LINEAR};
 
-	info.format = vulkan_format(format);
-	if (info.format == VK_FORMAT_UNDEFINED)
+	fmt = find_format(format);
+	if (!fmt) {
+		errno = ENOTSUP;
 		return NULL;
+	}
+	info.format = fmt->vk;
 
-	if (flags & BLT_IMAGE_DST)
+	if (flags & BLT_IMAGE_DST) {
 		info.usage |= VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
-	if (flags & BLT_IMAGE_SRC)
+		features |= VK_FORMAT_FEATURE_COLOR_ATTACHMENT_BIT;
+	}
+	if (flags & BLT_IMAGE_SRC) {
 		info.usage |= VK_IMAGE_USAGE_SAMPLED_BIT;
+		features |= VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT;
+	}
 	if (flags & BLT_IMAGE_DMABUF) {
+		if (!mods_in) {
+			mods_in = linear;
+			mods_len = LEN(linear);
+		}
+		/* and room to filter them again */
+		mods = reallocarray(NULL, mods_len, 2 * sizeof(mods[0]));
+		if (!mods) {
+			errno = ENOMEM;
+			goto error0;
+		}
+		memcpy(mods, mods_in, mods_len * sizeof(mods[0]));
+		mods_len = filter_modifiers(ctx, &info, features, mods_len, mods);
+		if (mods_len == 0)
+			goto error0;
+		/*
+		Writes and reads need transfer usage, which must not rule
+		out any modifiers the importer could use, so without it they
+		aren't supported.
+		*/
+		info.usage |= VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+		memcpy(mods + mods_len, mods, mods_len * sizeof(mods[0]));
+		if (filter_modifiers(ctx, &info, features | VK_FORMAT_FEATURE_TRANSFER_SRC_BIT | VK_FORMAT_FEATURE_TRANSFER_DST_BIT, mods_len, mods + mods_len) != mods_len)
+			info.usage &= ~(VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT);
+		image_mods.drmFormatModifierCount = mods_len;
+		image_mods.pDrmFormatModifiers = mods;
 		info.tiling = VK_IMAGE_TILING_DRM_FORMAT_MODIFIER_EXT;
 		info.pNext = &image_extern;
 		mem_image.pNext = &mem_export;
+	} else {
+		info.usage |= VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+		vkGetPhysicalDeviceFormatProperties(ctx->phys, info.format, &props);
+		if ((props.optimalTilingFeatures & features) != features) {
+			errno = ENOTSUP;
+			goto error0;
+		}
 	}
 
 	img = malloc(sizeof(*img));
@@ -413,6 +2217,7 @@ new_image(struct blt_context *ctx_base, int width, int height, uint32_t format,
 		.height = height,
 		.format = format,
 	};
+	img->usage = info.usage;
 	res = vkCreateImage(ctx->dev, &info, NULL, &img->vk);
 	if (res != VK_SUCCESS)
 		goto error1;
@@ -429,19 +2234,126 @@ new_image(struct blt_context *ctx_base, int width, int height, uint32_t format,
 	res = vkBindImageMemory(ctx->dev, img->vk, img->memory, 0);
 	if (res != VK_SUCCESS)
 		goto error3;
-	if (init_image(ctx, img, info.format, flags) < 0)
+	if (init_image(ctx, img, fmt, flags) < 0)
 		goto error3;
+	free(mods);
 
 	return &img->base;
 
 error3:
-	vkFreeMemory(ctx->dev, img->memory, NULL);
+	vkFreeMemory(ctx->dev, img->memory, NULL);
+error2:
+	vkDestroyImage(ctx->dev, img->vk, NULL);
+error1:
+	free(img);
+error0:
+	free(mods);
+	return NULL;
+}
+
+/*
+Create a new swapchain for srf, retiring the current one if there is
+one. The retired swapchain is destroyed once the GPU is done with the
+work submitted so far, so this doesn't wait for the queue to drain.
+*/
+static int
+create_swapchain(struct context *ctx, struct surface *srf)
+{
+	struct swapchain *sc, *old = srf->swapchain;
+	VkSurfaceCapabilitiesKHR caps;
+	VkImage *vkimg;
+	VkResult res;
+	uint32_t i;
+
+	if (flush(&ctx->base) < 0)
+		goto error0;
+	res = vkGetPhysicalDeviceSurfaceCapabilitiesKHR(ctx->phys, srf->vk, &caps);
+	if (res != VK_SUCCESS)
+		goto error0;
+	if (caps.currentExtent.width == 0xffffffff) {
+		if (srf->width < 0 || srf->height < 0) {
+			errno = EINVAL;
+			goto error0;
+		}
+		caps.currentExtent.width = srf->width;
+		caps.currentExtent.height = srf->height;
+	}
+	/* minimized windows can't have a swapchain */
+	if (caps.currentExtent.width == 0 || caps.currentExtent.height == 0) {
+		errno = EAGAIN;
+		goto error0;
+	}
+	srf->info.imageExtent = caps.currentExtent;
+	srf->info.minImageCount = srf->images > caps.minImageCount ? srf->images : caps.minImageCount;
+	if (caps.maxImageCount && srf->info.minImageCount > caps.maxImageCount)
+		srf->info.minImageCount = caps.maxImageCount;
+	srf->info.oldSwapchain = old ? old->vk : VK_NULL_HANDLE;
+	sc = malloc(sizeof(*sc));
+	if (!sc)
+		goto error0;
+	res = vkCreateSwapchainKHR(ctx->dev, &srf->info, NULL, &sc->vk);
+	if (res != VK_SUCCESS)
+		goto error1;
+	res = vkGetSwapchainImagesKHR(ctx->dev, sc->vk, &sc->img_len, NULL);
+	if (res != VK_SUCCESS)
+		goto error2;
+	sc->img = reallocarray(NULL, sc->img_len, sizeof(sc->img[0]));
+	if (!sc->img)
+		goto error2;
+	sc->age = reallocarray(NULL, sc->img_len, sizeof(sc->age[0]));
+	if (!sc->age)
+		goto error3;
+	vkimg = reallocarray(NULL, sc->img_len, sizeof(vkimg[0]));
+	if (!vkimg)
+		goto error4;
+	res = vkGetSwapchainImagesKHR(ctx->dev, sc->vk, &sc->img_len, vkimg);
+	if (res != VK_SUCCESS)
+		goto error5;
+	for (i = 0; i < sc->img_len; ++i) {
+		/* contents of new images are undefined */
+		sc->age[i] = INT_MAX;
+		sc->img[i].base = (struct blt_image){
+			.impl = &image_impl,
+			.width = caps.currentExtent.width,
+			.height = caps.currentExtent.height,
+			.format = srf->format,
+		};
+		sc->img[i].vk = vkimg[i];
+		sc->img[i].usage = srf->info.imageUsage;
+		if (init_image(ctx, &sc->img[i], find_format(srf->format), BLT_IMAGE_DST) < 0)
+			goto error6;
+	}
+	free(vkimg);
+	sc->first_id = 0;
+	sc->seq = 0;
+	sc->next = NULL;
+	if (old) {
+		old->seq = ctx->seq;
+		old->next = srf->retired;
+		srf->retired = old;
+	}
+	srf->swapchain = sc;
+	srf->stale = false;
+	return 0;
+
+error6:
+	while (i > 0)
+		finish_image(ctx, &sc->img[--i]);
+error5:
+	free(vkimg);
+error4:
+	free(sc->age);
+error3:
+	free(sc->img);
 error2:
-	vkDestroyImage(ctx->dev, img->vk, NULL);
+	vkDestroySwapchainKHR(ctx->dev, sc->vk, NULL);
 error1:
-	free(img);
+	free(sc);
 error0:
-	return NULL;
+	/* the old swapchain is retired even if creation failed */
+	if (old)
+		srf->stale = true;
+	return -1;
 }
 
 struct blt_surface *
@@ -449,8 +2361,6 @@ blt_vulkan_new_surface(struct blt_context *ctx_base, VkSurfaceKHR vk, int width,
 {
 	struct context *ctx = (void *)ctx_base;
 	struct surface *srf;
-	VkSurfaceCapabilitiesKHR caps;
-	VkImage *vkimg;
 	VkResult res;
 	VkSurfaceFormatKHR *formats;
 	uint32_t formats_len;
@@ -467,13 +2377,15 @@ blt_vulkan_new_surface(struct blt_context *ctx_base, VkSurfaceKHR vk, int width,
 	};
 	int i;
 	VkBool32 supported;
+	const struct format *fmt;
 
 	res = vkGetPhysicalDeviceSurfaceSupportKHR(ctx->phys, ctx->queue_index, vk, &supported);
 	if (res != VK_SUCCESS || !supported)
 		goto error0;
-	info.imageFormat = vulkan_format(format);
-	if (info.imageFormat == VK_FORMAT_UNDEFINED)
+	fmt = find_format(format);
+	if (!fmt)
 		goto error0;
+	info.imageFormat = fmt->vk;
 	res = vkGetPhysicalDeviceSurfaceFormatsKHR(ctx->phys, vk, &formats_len, NULL);
 	if (res != VK_SUCCESS)
 		goto error0;
@@ -494,125 +2406,712 @@ blt_vulkan_new_surface(struct blt_context *ctx_base, VkSurfaceKHR vk, int width,
 	free(formats);
 	if (i == formats_len)
 		goto error0;
-	/* XXX: check for surface formats */
 	srf = malloc(sizeof(*srf));
 	if (!srf)
 		goto error0;
 	srf->base = (struct blt_surface){.impl = &surface_impl};
 	srf->vk = vk;
-	res = vkGetPhysicalDeviceSurfaceCapabilitiesKHR(ctx->phys, vk, &caps);
-	if (res != VK_SUCCESS)
+	srf->info = info;
+	srf->format = format;
+	srf->width = width;
+	srf->height = height;
+	srf->images = 0;
+	srf->swapchain = NULL;
+	srf->retired = NULL;
+	srf->stale = false;
+	srf->spare = VK_NULL_HANDLE;
+	srf->spare_seq = 0;
+	srf->present_id = 0;
+	if (create_swapchain(ctx, srf) < 0)
 		goto error1;
-	if (width >= 0) {
-		if (caps.currentExtent.width != 0xffffffff)
-			goto error1;
-		caps.currentExtent.width = width;
+	return &srf->base;
+
+error1:
+	free(srf);
+error0:
+	return NULL;
+}
+
+static void
+draw(struct context *ctx)
+{
+	struct image *dst = (void *)ctx->base.dst;
+	struct draw_context *dc = dst->draw_ctx;
+	const struct blt_transform *t = &ctx->base.transform;
+
+	if (dc->vertex_pos == dc->vertex_len)
+		return;
+	/*
+	All pipeline layouts we use are compatible for push
+	constants, so we can just choose an arbitrary one here.
+	*/
+	vkCmdPushConstants(dc->cmd, ctx->fill_layout, VK_SHADER_STAGE_VERTEX_BIT, 0, 40, (float[]){
+		ctx->base.dst_x,
+		ctx->base.dst_y,
+		t->xx * ctx->base.src_x + t->xy * ctx->base.src_y + t->x0,
+		t->yx * ctx->base.src_x + t->yy * ctx->base.src_y + t->y0,
+		2./ctx->base.dst->width,
+		2./ctx->base.dst->height,
+		t->xx, t->yx,
+		t->xy, t->yy,
+	});
+	switch (dc->mode) {
+	case DRAW_RECTS:
+		vkCmdDraw(dc->cmd, (dc->vertex_len - dc->vertex_pos) / 2, 1, dc->vertex_pos / 2, 0);
+		break;
+	case DRAW_SHAPES:
+		vkCmdDraw(dc->cmd, 6, (dc->vertex_len - dc->vertex_pos) / SHAPE_SIZE, 0, dc->vertex_pos / SHAPE_SIZE);
+		break;
+	case DRAW_GLYPHS:
+		vkCmdDraw(dc->cmd, 6, (dc->vertex_len - dc->vertex_pos) / GLYPH_SIZE, 0, dc->vertex_pos / GLYPH_SIZE);
+		break;
 	}
-	if (height >= 0) {
-		if (caps.currentExtent.height != 0xffffffff)
-			goto error1;
-		caps.currentExtent.height = height;
+	dc->vertex_pos = dc->vertex_len;
+}
+
+static int
+add_wait(struct draw_context *dc, VkSemaphore semaphore, uint64_t value, VkPipelineStageFlags2 stage)
+{
+	VkSemaphoreSubmitInfo *wait;
+	size_t i, cap;
+
+	/* a later value of a timeline implies the earlier ones */
+	for (i = 0; i < dc->wait_len; ++i) {
+		wait = &dc->wait[i];
+		if (wait->semaphore == semaphore) {
+			if (wait->value < value)
+				wait->value = value;
+			wait->stageMask |= stage;
+			return 0;
+		}
+	}
+	if (dc->wait_len == dc->wait_cap) {
+		cap = dc->wait_cap ? dc->wait_cap * 2 : 4;
+		wait = reallocarray(dc->wait, cap, sizeof(dc->wait[0]));
+		if (!wait)
+			return -1;
+		dc->wait = wait;
+		dc->wait_cap = cap;
+	}
+	dc->wait[dc->wait_len++] = (VkSemaphoreSubmitInfo){
+		.sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+		.semaphore = semaphore,
+		.value = value,
+		.stageMask = stage,
+	};
+	return 0;
+}
+
+/* record that the next submission of dc samples img */
+static int
+add_reader(struct image *img, struct draw_context *dc)
+{
+	struct sync_point *reader;
+	size_t i, cap;
+
+	for (i = 0; i < img->reader_len; ++i) {
+		if (img->reader[i].timeline == dc->timeline) {
+			img->reader[i].seq = dc->seq + 1;
+			return 0;
+		}
+	}
+	if (img->reader_len == img->reader_cap) {
+		cap = img->reader_cap ? img->reader_cap * 2 : 4;
+		reader = reallocarray(img->reader, cap, sizeof(img->reader[0]));
+		if (!reader)
+			return -1;
+		img->reader = reader;
+		img->reader_cap = cap;
+	}
+	img->reader[img->reader_len++] = (struct sync_point){dc->timeline, dc->seq + 1};
+	return 0;
+}
+
+/*
+Make the next submission for dc wait for the fence imported into img,
+its acquisition from the swapchain, and any transfer to or from img,
+if there are any. If dc draws to img, it also waits for the
+submissions that sample img, and otherwise for the one that draws to
+it, so that independent destinations can render concurrently. These
+are all timeline values, so any number of draw contexts can wait for
+them.
+*/
+static int
+wait_image(struct context *ctx, struct draw_context *dc, struct image *img, VkPipelineStageFlags2 stage)
+{
+	struct draw_context *writer = img->draw_ctx;
+	size_t i;
+
+	/* streams may sample img at the same time */
+	pthread_mutex_lock(&owner(ctx)->lock);
+	if (writer == dc) {
+		for (i = 0; i < img->reader_len; ++i) {
+			if (add_wait(dc, img->reader[i].timeline, img->reader[i].seq, stage) < 0)
+				goto error0;
+		}
+		img->reader_len = 0;
+	} else if (writer) {
+		/* a pending writer is submitted with dc, signalling its next value */
+		if (add_wait(dc, writer->timeline, writer->pending ? writer->seq + 1 : writer->seq, stage) < 0)
+			goto error0;
+		if (add_reader(img, dc) < 0)
+			goto error0;
+	}
+	/* values that have already signalled cost nothing to wait for */
+	if (img->ready && add_wait(dc, ctx->timeline, img->ready, stage) < 0)
+		goto error0;
+	if (img->xfer_seq && add_wait(dc, ctx->xfer_timeline, img->xfer_seq, stage) < 0)
+		goto error0;
+	img->used = owner(ctx)->frame + 1;
+	pthread_mutex_unlock(&owner(ctx)->lock);
+	return 0;
+
+error0:
+	pthread_mutex_unlock(&owner(ctx)->lock);
+	return -1;
+}
+
+/* transition img to layout between the given source and destination accesses */
+static void
+set_layout(struct draw_context *dc, struct image *img, VkImageLayout layout, VkPipelineStageFlags2 src_stage, VkAccessFlags2 src_access, VkPipelineStageFlags2 dst_stage, VkAccessFlags2 dst_access)
+{
+	vkCmdPipelineBarrier2(dc->cmd, &(VkDependencyInfo){
+		.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+		.imageMemoryBarrierCount = 1,
+		.pImageMemoryBarriers = &(VkImageMemoryBarrier2){
+			.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
+			.srcStageMask = src_stage,
+			.srcAccessMask = src_access,
+			.dstStageMask = dst_stage,
+			.dstAccessMask = dst_access,
+			.oldLayout = img->layout,
+			.newLayout = layout,
+			.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+			.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+			.image = img->vk,
+			.subresourceRange = {
+				.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+				.levelCount = 1,
+				.layerCount = 1,
+			},
+		},
+	});
+	img->layout = layout;
+}
+
+/*
+Finish recording for the current destination, and queue its command
+buffer for the next flush.
+*/
+static int
+end(struct context *ctx)
+{
+	struct image *dst = (void *)ctx->base.dst;
+	struct draw_context *dc = dst->draw_ctx, **pending;
+	VkResult res;
+	size_t cap;
+
+	/* the parent reads the pending list of a stream when it flushes */
+	pthread_mutex_lock(&owner(ctx)->lock);
+	if (ctx->pending_len == ctx->pending_cap) {
+		cap = ctx->pending_cap ? ctx->pending_cap * 2 : 8;
+		pending = reallocarray(ctx->pending, cap, sizeof(ctx->pending[0]));
+		if (!pending)
+			goto error0;
+		ctx->pending = pending;
+		ctx->pending_cap = cap;
 	}
-	info.imageExtent = caps.currentExtent;
-	info.minImageCount = caps.minImageCount;
-	res = vkCreateSwapchainKHR(ctx->dev, &info, NULL, &srf->swapchain);
+	draw(ctx);
+	vkCmdEndRendering(dc->cmd);
+	/* leave it ready for sampling by the submissions that wait for it */
+	if (resting_layout(dst) != VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL)
+		set_layout(dc, dst, resting_layout(dst), VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT, VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT, VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT, VK_ACCESS_2_SHADER_SAMPLED_READ_BIT);
+	if (dc->timing != -1)
+		vkCmdWriteTimestamp(dc->cmd, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, ctx->query_pool, dc->timing * 2 + 1);
+	res = vkEndCommandBuffer(dc->cmd);
+	dc->recording = false;
 	if (res != VK_SUCCESS)
-		goto error1;
-	res = vkGetSwapchainImagesKHR(ctx->dev, srf->swapchain, &srf->img_len, NULL);
+		goto error0;
+	/* the next draw context continues after its vertices */
+	ctx->vertex_used = dc->vertex - ctx->vertex_buffer->map + (dc->vertex_len + SHAPE_SIZE - 1) / SHAPE_SIZE * SHAPE_SIZE;
+	ctx->pending[ctx->pending_len++] = dc;
+	dc->pending = true;
+	pthread_mutex_unlock(&owner(ctx)->lock);
+	return 0;
+
+error0:
+	pthread_mutex_unlock(&owner(ctx)->lock);
+	return -1;
+}
+
+/*
+Submit the copies added since the last transfer submission, then the
+command buffers of all destinations that have finished recording,
+first those of ctx and then those of each of its streams, in the
+order they finished. Each one only waits for what it depends on, and
+signals the next value of the timeline of its draw context. A last
+submission waits for all of them and signals the next value of the
+timeline of ctx. The lock must be held.
+*/
+static int
+submit_pending(struct context *ctx)
+{
+	struct context *s;
+	struct draw_context *dc;
+	struct vertex_buffer *vb;
+	struct image *img;
+	struct {
+		VkCommandBufferSubmitInfo cmd;
+		VkSemaphoreSubmitInfo signal;
+	} *submit;
+	VkSubmitInfo2 *info;
+	VkSemaphoreSubmitInfo *join;
+	VkResult res;
+	size_t i, j, n, len;
+
+	/* uploads that the draw contexts may wait for go first */
+	if (submit_transfers(ctx) < 0)
+		return -1;
+	len = ctx->pending_len;
+	for (i = 0; i < ctx->stream_len; ++i)
+		len += ctx->stream[i]->pending_len;
+	if (len == 0)
+		return 0;
+	info = reallocarray(NULL, len + 1, sizeof(info[0]));
+	submit = reallocarray(NULL, len, sizeof(submit[0]));
+	join = reallocarray(NULL, len + 1, sizeof(join[0]));
+	if (!info || !submit || !join)
+		goto error0;
+	for (i = 0, n = 0; i <= ctx->stream_len; ++i) {
+		s = i == 0 ? ctx : ctx->stream[i - 1];
+		for (j = 0; j < s->pending_len; ++j, ++n) {
+			dc = s->pending[j];
+			submit[n].cmd = (VkCommandBufferSubmitInfo){
+				.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_SUBMIT_INFO,
+				.commandBuffer = dc->cmd,
+			};
+			submit[n].signal = (VkSemaphoreSubmitInfo){
+				.sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+				.semaphore = dc->timeline,
+				.value = dc->seq + 1,
+				.stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+			};
+			join[n] = submit[n].signal;
+			info[n] = (VkSubmitInfo2){
+				.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO_2,
+				.waitSemaphoreInfoCount = dc->wait_len,
+				.pWaitSemaphoreInfos = dc->wait,
+				.commandBufferInfoCount = 1,
+				.pCommandBufferInfos = &submit[n].cmd,
+				.signalSemaphoreInfoCount = 1,
+				.pSignalSemaphoreInfos = &submit[n].signal,
+			};
+		}
+	}
+	/* timeline values must be signalled in order */
+	join[len] = (VkSemaphoreSubmitInfo){
+		.sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+		.semaphore = ctx->timeline,
+		.value = ctx->seq,
+		.stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+	};
+	info[len] = (VkSubmitInfo2){
+		.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO_2,
+		.waitSemaphoreInfoCount = len + 1,
+		.pWaitSemaphoreInfos = join,
+		.signalSemaphoreInfoCount = 1,
+		.pSignalSemaphoreInfos = &(VkSemaphoreSubmitInfo){
+			.sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+			.semaphore = ctx->timeline,
+			.value = ctx->seq + 1,
+			.stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+		},
+	};
+	res = vkQueueSubmit2(ctx->queue, len + 1, info, VK_NULL_HANDLE);
 	if (res != VK_SUCCESS)
-		goto error2;
-	srf->img = reallocarray(NULL, srf->img_len, sizeof(srf->img[0]));
-	if (!srf->img)
-		goto error2;
-	srf->age = reallocarray(NULL, srf->img_len, sizeof(srf->age[0]));
-	if (!srf->age)
-		goto error3;
-	vkimg = reallocarray(NULL, srf->img_len, sizeof(vkimg[0]));
-	if (!vkimg)
-		goto error4;
-	res = vkGetSwapchainImagesKHR(ctx->dev, srf->swapchain, &srf->img_len, vkimg);
+		goto error0;
+	++ctx->seq;
+	for (i = 0; i <= ctx->stream_len; ++i) {
+		s = i == 0 ? ctx : ctx->stream[i - 1];
+		for (j = 0; j < s->pending_len; ++j) {
+			dc = s->pending[j];
+			++dc->seq;
+			dc->wait_len = 0;
+			dc->pending = false;
+			s->cmd_seq[dc->cmd_index] = ctx->seq;
+			while (dc->used) {
+				vb = dc->used;
+				dc->used = vb->next;
+				vb->seq = ctx->seq;
+				vb->next = ctx->vertex_pool;
+				ctx->vertex_pool = vb;
+			}
+			if (dc->timing != -1)
+				ctx->timing[dc->timing].seq = ctx->seq;
+		}
+		s->pending_len = 0;
+	}
+	for (img = ctx->destroyed; img; img = img->next) {
+		if (img->destroy_seq == 0)
+			img->destroy_seq = ctx->seq;
+	}
+	++ctx->frame;
+	free(join);
+	free(submit);
+	free(info);
+	return 0;
+
+error0:
+	free(join);
+	free(submit);
+	free(info);
+	return -1;
+}
+
+/*
+Finish recording for the current destination. Streams only queue their
+command buffers, which are submitted by the next flush of their parent.
+*/
+static int
+flush(struct blt_context *ctx_base)
+{
+	struct context *ctx = (void *)ctx_base;
+	struct image *dst = (void *)ctx->base.dst;
+	bool reap;
+	int ret;
+
+	if (dst && dst->draw_ctx->recording && end(ctx) < 0)
+		return -1;
+	if (ctx->parent)
+		return 0;
+	pthread_mutex_lock(&ctx->lock);
+	ret = submit_pending(ctx);
+	reap = ctx->destroyed != NULL;
+	pthread_mutex_unlock(&ctx->lock);
+	if (reap)
+		reap_images(ctx);
+	return ret;
+}
+
+/*
+Start a new timing for dst, discarding the oldest one if the ring is
+full and it has completed. If it hasn't, this rendering isn't timed.
+*/
+static void
+begin_timing(struct context *ctx, struct image *dst)
+{
+	struct draw_context *dc = dst->draw_ctx;
+	struct timing *t;
+	uint64_t done;
+	size_t i;
+
+	dc->timing = -1;
+	if (!ctx->query_pool)
+		return;
+	if (ctx->timing_len == LEN(ctx->timing)) {
+		t = &ctx->timing[ctx->timing_pos];
+		if (vkGetSemaphoreCounterValue(ctx->dev, ctx->timeline, &done) != VK_SUCCESS)
+			return;
+		if (t->seq == 0 || t->seq > done)
+			return;
+		ctx->timing_pos = (ctx->timing_pos + 1) % LEN(ctx->timing);
+		--ctx->timing_len;
+	}
+	i = (ctx->timing_pos + ctx->timing_len++) % LEN(ctx->timing);
+	ctx->timing[i] = (struct timing){
+		.dst = &dst->base,
+		.frame = ctx->frame,
+	};
+	vkCmdResetQueryPool(dc->cmd, ctx->query_pool, i * 2, 2);
+	vkCmdWriteTimestamp(dc->cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, ctx->query_pool, i * 2);
+	dc->timing = i;
+}
+
+static void
+begin_rendering(struct draw_context *dc, struct image *dst)
+{
+	vkCmdBeginRendering(dc->cmd, &(VkRenderingInfo){
+		.sType = VK_STRUCTURE_TYPE_RENDERING_INFO,
+		.renderArea.extent = {dst->base.width, dst->base.height},
+		.layerCount = 1,
+		.colorAttachmentCount = 1,
+		.pColorAttachments = &(VkRenderingAttachmentInfo){
+			.sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO,
+			.imageView = dst->view,
+			.imageLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+			.loadOp = VK_ATTACHMENT_LOAD_OP_LOAD,
+			.storeOp = VK_ATTACHMENT_STORE_OP_STORE,
+		},
+	});
+}
+
+/*
+Find a command buffer of ctx that the GPU is done with, or allocate a
+new one, and mark it as in use. The lock must be held.
+*/
+static int
+get_command_buffer(struct context *ctx, size_t *index)
+{
+	VkCommandBuffer *cmd;
+	uint64_t *seq, done;
+	VkResult res;
+	size_t i;
+
+	if (vkGetSemaphoreCounterValue(ctx->dev, ctx->timeline, &done) != VK_SUCCESS)
+		return -1;
+	for (i = 0; i < ctx->cmd_len; ++i) {
+		if (ctx->cmd_seq[i] <= done)
+			goto found;
+	}
+	cmd = reallocarray(ctx->cmd, i + 1, sizeof(cmd[0]));
+	if (!cmd)
+		return -1;
+	ctx->cmd = cmd;
+	seq = reallocarray(ctx->cmd_seq, i + 1, sizeof(seq[0]));
+	if (!seq)
+		return -1;
+	ctx->cmd_seq = seq;
+	res = vkAllocateCommandBuffers(ctx->dev, &(VkCommandBufferAllocateInfo){
+		.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+		.commandPool = ctx->cmd_pool,
+		.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+		.commandBufferCount = 1,
+	}, &ctx->cmd[i]);
 	if (res != VK_SUCCESS)
-		goto error5;
-	for (i = 0; i < srf->img_len; ++i) {
-		srf->age[i] = INT_MAX;
-		srf->img[i].base = (struct blt_image){
-			.impl = &image_impl,
-			.width = caps.currentExtent.width,
-			.height = caps.currentExtent.height,
-			.format = BLT_FMT('X', 'R', '2', '4'),
-		};
-		srf->img[i].vk = vkimg[i];
-		if (init_image(ctx, &srf->img[i], VK_FORMAT_B8G8R8A8_UNORM, BLT_IMAGE_DST) < 0)
-			goto error6;
+		return -1;
+	++ctx->cmd_len;
+found:
+	ctx->cmd_seq[i] = UINT64_MAX;
+	*index = i;
+	return 0;
+}
+
+/*
+Make a vertex buffer the GPU is done with, or a new one, the current
+one of ctx. The old one is returned to the pool once dc, which is
+recorded after all its other users, is submitted. The lock must be
+held.
+*/
+static int
+next_vertex_buffer(struct context *ctx, struct draw_context *dc)
+{
+	struct context *shared = owner(ctx);
+	struct vertex_buffer **p, *vb;
+	uint64_t done;
+	void *data;
+
+	if (vkGetSemaphoreCounterValue(ctx->dev, ctx->timeline, &done) != VK_SUCCESS)
+		return -1;
+	for (p = &shared->vertex_pool; *p; p = &(*p)->next) {
+		if ((*p)->seq <= done)
+			break;
 	}
-	free(vkimg);
-	return &srf->base;
+	if (*p) {
+		vb = *p;
+		*p = vb->next;
+	} else {
+		vb = malloc(sizeof(*vb));
+		if (!vb)
+			return -1;
+		if (alloc_buffer(ctx, VERTEX_SIZE * sizeof(vb->map[0]), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, &vb->buffer, &vb->memory) < 0) {
+			free(vb);
+			return -1;
+		}
+		if (vkMapMemory(ctx->dev, vb->memory, 0, VK_WHOLE_SIZE, 0, &data) != VK_SUCCESS) {
+			vkDestroyBuffer(ctx->dev, vb->buffer, NULL);
+			vkFreeMemory(ctx->dev, vb->memory, NULL);
+			free(vb);
+			return -1;
+		}
+		vb->map = data;
+	}
+	if (ctx->vertex_buffer) {
+		ctx->vertex_buffer->next = dc->used;
+		dc->used = ctx->vertex_buffer;
+	}
+	ctx->vertex_buffer = vb;
+	ctx->vertex_used = 0;
+	return 0;
+}
+
+/* record the vertices of dc from the unused part of the current vertex buffer */
+static void
+bind_vertex_buffer(struct context *ctx, struct draw_context *dc)
+{
+	dc->vertex = ctx->vertex_buffer->map + ctx->vertex_used;
+	dc->vertex_len = 0;
+	dc->vertex_pos = 0;
+	dc->vertex_cap = VERTEX_SIZE - ctx->vertex_used;
+	vkCmdBindVertexBuffers(dc->cmd, 0, 1, &ctx->vertex_buffer->buffer, (VkDeviceSize[]){ctx->vertex_used * sizeof(dc->vertex[0])});
+}
+
+/*
+Draw the vertices recorded so far and continue in another vertex
+buffer, once the part of the current one for dc is full. This doesn't
+submit anything, so streams can record any number of vertices.
+*/
+static int
+new_vertex_buffer(struct context *ctx, struct draw_context *dc)
+{
+	int ret;
+
+	draw(ctx);
+	pthread_mutex_lock(&owner(ctx)->lock);
+	ret = next_vertex_buffer(ctx, dc);
+	pthread_mutex_unlock(&owner(ctx)->lock);
+	if (ret < 0)
+		return -1;
+	bind_vertex_buffer(ctx, dc);
+	return 0;
+}
+
+static int
+begin(struct context *ctx, struct image *dst)
+{
+	struct draw_context *dc = dst->draw_ctx;
+	VkResult res;
+
+	pthread_mutex_lock(&owner(ctx)->lock);
+	/* a draw context is submitted once per flush, with its command buffer */
+	if (dc->pending) {
+		/* streams can't submit on their own */
+		if (ctx->parent) {
+			errno = EBUSY;
+			goto error0;
+		}
+		if (submit_pending(ctx) < 0)
+			goto error0;
+	}
+	if (get_command_buffer(ctx, &dc->cmd_index) < 0)
+		goto error0;
+	dc->cmd = ctx->cmd[dc->cmd_index];
+	if ((!ctx->vertex_buffer || ctx->vertex_used == VERTEX_SIZE) && next_vertex_buffer(ctx, dc) < 0)
+		goto error0;
+	pthread_mutex_unlock(&owner(ctx)->lock);
+	dc->mode = DRAW_RECTS;
+	res = vkBeginCommandBuffer(dc->cmd, &(VkCommandBufferBeginInfo){
+		.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+		.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+	});
+	if (res != VK_SUCCESS)
+		return -1;
+	if (wait_image(ctx, dc, dst, VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT) < 0)
+		return -1;
+	/* the semaphore waits above are for the same stage, so this comes after them */
+	if (dst->layout != VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL)
+		set_layout(dc, dst, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT, 0, VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT, VK_ACCESS_2_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT);
+	begin_timing(ctx, dst);
+	begin_rendering(dc, dst);
+	bind_vertex_buffer(ctx, dc);
+	vkCmdSetViewport(dc->cmd, 0, 1, &(VkViewport){
+		.width = dst->base.width,
+		.height = dst->base.height,
+	});
+	vkCmdSetScissor(dc->cmd, 0, 1, &(VkRect2D){
+		.extent = {dst->base.width, dst->base.height},
+	});
+	dc->recording = true;
+	return 0;
 
-error6:
-	/* XXX: destroy images */
-error5:
-	free(vkimg);
-error4:
-	free(srf->age);
-error3:
-	free(srf->img);
-error2:
-	vkDestroySwapchainKHR(ctx->dev, srf->swapchain, NULL);
-error1:
-	free(srf);
 error0:
-	return NULL;
+	pthread_mutex_unlock(&owner(ctx)->lock);
+	return -1;
+}
+
+/*
+Return the pipelines for drawing to format, creating them if necessary.
+Streams use those of their parent.
+*/
+static struct pipelines *
+get_pipelines(struct context *ctx, VkFormat format)
+{
+	struct context *shared = owner(ctx);
+	struct pipelines *p;
+
+	pthread_mutex_lock(&shared->lock);
+	for (p = shared->pipelines; p < shared->pipelines + shared->pipelines_len; ++p) {
+		if (p->format == format)
+			goto done;
+	}
+	if (shared->pipelines_len == LEN(shared->pipelines)) {
+		p = NULL;
+		goto done;
+	}
+	p->format = format;
+	if (make_pipelines(shared, p) < 0) {
+		p = NULL;
+		goto done;
+	}
+	++shared->pipelines_len;
+done:
+	pthread_mutex_unlock(&shared->lock);
+	return p;
 }
 
 static void
-flush(struct context *ctx)
+push_color(struct context *ctx, struct image *dst, const struct blt_color *color)
 {
-	struct image *dst = (void *)ctx->base.dst;
-	struct draw_context *dc = dst->draw_ctx;
+	/* destinations with only alpha store it in the red component */
+	bool alpha = dst->fmt->vk == VK_FORMAT_R8_UNORM;
+	float a = (float)color->alpha / UINT16_MAX;
 
-	if (dc->vertex_pos == dc->vertex_len)
-		return;
-	/*
-	All pipeline layouts we use are compatible for push
-	constants, so we can just choose an arbitrary one here.
-	*/
-	vkCmdPushConstants(dc->cmd, ctx->fill_pipeline.layout, VK_SHADER_STAGE_VERTEX_BIT, 0, 24, (float[]){
-		ctx->base.dst_x,
-		ctx->base.dst_y,
-		ctx->base.src_x,
-		ctx->base.src_y,
-		2./ctx->base.dst->width,
-		2./ctx->base.dst->height,
+	vkCmdPushConstants(dst->draw_ctx->cmd, ctx->fill_layout, VK_SHADER_STAGE_FRAGMENT_BIT, 48, 16, (float[]){
+		alpha ? a : (float)color->red / UINT16_MAX,
+		alpha ? a : (float)color->green / UINT16_MAX,
+		alpha ? a : (float)color->blue / UINT16_MAX,
+		a,
 	});
-	vkCmdDraw(dc->cmd, (dc->vertex_len - dc->vertex_pos) / 2, 1, dc->vertex_pos / 2, 0);
-	dc->vertex_pos = dc->vertex_len;
 }
 
 static int
-submit(struct context *ctx)
+bind_src(struct context *ctx, struct image *dst, struct blt_image *src_base, int filter)
 {
-	struct image *dst = (void *)ctx->base.dst;
 	struct draw_context *dc = dst->draw_ctx;
-	VkSubmitInfo info = {
-		.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
-		.pWaitDstStageMask = (VkPipelineStageFlags[]){VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT},
-		.commandBufferCount = 1,
-		.pCommandBuffers = (VkCommandBuffer[]){dc->cmd},
-		.signalSemaphoreCount = 1,
-		.pSignalSemaphores = (VkSemaphore[]){dc->semaphore},
-	};
-	VkResult res;
+	struct pipelines *pipelines;
+	VkPipeline pipeline;
+	/* destinations with only alpha store it in the red component */
+	bool alpha = dst->fmt->vk == VK_FORMAT_R8_UNORM;
 
-	flush(ctx);
-	vkCmdEndRendering(dc->cmd);
-	res = vkEndCommandBuffer(dc->cmd);
-	if (res != VK_SUCCESS)
+	if (!src_base)
+		return 0;
+	pipelines = get_pipelines(ctx, dst->fmt->vk);
+	if (!pipelines)
 		return -1;
-	res = vkQueueSubmit(ctx->queue, 1, &info, VK_NULL_HANDLE);
-	if (res != VK_SUCCESS)
+	if (src_base->impl == &image_impl) {
+		struct image *src = (void *)src_base;
+
+		if (!src->src_view)
+			return -1;
+		if (wait_image(ctx, dc, src, VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT) < 0)
+			return -1;
+		if (dc->mode == DRAW_SHAPES)
+			pipeline = pipelines->shape_copy;
+		else if (filter == BLT_FILTER_BOX)
+			pipeline = pipelines->box;
+		else
+			pipeline = pipelines->copy;
+		vkCmdBindPipeline(dc->cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+		ctx->push_descriptor_set(dc->cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, ctx->copy_layout, 0, 1, (VkWriteDescriptorSet[]){
+			{
+				.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+				.dstBinding = 0,
+				.descriptorCount = 1,
+				.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+				.pImageInfo = &(VkDescriptorImageInfo){
+					.sampler = filter == BLT_FILTER_NEAREST ? ctx->nearest_sampler : ctx->linear_sampler,
+					.imageView = alpha ? src->alpha_view : src->src_view,
+					.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+				},
+			},
+		});
+	} else if (src_base->impl == &blt_solid_image_impl) {
+		struct blt_solid *src = (void *)src_base;
+
+		vkCmdBindPipeline(dc->cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, dc->mode == DRAW_SHAPES ? pipelines->shape_fill : pipelines->fill);
+		push_color(ctx, dst, &src->color);
+	} else {
 		return -1;
-	dc->vertex_len = 0;
-	dc->vertex_pos = 0;
+	}
 	return 0;
 }
 
@@ -620,13 +3119,11 @@ static int
 setup(struct blt_context *ctx_base, int op, struct blt_image *dst_base, struct blt_image *src_base, struct blt_image *mask)
 {
 	struct context *ctx = (void *)ctx_base;
-	struct image *dst;
+	struct image *dst, *old = (void *)ctx->base.dst;
 	struct draw_context *dc;
-	struct pipeline *pipeline = NULL;
-	VkResult res;
 
-	if (ctx->base.dst && dst_base != ctx->base.dst)
-		submit(ctx);
+	if (old && dst_base != &old->base && old->draw_ctx->recording && end(ctx) < 0)
+		return -1;
 	if (!dst_base)
 		return 0;
 	if (dst_base->impl != &image_impl)
@@ -638,82 +3135,37 @@ setup(struct blt_context *ctx_base, int op, struct blt_image *dst_base, struct b
 	if (!dc)
 		return -1;
 
-	if (&dst->base != ctx->base.dst) {
-		ctx->base.src = NULL;
-
-		res = vkBeginCommandBuffer(dc->cmd, &(VkCommandBufferBeginInfo){
-			.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
-			.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
-		});
-		if (res != VK_SUCCESS)
+	if (!dc->recording) {
+		if (begin(ctx, dst) < 0)
 			return -1;
-		vkCmdBeginRendering(dc->cmd, &(VkRenderingInfo){
-			.sType = VK_STRUCTURE_TYPE_RENDERING_INFO,
-			.renderArea.extent = {dst->base.width, dst->base.height},
-			.layerCount = 1,
-			.colorAttachmentCount = 1,
-			.pColorAttachments = &(VkRenderingAttachmentInfo){
-				.sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO,
-				.imageView = dst->view,
-				.imageLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
-				.loadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
-				.storeOp = VK_ATTACHMENT_STORE_OP_STORE,
-			},
-		});
-		vkCmdBindVertexBuffers(dc->cmd, 0, 1, (VkBuffer[]){dc->vertex_buffer}, (VkDeviceSize[]){0});
-		vkCmdSetViewport(dc->cmd, 0, 1, &(VkViewport){
-			.width = dst->base.width,
-			.height = dst->base.height,
-		});
-		vkCmdSetScissor(dc->cmd, 0, 1, &(VkRect2D){
-			.extent = {dst->base.width, dst->base.height},
-		});
+	} else {
+		/* draw with the old state before it changes */
+		draw(ctx);
+		if (src_base == ctx->base.src)
+			return 0;
 	}
-	if (src_base != ctx->base.src) {
-		if (ctx->base.dst)
-			flush(ctx);
-		if (src_base->impl == &image_impl) {
-			struct image *src = (void *)src_base;
+	return bind_src(ctx, dst, src_base, ctx->base.filter);
+}
 
-			switch (src_base->format) {
-			case BLT_FMT('X', 'R', '2', '4'):
-			case BLT_FMT('A', 'R', '2', '4'):
-				pipeline = &ctx->copy_rgb_pipeline;
-				break;
-			default:
-				return -1;
-			}
-			vkCmdBindPipeline(dc->cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline->vk);
-			vkCmdBindDescriptorSets(dc->cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline->layout, 0, 1, &pipeline->desc, 0, NULL);
-			vkUpdateDescriptorSets(ctx->dev, 1, (VkWriteDescriptorSet[]){
-				{
-					.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
-					.dstSet = pipeline->desc,
-					.dstBinding = 0,
-					.descriptorCount = 1,
-					.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
-					.pImageInfo = &(VkDescriptorImageInfo){
-						.imageView = src->view,
-						.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
-					},
-				},
-			}, 0, NULL);
-		} else if (src_base->impl == &blt_solid_image_impl) {
-			struct blt_solid *src = (void *)src_base;
-
-			pipeline = &ctx->fill_pipeline;
-			vkCmdBindPipeline(dc->cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline->vk);
-			vkCmdPushConstants(dc->cmd, pipeline->layout, VK_SHADER_STAGE_FRAGMENT_BIT, 32, 16, (float[]){
-				(float)src->color.red / UINT16_MAX,
-				(float)src->color.green / UINT16_MAX,
-				(float)src->color.blue / UINT16_MAX,
-				(float)src->color.alpha / UINT16_MAX,
-			});
-		} else {
-			return -1;
-		}
-	}
-	return 0;
+/*
+Switch between drawing rects, shapes and glyphs, which use different
+pipelines. Glyphs bind their own pipeline for each call.
+*/
+static int
+set_mode(struct context *ctx, struct image *dst, int mode)
+{
+	struct draw_context *dc = dst->draw_ctx;
+
+	if (dc->mode == mode)
+		return 0;
+	draw(ctx);
+	dc->mode = mode;
+	/* instances are indexed in units of their size, which all divide SHAPE_SIZE */
+	dc->vertex_len = (dc->vertex_len + SHAPE_SIZE - 1) / SHAPE_SIZE * SHAPE_SIZE;
+	dc->vertex_pos = dc->vertex_len;
+	if (mode == DRAW_GLYPHS)
+		return 0;
+	return bind_src(ctx, dst, ctx->base.src, ctx->base.filter);
 }
 
 static int
@@ -723,9 +3175,16 @@ rect(struct blt_context *ctx_base, size_t len, const struct blt_rect *rect)
 	struct image *img = (void *)ctx->base.dst;
 	struct draw_context *dc = img->draw_ctx;
 
+	/* recording was ended by blt_flush */
+	if (!dc->recording && (begin(ctx, img) < 0 || bind_src(ctx, img, ctx->base.src, ctx->base.filter) < 0))
+		return -1;
+	if (set_mode(ctx, img, DRAW_RECTS) < 0)
+		return -1;
 	for (; len > 0; --len, ++rect) {
-		if (dc->vertex_cap - dc->vertex_len < 12)
-			flush(ctx);
+		if (dc->vertex_cap - dc->vertex_len < 12 && new_vertex_buffer(ctx, dc) < 0)
+			return -1;
+		if (dc->timing != -1)
+			++ctx->timing[dc->timing].rects;
 		dc->vertex[dc->vertex_len++] = rect->x0;
 		dc->vertex[dc->vertex_len++] = rect->y0;
 		dc->vertex[dc->vertex_len++] = rect->x1;
@@ -742,12 +3201,389 @@ rect(struct blt_context *ctx_base, size_t len, const struct blt_rect *rect)
 	return 0;
 }
 
+/* slope of the line l in x per y */
+static float
+line_dxdy(const struct blt_line *l)
+{
+	return (l->p2.x - l->p1.x) / (l->p2.y - l->p1.y);
+}
+
+/* x coordinate of the line l at y */
+static float
+line_x(const struct blt_line *l, float y)
+{
+	return l->p1.x + (y - l->p1.y) * line_dxdy(l);
+}
+
+/*
+Add a shape instance, which is the bounding box followed by two
+trapezoids stacked at a kink: the top, kink and bottom, the x of the
+left and right lines of the upper trapezoid at the top and of the lower
+one at the kink, and the slopes of those lines. The bounding box is
+extended by a pixel so that it includes all the pixels that are
+partially covered.
+*/
+static int
+add_shape(struct context *ctx, float x0, float x1, const float trap[static 12])
+{
+	struct image *img = (void *)ctx->base.dst;
+	struct draw_context *dc = img->draw_ctx;
+	float *shape;
+
+	/* recording was ended by blt_flush */
+	if (!dc->recording && begin(ctx, img) < 0)
+		return -1;
+	if (set_mode(ctx, img, DRAW_SHAPES) < 0)
+		return -1;
+	if (dc->vertex_cap - dc->vertex_len < SHAPE_SIZE && new_vertex_buffer(ctx, dc) < 0)
+		return -1;
+	shape = (float *)(dc->vertex + dc->vertex_len);
+	shape[0] = floorf(x0) - 1;
+	shape[1] = floorf(trap[0]) - 1;
+	shape[2] = ceilf(x1) + 1;
+	shape[3] = ceilf(trap[2]) + 1;
+	memcpy(shape + 4, trap, 12 * sizeof(float));
+	dc->vertex_len += SHAPE_SIZE;
+	return 0;
+}
+
+static int
+trapezoids(struct blt_context *ctx_base, size_t len, const struct blt_trapezoid *trap)
+{
+	struct context *ctx = (void *)ctx_base;
+	float lt, lb, rt, rb, dl, dr;
+
+	for (; len > 0; --len, ++trap) {
+		if (trap->top >= trap->bottom)
+			continue;
+		/* horizontal or zero-length sides bound nothing */
+		if (trap->left.p1.y == trap->left.p2.y || trap->right.p1.y == trap->right.p2.y)
+			continue;
+		lt = line_x(&trap->left, trap->top);
+		lb = line_x(&trap->left, trap->bottom);
+		rt = line_x(&trap->right, trap->top);
+		rb = line_x(&trap->right, trap->bottom);
+		dl = line_dxdy(&trap->left);
+		dr = line_dxdy(&trap->right);
+		/* the lower trapezoid is empty */
+		if (add_shape(ctx, fminf(lt, lb), fmaxf(rt, rb), (float[]){
+			trap->top, trap->bottom, trap->bottom, 0,
+			lt, rt, lb, rb,
+			dl, dr, dl, dr,
+		}) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+static int
+triangles(struct blt_context *ctx_base, size_t len, const struct blt_triangle *tri)
+{
+	struct context *ctx = (void *)ctx_base;
+	struct blt_point a, b, c, t;
+	float x, dac, dab, dbc;
+
+	for (; len > 0; --len, ++tri) {
+		/* sort the points from top to bottom */
+		a = tri->p1, b = tri->p2, c = tri->p3;
+		if (b.y < a.y)
+			t = a, a = b, b = t;
+		if (c.y < b.y)
+			t = b, b = c, c = t;
+		if (b.y < a.y)
+			t = a, a = b, b = t;
+		if (a.y == c.y)
+			continue;
+		/*
+		The long side from a to c is on one side of both
+		trapezoids, and the sides from a to b and b to c are on
+		the other. An empty trapezoid gets any finite slope.
+		*/
+		dac = (c.x - a.x) / (c.y - a.y);
+		dab = a.y < b.y ? (b.x - a.x) / (b.y - a.y) : 0;
+		dbc = b.y < c.y ? (c.x - b.x) / (c.y - b.y) : 0;
+		x = a.x + (b.y - a.y) * dac;
+		/* collinear points have no area */
+		if (x == b.x)
+			continue;
+		if (add_shape(ctx, fminf(a.x, fminf(b.x, c.x)), fmaxf(a.x, fmaxf(b.x, c.x)), x < b.x ? (float[]){
+			a.y, b.y, c.y, 0,
+			a.x, a.x, x, b.x,
+			dac, dab, dac, dbc,
+		} : (float[]){
+			a.y, b.y, c.y, 0,
+			a.x, a.x, b.x, x,
+			dab, dac, dbc, dac,
+		}) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/*
+Bind the glyph pipeline with atlas. Glyphs in an A8 atlas are the
+coverage of the source, which must be solid, and glyphs in an ARGB
+atlas are drawn as they are.
+*/
+static int
+bind_glyphs(struct context *ctx, struct image *dst, struct image *atlas)
+{
+	static const struct blt_color white = {0xffff, 0xffff, 0xffff, 0xffff};
+	struct draw_context *dc = dst->draw_ctx;
+	struct pipelines *pipelines;
+	const struct blt_color *color;
+	bool alpha = atlas->fmt->vk == VK_FORMAT_R8_UNORM || dst->fmt->vk == VK_FORMAT_R8_UNORM;
+
+	if (atlas->fmt->vk == VK_FORMAT_R8_UNORM) {
+		if (!ctx->base.src || ctx->base.src->impl != &blt_solid_image_impl) {
+			errno = ENOTSUP;
+			return -1;
+		}
+		color = &((struct blt_solid *)ctx->base.src)->color;
+	} else {
+		color = &white;
+	}
+	pipelines = get_pipelines(ctx, dst->fmt->vk);
+	if (!pipelines)
+		return -1;
+	if (wait_image(ctx, dc, atlas, VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT) < 0)
+		return -1;
+	vkCmdBindPipeline(dc->cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelines->glyph);
+	ctx->push_descriptor_set(dc->cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, ctx->copy_layout, 0, 1, (VkWriteDescriptorSet[]){
+		{
+			.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+			.dstBinding = 0,
+			.descriptorCount = 1,
+			.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+			.pImageInfo = &(VkDescriptorImageInfo){
+				.sampler = ctx->nearest_sampler,
+				.imageView = alpha ? atlas->alpha_view : atlas->src_view,
+				.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+			},
+		},
+	});
+	push_color(ctx, dst, color);
+	return 0;
+}
+
+static int
+glyphs(struct blt_context *ctx_base, struct blt_image *atlas_base, size_t len, const struct blt_glyph_rect *glyph)
+{
+	struct context *ctx = (void *)ctx_base;
+	struct image *img = (void *)ctx->base.dst, *atlas = (void *)atlas_base;
+	struct draw_context *dc = img->draw_ctx;
+	int32_t *v;
+
+	if (atlas_base->impl != &image_impl || !atlas->src_view)
+		return -1;
+	/* recording was ended by blt_flush */
+	if (!dc->recording && begin(ctx, img) < 0)
+		return -1;
+	if (set_mode(ctx, img, DRAW_GLYPHS) < 0)
+		return -1;
+	/* glyphs from an earlier call may use another atlas or color */
+	draw(ctx);
+	if (bind_glyphs(ctx, img, atlas) < 0)
+		return -1;
+	for (; len > 0; --len, ++glyph) {
+		if (dc->vertex_cap - dc->vertex_len < GLYPH_SIZE && new_vertex_buffer(ctx, dc) < 0)
+			return -1;
+		v = dc->vertex + dc->vertex_len;
+		v[0] = glyph->dst.x0;
+		v[1] = glyph->dst.y0;
+		v[2] = glyph->dst.x1;
+		v[3] = glyph->dst.y1;
+		v[4] = glyph->atlas_x;
+		v[5] = glyph->atlas_y;
+		dc->vertex_len += GLYPH_SIZE;
+	}
+	return 0;
+}
+
+static int
+set_transform(struct blt_context *ctx_base, const struct blt_transform *transform, int filter)
+{
+	struct context *ctx = (void *)ctx_base;
+	struct image *dst = (void *)ctx->base.dst;
+
+	if (!dst || !dst->draw_ctx->recording)
+		return 0;
+	/* draw with the old transform before it changes */
+	draw(ctx);
+	if (filter == ctx->base.filter)
+		return 0;
+	return bind_src(ctx, dst, ctx->base.src, filter);
+}
+
+/*
+Return the timings that have completed, oldest first. Results that
+aren't available yet are left for a later call, so this never waits
+for the GPU.
+*/
+static int
+get_gpu_timings(struct blt_context *ctx_base, struct blt_gpu_timing *timing, size_t len)
+{
+	struct context *ctx = (void *)ctx_base;
+	struct timing *t;
+	uint64_t ts[2];
+	VkResult res;
+	size_t n;
+
+	if (!ctx->query_pool) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	for (n = 0; n < len && ctx->timing_len > 0; ++n) {
+		t = &ctx->timing[ctx->timing_pos];
+		if (t->seq == 0)
+			break;
+		res = vkGetQueryPoolResults(ctx->dev, ctx->query_pool, ctx->timing_pos * 2, 2, sizeof(ts), ts, sizeof(ts[0]), VK_QUERY_RESULT_64_BIT);
+		if (res == VK_NOT_READY)
+			break;
+		if (res != VK_SUCCESS)
+			return -1;
+		timing[n] = (struct blt_gpu_timing){
+			.dst = t->dst,
+			.rects = t->rects,
+			.frame = t->frame,
+			.start = (ts[0] & ctx->timestamp_mask) * ctx->timestamp_period,
+			.end = (ts[1] & ctx->timestamp_mask) * ctx->timestamp_period,
+		};
+		ctx->timing_pos = (ctx->timing_pos + 1) % LEN(ctx->timing);
+		--ctx->timing_len;
+	}
+	return n;
+}
+
+static struct blt_context *
+new_stream(struct blt_context *ctx_base)
+{
+	struct context *ctx = owner((void *)ctx_base), *s, **stream;
+	VkResult res;
+	size_t cap;
+
+	/* a stream starts out like a new context, which records no timings */
+	s = new_context();
+	if (!s)
+		goto error0;
+	s->parent = ctx;
+	/* the device and the objects created with it, which don't change */
+	s->fd = ctx->fd;
+	s->instance = ctx->instance;
+	s->phys = ctx->phys;
+	s->dev = ctx->dev;
+	s->queue = ctx->queue;
+	s->queue_index = ctx->queue_index;
+	s->xfer_queue = ctx->xfer_queue;
+	s->xfer_index = ctx->xfer_index;
+	s->xfer_pool = ctx->xfer_pool;
+	s->xfer_timeline = ctx->xfer_timeline;
+	s->vert_shader = ctx->vert_shader;
+	s->fill_shader = ctx->fill_shader;
+	s->copy_shader = ctx->copy_shader;
+	s->box_shader = ctx->box_shader;
+	s->shape_shader = ctx->shape_shader;
+	s->shape_fill_shader = ctx->shape_fill_shader;
+	s->shape_copy_shader = ctx->shape_copy_shader;
+	s->glyph_vert_shader = ctx->glyph_vert_shader;
+	s->glyph_frag_shader = ctx->glyph_frag_shader;
+	s->copy_desc_layout = ctx->copy_desc_layout;
+	s->fill_layout = ctx->fill_layout;
+	s->copy_layout = ctx->copy_layout;
+	s->nearest_sampler = ctx->nearest_sampler;
+	s->linear_sampler = ctx->linear_sampler;
+	s->timeline = ctx->timeline;
+	s->get_memory_fd = ctx->get_memory_fd;
+	s->get_image_drm_format_modifier_properties = ctx->get_image_drm_format_modifier_properties;
+	s->get_semaphore_fd = ctx->get_semaphore_fd;
+	s->import_semaphore_fd = ctx->import_semaphore_fd;
+	s->push_descriptor_set = ctx->push_descriptor_set;
+	s->incremental_present = ctx->incremental_present;
+	s->present_wait = ctx->present_wait;
+	s->display_timing = ctx->display_timing;
+	s->wait_for_present = ctx->wait_for_present;
+	s->get_past_presentation_timing = ctx->get_past_presentation_timing;
+	/* each thread needs its own pool */
+	res = vkCreateCommandPool(ctx->dev, &(VkCommandPoolCreateInfo){
+		.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+		.queueFamilyIndex = ctx->queue_index,
+		.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
+	}, NULL, &s->cmd_pool);
+	if (res != VK_SUCCESS)
+		goto error1;
+	pthread_mutex_lock(&ctx->lock);
+	if (ctx->stream_len == ctx->stream_cap) {
+		cap = ctx->stream_cap ? ctx->stream_cap * 2 : 4;
+		stream = reallocarray(ctx->stream, cap, sizeof(ctx->stream[0]));
+		if (!stream)
+			goto error2;
+		ctx->stream = stream;
+		ctx->stream_cap = cap;
+	}
+	ctx->stream[ctx->stream_len++] = s;
+	pthread_mutex_unlock(&ctx->lock);
+	return &s->base;
+
+error2:
+	pthread_mutex_unlock(&ctx->lock);
+	vkDestroyCommandPool(ctx->dev, s->cmd_pool, NULL);
+error1:
+	free(s);
+error0:
+	return NULL;
+}
+
+/*
+Submit the rendering recorded by a stream, and wait until it completes
+so that its command buffers can be freed.
+*/
+static void
+destroy_stream(struct context *ctx)
+{
+	struct context *parent = ctx->parent;
+	uint64_t seq;
+	size_t i;
+
+	flush(&ctx->base);
+	pthread_mutex_lock(&parent->lock);
+	submit_pending(parent);
+	seq = parent->seq;
+	/* everything recorded into it has been submitted */
+	if (ctx->vertex_buffer) {
+		ctx->vertex_buffer->seq = seq;
+		ctx->vertex_buffer->next = parent->vertex_pool;
+		parent->vertex_pool = ctx->vertex_buffer;
+	}
+	for (i = 0; parent->stream[i] != ctx; ++i)
+		;
+	memmove(&parent->stream[i], &parent->stream[i + 1], (parent->stream_len - i - 1) * sizeof(parent->stream[0]));
+	--parent->stream_len;
+	pthread_mutex_unlock(&parent->lock);
+	vkWaitSemaphores(ctx->dev, &(VkSemaphoreWaitInfo){
+		.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+		.semaphoreCount = 1,
+		.pSemaphores = &ctx->timeline,
+		.pValues = &seq,
+	}, UINT64_MAX);
+	vkDestroyCommandPool(ctx->dev, ctx->cmd_pool, NULL);
+	free(ctx->cmd);
+	free(ctx->cmd_seq);
+	free(ctx->pending);
+}
+
 static const struct blt_context_impl impl = {
 	.destroy = destroy,
+	.new_stream = new_stream,
 	.new_image = new_image,
 	.new_solid = blt_new_solid_image,
 	.setup = setup,
 	.rect = rect,
+	.trapezoids = trapezoids,
+	.triangles = triangles,
+	.glyphs = glyphs,
+	.flush = flush,
+	.get_gpu_timings = get_gpu_timings,
+	.set_transform = set_transform,
 };
 
 static bool
@@ -761,35 +3597,36 @@ has_extension(VkExtensionProperties *prop, uint32_t prop_len, const char *name)
 }
 
 static int
-make_pipeline(struct context *ctx)
+make_layouts(struct context *ctx)
 {
 	VkResult res;
-	VkGraphicsPipelineCreateInfo info[2];
-	VkPipeline pipeline[2];
-	VkDescriptorSet desc[2];
 	VkPushConstantRange push[] = {
 		{
 			/*
 			layout(offset = 0) vec2 dst_origin;
 			layout(offset = 8) vec2 src_origin;
 			layout(offset = 16) vec2 dst_size;
+			layout(offset = 24) vec2 src_dx;
+			layout(offset = 32) vec2 src_dy;
 			*/
 			.stageFlags = VK_SHADER_STAGE_VERTEX_BIT,
 			.offset = 0,
-			.size = 24,
+			.size = 40,
 		},
 		{
 			/*
-			layout(offset = 16) vec4 color;
+			layout(offset = 48) vec4 color;
 			*/
 			.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT,
-			.offset = 32,
+			.offset = 48,
 			.size = 16,
 		},
 	};
 
 	res = vkCreateDescriptorSetLayout(ctx->dev, &(VkDescriptorSetLayoutCreateInfo){
 		.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+		/* descriptors are pushed, since the source and filter change between draws */
+		.flags = VK_DESCRIPTOR_SET_LAYOUT_CREATE_PUSH_DESCRIPTOR_BIT_KHR,
 		.bindingCount = 1,
 		.pBindings = (VkDescriptorSetLayoutBinding[]){
 			{
@@ -797,58 +3634,55 @@ make_pipeline(struct context *ctx)
 				.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
 				.descriptorCount = 1,
 				.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT,
-				.pImmutableSamplers = (VkSampler[]){ctx->rgb_sampler},
 			},
 		},
-	}, NULL, &ctx->copy_rgb_pipeline.desc_layout);
+	}, NULL, &ctx->copy_desc_layout);
 	if (res != VK_SUCCESS)
 		goto error0;
-	res = vkCreateDescriptorPool(ctx->dev, &(VkDescriptorPoolCreateInfo){
-		.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
-		.maxSets = 2,
-		.poolSizeCount = 1,
-		.pPoolSizes = (VkDescriptorPoolSize[]){
-			{
-				.type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
-				.descriptorCount = 2,
-			},
-		},
-	}, NULL, &ctx->desc_pool);
-	if (res != VK_SUCCESS)
-		goto error1;
-	res = vkAllocateDescriptorSets(ctx->dev, &(VkDescriptorSetAllocateInfo){
-		.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
-		.descriptorPool = ctx->desc_pool,
-		.descriptorSetCount = 1,
-		.pSetLayouts = (VkDescriptorSetLayout[]){
-			ctx->copy_rgb_pipeline.desc_layout,
-		},
-	}, desc);
-	ctx->copy_rgb_pipeline.desc = desc[0];
-	if (res != VK_SUCCESS)
-		goto error2;
 	res = vkCreatePipelineLayout(ctx->dev, &(VkPipelineLayoutCreateInfo){
 		.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
 		.pushConstantRangeCount = LEN(push),
 		.pPushConstantRanges = push,
-	}, NULL, &ctx->fill_pipeline.layout);
+	}, NULL, &ctx->fill_layout);
 	if (res != VK_SUCCESS)
-		goto error3;
+		goto error1;
 	res = vkCreatePipelineLayout(ctx->dev, &(VkPipelineLayoutCreateInfo){
 		.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
 		.setLayoutCount = 1,
-		.pSetLayouts = &ctx->copy_rgb_pipeline.desc_layout,
+		.pSetLayouts = &ctx->copy_desc_layout,
 		.pushConstantRangeCount = LEN(push),
 		.pPushConstantRanges = push,
-	}, NULL, &ctx->copy_rgb_pipeline.layout);
+	}, NULL, &ctx->copy_layout);
 	if (res != VK_SUCCESS)
-		goto error4;
+		goto error2;
+	return 0;
+
+error2:
+	vkDestroyPipelineLayout(ctx->dev, ctx->fill_layout, NULL);
+error1:
+	vkDestroyDescriptorSetLayout(ctx->dev, ctx->copy_desc_layout, NULL);
+error0:
+	return -1;
+}
+
+/*
+Create the fill and copy pipelines for rendering to p->format. All
+formats use the same shaders, since conversions between them are done
+by the image views and the push constants.
+*/
+static int
+make_pipelines(struct context *ctx, struct pipelines *p)
+{
+	VkResult res;
+	VkGraphicsPipelineCreateInfo info[6];
+	VkPipeline pipeline[6];
+
 	info[0] = (VkGraphicsPipelineCreateInfo){
 		.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO,
 		.pNext = &(VkPipelineRenderingCreateInfo){
 			.sType = VK_STRUCTURE_TYPE_PIPELINE_RENDERING_CREATE_INFO,
 			.colorAttachmentCount = 1,
-			.pColorAttachmentFormats = (VkFormat[]){VK_FORMAT_B8G8R8A8_UNORM},
+			.pColorAttachmentFormats = &p->format,
 		},
 		.stageCount = 2,
 		.pStages = (VkPipelineShaderStageCreateInfo[]){
@@ -910,49 +3744,397 @@ make_pipeline(struct context *ctx)
 				.colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT,
 			},
 		},
-		.pDynamicState = &(VkPipelineDynamicStateCreateInfo){
-			.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO,
-			.dynamicStateCount = 2,
-			.pDynamicStates = (VkDynamicState[]){
-				VK_DYNAMIC_STATE_VIEWPORT,
-				VK_DYNAMIC_STATE_SCISSOR,
-			},
+		.pDynamicState = &(VkPipelineDynamicStateCreateInfo){
+			.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO,
+			.dynamicStateCount = 2,
+			.pDynamicStates = (VkDynamicState[]){
+				VK_DYNAMIC_STATE_VIEWPORT,
+				VK_DYNAMIC_STATE_SCISSOR,
+			},
+		},
+		.layout = ctx->fill_layout,
+	};
+	info[1] = info[0];
+	info[1].pStages = (VkPipelineShaderStageCreateInfo[]){
+		{
+			.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+			.stage = VK_SHADER_STAGE_VERTEX_BIT,
+			.module = ctx->vert_shader,
+			.pName = "main",
+		},
+		{
+			.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+			.stage = VK_SHADER_STAGE_FRAGMENT_BIT,
+			.module = ctx->copy_shader,
+			.pName = "main",
+		},
+	};
+	info[1].layout = ctx->copy_layout;
+	info[2] = info[1];
+	info[2].pStages = (VkPipelineShaderStageCreateInfo[]){
+		info[1].pStages[0],
+		{
+			.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+			.stage = VK_SHADER_STAGE_FRAGMENT_BIT,
+			.module = ctx->box_shader,
+			.pName = "main",
+		},
+	};
+	/*
+	Shapes and glyphs are drawn as one instance each, and their
+	coverage is blended over the destination.
+	*/
+	info[3] = info[0];
+	info[3].pStages = (VkPipelineShaderStageCreateInfo[]){
+		{
+			.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+			.stage = VK_SHADER_STAGE_VERTEX_BIT,
+			.module = ctx->shape_shader,
+			.pName = "main",
+		},
+		{
+			.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+			.stage = VK_SHADER_STAGE_FRAGMENT_BIT,
+			.module = ctx->shape_fill_shader,
+			.pName = "main",
+		},
+	};
+	info[3].pVertexInputState = &(VkPipelineVertexInputStateCreateInfo){
+		.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO,
+		.vertexBindingDescriptionCount = 1,
+		.pVertexBindingDescriptions = &(VkVertexInputBindingDescription){
+			.binding = 0,
+			.stride = SHAPE_SIZE * 4,
+			.inputRate = VK_VERTEX_INPUT_RATE_INSTANCE,
+		},
+		.vertexAttributeDescriptionCount = 4,
+		.pVertexAttributeDescriptions = (VkVertexInputAttributeDescription[]){
+			{.binding = 0, .location = 0, .format = VK_FORMAT_R32G32B32A32_SFLOAT, .offset = 0},
+			{.binding = 0, .location = 1, .format = VK_FORMAT_R32G32B32A32_SFLOAT, .offset = 16},
+			{.binding = 0, .location = 2, .format = VK_FORMAT_R32G32B32A32_SFLOAT, .offset = 32},
+			{.binding = 0, .location = 3, .format = VK_FORMAT_R32G32B32A32_SFLOAT, .offset = 48},
+		},
+	};
+	info[3].pColorBlendState = &(VkPipelineColorBlendStateCreateInfo){
+		.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO,
+		.logicOpEnable = VK_FALSE,
+		.logicOp = VK_LOGIC_OP_COPY,
+		.attachmentCount = 1,
+		.pAttachments = &(VkPipelineColorBlendAttachmentState){
+			.blendEnable = VK_TRUE,
+			.srcColorBlendFactor = VK_BLEND_FACTOR_ONE,
+			.dstColorBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA,
+			.colorBlendOp = VK_BLEND_OP_ADD,
+			.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE,
+			.dstAlphaBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA,
+			.alphaBlendOp = VK_BLEND_OP_ADD,
+			.colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT,
 		},
-		.layout = ctx->fill_pipeline.layout,
 	};
-	info[1] = info[0];
-	info[1].pStages = (VkPipelineShaderStageCreateInfo[]){
+	info[4] = info[3];
+	info[4].pStages = (VkPipelineShaderStageCreateInfo[]){
+		info[3].pStages[0],
+		{
+			.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+			.stage = VK_SHADER_STAGE_FRAGMENT_BIT,
+			.module = ctx->shape_copy_shader,
+			.pName = "main",
+		},
+	};
+	info[4].layout = ctx->copy_layout;
+	info[5] = info[4];
+	info[5].pStages = (VkPipelineShaderStageCreateInfo[]){
 		{
 			.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
 			.stage = VK_SHADER_STAGE_VERTEX_BIT,
-			.module = ctx->vert_shader,
+			.module = ctx->glyph_vert_shader,
 			.pName = "main",
 		},
 		{
 			.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
 			.stage = VK_SHADER_STAGE_FRAGMENT_BIT,
-			.module = ctx->copy_shader,
+			.module = ctx->glyph_frag_shader,
 			.pName = "main",
 		},
 	};
-	info[1].layout = ctx->copy_rgb_pipeline.layout;
+	info[5].pVertexInputState = &(VkPipelineVertexInputStateCreateInfo){
+		.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO,
+		.vertexBindingDescriptionCount = 1,
+		.pVertexBindingDescriptions = &(VkVertexInputBindingDescription){
+			.binding = 0,
+			.stride = GLYPH_SIZE * 4,
+			.inputRate = VK_VERTEX_INPUT_RATE_INSTANCE,
+		},
+		.vertexAttributeDescriptionCount = 2,
+		.pVertexAttributeDescriptions = (VkVertexInputAttributeDescription[]){
+			{.binding = 0, .location = 0, .format = VK_FORMAT_R32G32B32A32_SINT, .offset = 0},
+			{.binding = 0, .location = 1, .format = VK_FORMAT_R32G32_SINT, .offset = 16},
+		},
+	};
 	res = vkCreateGraphicsPipelines(ctx->dev, VK_NULL_HANDLE, LEN(pipeline), info, NULL, pipeline);
+	if (res != VK_SUCCESS)
+		return -1;
+	p->fill = pipeline[0];
+	p->copy = pipeline[1];
+	p->box = pipeline[2];
+	p->shape_fill = pipeline[3];
+	p->shape_copy = pipeline[4];
+	p->glyph = pipeline[5];
+	return 0;
+}
+
+static struct context *
+new_context(void)
+{
+	struct context *ctx;
+
+	ctx = malloc(sizeof(*ctx));
+	if (!ctx)
+		return NULL;
+	ctx->base = (struct blt_context){
+		.impl = &impl,
+		.transform = {.xx = 1, .yy = 1},
+		.filter = BLT_FILTER_NEAREST,
+	};
+	ctx->phys = VK_NULL_HANDLE;
+	ctx->cmd = NULL;
+	ctx->cmd_seq = NULL;
+	ctx->cmd_len = 0;
+	ctx->seq = 0;
+	ctx->pending = NULL;
+	ctx->pending_len = 0;
+	ctx->pipelines_len = 0;
+	ctx->pending_cap = 0;
+	ctx->vertex_pool = NULL;
+	ctx->vertex_buffer = NULL;
+	ctx->vertex_used = 0;
+	ctx->destroyed = NULL;
+	ctx->parent = NULL;
+	ctx->stream = NULL;
+	ctx->stream_len = 0;
+	ctx->stream_cap = 0;
+	pthread_mutex_init(&ctx->lock, NULL);
+	ctx->spare = NULL;
+	ctx->spare_len = 0;
+	ctx->spare_cap = 0;
+	ctx->spare_wait = NULL;
+	ctx->spare_wait_len = 0;
+	ctx->spare_wait_cap = 0;
+	ctx->query_pool = VK_NULL_HANDLE;
+	ctx->timing_pos = 0;
+	ctx->timing_len = 0;
+	ctx->frame = 0;
+	ctx->incremental_present = false;
+	ctx->present_wait = false;
+	ctx->display_timing = false;
+	ctx->xfer_seq = 0;
+	ctx->transfer = NULL;
+	ctx->xfer_img = NULL;
+	ctx->xfer_img_len = 0;
+	ctx->xfer_img_cap = 0;
+	ctx->staging_pool = NULL;
+	ctx->staging = NULL;
+	ctx->staging_used = 0;
+	return ctx;
+}
+
+/*
+Create the objects that every context needs once its device and queues
+are known, whether the device was created by libblit or the application.
+*/
+static int
+init_device(struct context *ctx)
+{
+	VkResult res;
+	VkPhysicalDeviceProperties props;
+	VkQueueFamilyProperties *family;
+	uint32_t family_len, bits;
+
+	ctx->get_memory_fd = (PFN_vkGetMemoryFdKHR)vkGetDeviceProcAddr(ctx->dev, "vkGetMemoryFdKHR");
+	ctx->get_image_drm_format_modifier_properties = (PFN_vkGetImageDrmFormatModifierPropertiesEXT)vkGetDeviceProcAddr(ctx->dev, "vkGetImageDrmFormatModifierPropertiesEXT");
+	ctx->get_semaphore_fd = (PFN_vkGetSemaphoreFdKHR)vkGetDeviceProcAddr(ctx->dev, "vkGetSemaphoreFdKHR");
+	ctx->import_semaphore_fd = (PFN_vkImportSemaphoreFdKHR)vkGetDeviceProcAddr(ctx->dev, "vkImportSemaphoreFdKHR");
+	ctx->push_descriptor_set = (PFN_vkCmdPushDescriptorSetKHR)vkGetDeviceProcAddr(ctx->dev, "vkCmdPushDescriptorSetKHR");
+	if (ctx->present_wait)
+		ctx->wait_for_present = (PFN_vkWaitForPresentKHR)vkGetDeviceProcAddr(ctx->dev, "vkWaitForPresentKHR");
+	if (ctx->display_timing)
+		ctx->get_past_presentation_timing = (PFN_vkGetPastPresentationTimingGOOGLE)vkGetDeviceProcAddr(ctx->dev, "vkGetPastPresentationTimingGOOGLE");
+
+	res = vkCreateShaderModule(ctx->dev, &(VkShaderModuleCreateInfo){
+		.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
+		.codeSize = sizeof(vert_spv),
+		.pCode = vert_spv,
+	}, NULL, &ctx->vert_shader);
+	if (res != VK_SUCCESS)
+		goto error0;
+	res = vkCreateShaderModule(ctx->dev, &(VkShaderModuleCreateInfo){
+		.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
+		.codeSize = sizeof(fill_spv),
+		.pCode = fill_spv,
+	}, NULL, &ctx->fill_shader);
+	if (res != VK_SUCCESS)
+		goto error1;
+	res = vkCreateShaderModule(ctx->dev, &(VkShaderModuleCreateInfo){
+		.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
+		.codeSize = sizeof(copy_spv),
+		.pCode = copy_spv,
+	}, NULL, &ctx->copy_shader);
+	if (res != VK_SUCCESS)
+		goto error2;
+	res = vkCreateShaderModule(ctx->dev, &(VkShaderModuleCreateInfo){
+		.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
+		.codeSize = sizeof(box_spv),
+		.pCode = box_spv,
+	}, NULL, &ctx->box_shader);
+	if (res != VK_SUCCESS)
+		goto error3;
+	res = vkCreateShaderModule(ctx->dev, &(VkShaderModuleCreateInfo){
+		.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
+		.codeSize = sizeof(shape_spv),
+		.pCode = shape_spv,
+	}, NULL, &ctx->shape_shader);
+	if (res != VK_SUCCESS)
+		goto error4;
+	res = vkCreateShaderModule(ctx->dev, &(VkShaderModuleCreateInfo){
+		.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
+		.codeSize = sizeof(shape_fill_spv),
+		.pCode = shape_fill_spv,
+	}, NULL, &ctx->shape_fill_shader);
 	if (res != VK_SUCCESS)
 		goto error5;
-	ctx->fill_pipeline.vk = pipeline[0];
-	ctx->copy_rgb_pipeline.vk = pipeline[1];
+	res = vkCreateShaderModule(ctx->dev, &(VkShaderModuleCreateInfo){
+		.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
+		.codeSize = sizeof(shape_copy_spv),
+		.pCode = shape_copy_spv,
+	}, NULL, &ctx->shape_copy_shader);
+	if (res != VK_SUCCESS)
+		goto error6;
+	res = vkCreateShaderModule(ctx->dev, &(VkShaderModuleCreateInfo){
+		.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
+		.codeSize = sizeof(glyph_vert_spv),
+		.pCode = glyph_vert_spv,
+	}, NULL, &ctx->glyph_vert_shader);
+	if (res != VK_SUCCESS)
+		goto error7;
+	res = vkCreateShaderModule(ctx->dev, &(VkShaderModuleCreateInfo){
+		.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
+		.codeSize = sizeof(glyph_frag_spv),
+		.pCode = glyph_frag_spv,
+	}, NULL, &ctx->glyph_frag_shader);
+	if (res != VK_SUCCESS)
+		goto error8;
+	res = vkCreateSampler(ctx->dev, &(VkSamplerCreateInfo){
+		.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
+		.magFilter = VK_FILTER_NEAREST,
+		.minFilter = VK_FILTER_NEAREST,
+		.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_BORDER,
+		.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_BORDER,
+		.borderColor = VK_BORDER_COLOR_FLOAT_TRANSPARENT_BLACK,
+		.unnormalizedCoordinates = VK_TRUE,
+	}, NULL, &ctx->nearest_sampler);
+	if (res != VK_SUCCESS)
+		goto error9;
+	res = vkCreateSampler(ctx->dev, &(VkSamplerCreateInfo){
+		.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
+		.magFilter = VK_FILTER_LINEAR,
+		.minFilter = VK_FILTER_LINEAR,
+		.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_BORDER,
+		.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_BORDER,
+		.borderColor = VK_BORDER_COLOR_FLOAT_TRANSPARENT_BLACK,
+		.unnormalizedCoordinates = VK_TRUE,
+	}, NULL, &ctx->linear_sampler);
+	if (res != VK_SUCCESS)
+		goto error10;
+	if (make_layouts(ctx) < 0)
+		goto error11;
+	res = vkCreateCommandPool(ctx->dev, &(VkCommandPoolCreateInfo){
+		.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+		.queueFamilyIndex = ctx->queue_index,
+		.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
+	}, NULL, &ctx->cmd_pool);
+	if (res != VK_SUCCESS)
+		goto error12;
+	res = vkCreateSemaphore(ctx->dev, &(VkSemaphoreCreateInfo){
+		.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+		.pNext = &(VkSemaphoreTypeCreateInfo){
+			.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO,
+			.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE,
+			.initialValue = 0,
+		},
+	}, NULL, &ctx->timeline);
+	if (res != VK_SUCCESS)
+		goto error13;
+	res = vkCreateCommandPool(ctx->dev, &(VkCommandPoolCreateInfo){
+		.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+		.queueFamilyIndex = ctx->xfer_index,
+		.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
+	}, NULL, &ctx->xfer_pool);
+	if (res != VK_SUCCESS)
+		goto error14;
+	res = vkCreateSemaphore(ctx->dev, &(VkSemaphoreCreateInfo){
+		.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+		.pNext = &(VkSemaphoreTypeCreateInfo){
+			.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO,
+			.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE,
+			.initialValue = 0,
+		},
+	}, NULL, &ctx->xfer_timeline);
+	if (res != VK_SUCCESS)
+		goto error15;
+	/* timings are optional, so failure here isn't fatal */
+	vkGetPhysicalDeviceQueueFamilyProperties(ctx->phys, &family_len, NULL);
+	family = reallocarray(NULL, family_len, sizeof(family[0]));
+	if (family)
+		vkGetPhysicalDeviceQueueFamilyProperties(ctx->phys, &family_len, family);
+	bits = family && ctx->queue_index < family_len ? family[ctx->queue_index].timestampValidBits : 0;
+	if (bits > 0 && bits <= 64) {
+		vkGetPhysicalDeviceProperties(ctx->phys, &props);
+		ctx->timestamp_period = props.limits.timestampPeriod;
+		ctx->timestamp_mask = bits == 64 ? ~0ull : (1ull << bits) - 1;
+		res = vkCreateQueryPool(ctx->dev, &(VkQueryPoolCreateInfo){
+			.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+			.queryType = VK_QUERY_TYPE_TIMESTAMP,
+			.queryCount = LEN(ctx->timing) * 2,
+		}, NULL, &ctx->query_pool);
+		if (res != VK_SUCCESS)
+			ctx->query_pool = VK_NULL_HANDLE;
+	}
+	free(family);
+
 	return 0;
 
+error15:
+	vkDestroyCommandPool(ctx->dev, ctx->xfer_pool, NULL);
+error14:
+	vkDestroySemaphore(ctx->dev, ctx->timeline, NULL);
+error13:
+	vkDestroyCommandPool(ctx->dev, ctx->cmd_pool, NULL);
+error12:
+	vkDestroyPipelineLayout(ctx->dev, ctx->copy_layout, NULL);
+	vkDestroyPipelineLayout(ctx->dev, ctx->fill_layout, NULL);
+	vkDestroyDescriptorSetLayout(ctx->dev, ctx->copy_desc_layout, NULL);
+error11:
+	vkDestroySampler(ctx->dev, ctx->linear_sampler, NULL);
+error10:
+	vkDestroySampler(ctx->dev, ctx->nearest_sampler, NULL);
+error9:
+	vkDestroyShaderModule(ctx->dev, ctx->glyph_frag_shader, NULL);
+error8:
+	vkDestroyShaderModule(ctx->dev, ctx->glyph_vert_shader, NULL);
+error7:
+	vkDestroyShaderModule(ctx->dev, ctx->shape_copy_shader, NULL);
+error6:
+	vkDestroyShaderModule(ctx->dev, ctx->shape_fill_shader, NULL);
 error5:
-	vkDestroyPipelineLayout(ctx->dev, ctx->copy_rgb_pipeline.layout, NULL);
+	vkDestroyShaderModule(ctx->dev, ctx->shape_shader, NULL);
 error4:
-	vkDestroyPipelineLayout(ctx->dev, ctx->fill_pipeline.layout, NULL);
+	vkDestroyShaderModule(ctx->dev, ctx->box_shader, NULL);
 error3:
-	vkFreeDescriptorSets(ctx->dev, ctx->desc_pool, 1, desc);
+	vkDestroyShaderModule(ctx->dev, ctx->copy_shader, NULL);
 error2:
-	vkDestroyDescriptorPool(ctx->dev, ctx->desc_pool, NULL);
+	vkDestroyShaderModule(ctx->dev, ctx->fill_shader, NULL);
 error1:
-	vkDestroyDescriptorSetLayout(ctx->dev, ctx->copy_rgb_pipeline.desc_layout, NULL);
+	vkDestroyShaderModule(ctx->dev, ctx->vert_shader, NULL);
 error0:
 	return -1;
 }
@@ -962,7 +4144,7 @@ blt_vulkan_new(dev_t dev, int flags)
 {
 	struct context *ctx;
 	VkResult res;
-	const char *ext[4];
+	const char *ext[11];
 	VkPhysicalDevice *phys;
 	VkPhysicalDeviceDrmPropertiesEXT drm_prop = {
 		.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DRM_PROPERTIES_EXT,
@@ -971,14 +4153,21 @@ blt_vulkan_new(dev_t dev, int flags)
 		.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2,
 		.pNext = &drm_prop,
 	};
+	VkPhysicalDevicePresentWaitFeaturesKHR present_wait_features = {
+		.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_WAIT_FEATURES_KHR,
+	};
+	VkPhysicalDevicePresentIdFeaturesKHR present_id_features = {
+		.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_ID_FEATURES_KHR,
+		.pNext = &present_wait_features,
+	};
 	VkExtensionProperties *ext_prop = NULL;
 	VkQueueFamilyProperties *family;
+	VkQueueFlags queue_flags;
 	uint32_t i, j, ext_len, phys_len, ext_prop_len, family_len;
 
-	ctx = malloc(sizeof(*ctx));
+	ctx = new_context();
 	if (!ctx)
 		goto error0;
-	ctx->base = (struct blt_context){.impl = &impl};
 
 	ext_len = 0;
 	if (flags & (BLT_VULKAN_WAYLAND|BLT_VULKAN_X11))
@@ -1005,6 +4194,8 @@ blt_vulkan_new(dev_t dev, int flags)
 	ext[ext_len++] = VK_KHR_EXTERNAL_MEMORY_FD_EXTENSION_NAME;
 	ext[ext_len++] = VK_EXT_EXTERNAL_MEMORY_DMA_BUF_EXTENSION_NAME;
 	ext[ext_len++] = VK_EXT_IMAGE_DRM_FORMAT_MODIFIER_EXTENSION_NAME;
+	ext[ext_len++] = VK_KHR_EXTERNAL_SEMAPHORE_FD_EXTENSION_NAME;
+	ext[ext_len++] = VK_KHR_PUSH_DESCRIPTOR_EXTENSION_NAME;
 
 	res = vkEnumeratePhysicalDevices(ctx->instance, &phys_len, NULL);
 	if (res != VK_SUCCESS)
@@ -1041,7 +4232,7 @@ blt_vulkan_new(dev_t dev, int flags)
 			}
 		}
 		for (j = 0; j < ext_len; ++j) {
-			if (!has_extension(ext_prop, ext_prop_len, ext[i]))
+			if (!has_extension(ext_prop, ext_prop_len, ext[j]))
 				break;
 		}
 		if (j == ext_len) {
@@ -1052,6 +4243,28 @@ blt_vulkan_new(dev_t dev, int flags)
 	if (ctx->phys == VK_NULL_HANDLE)
 		goto error4;
 	printf("found\n");
+	if (flags & (BLT_VULKAN_WAYLAND|BLT_VULKAN_X11) && has_extension(ext_prop, ext_prop_len, VK_KHR_INCREMENTAL_PRESENT_EXTENSION_NAME)) {
+		ext[ext_len++] = VK_KHR_INCREMENTAL_PRESENT_EXTENSION_NAME;
+		ctx->incremental_present = true;
+	}
+	if (flags & (BLT_VULKAN_WAYLAND|BLT_VULKAN_X11) &&
+	    has_extension(ext_prop, ext_prop_len, VK_KHR_PRESENT_ID_EXTENSION_NAME) &&
+	    has_extension(ext_prop, ext_prop_len, VK_KHR_PRESENT_WAIT_EXTENSION_NAME))
+	{
+		vkGetPhysicalDeviceFeatures2(ctx->phys, &(VkPhysicalDeviceFeatures2){
+			.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2,
+			.pNext = &present_id_features,
+		});
+		if (present_id_features.presentId && present_wait_features.presentWait) {
+			ext[ext_len++] = VK_KHR_PRESENT_ID_EXTENSION_NAME;
+			ext[ext_len++] = VK_KHR_PRESENT_WAIT_EXTENSION_NAME;
+			ctx->present_wait = true;
+		}
+	}
+	if (flags & (BLT_VULKAN_WAYLAND|BLT_VULKAN_X11) && has_extension(ext_prop, ext_prop_len, VK_GOOGLE_DISPLAY_TIMING_EXTENSION_NAME)) {
+		ext[ext_len++] = VK_GOOGLE_DISPLAY_TIMING_EXTENSION_NAME;
+		ctx->display_timing = true;
+	}
 	vkGetPhysicalDeviceQueueFamilyProperties(ctx->phys, &family_len, NULL);
 	family = reallocarray(NULL, family_len, sizeof(family[0]));
 	if (!family)
@@ -1065,19 +4278,55 @@ blt_vulkan_new(dev_t dev, int flags)
 	}
 	if (i == family_len)
 		goto error5;
+	/*
+	Use a queue family dedicated to transfers for uploads and
+	readbacks if there is one, or else an async compute family,
+	so that they can overlap with rendering. It must be able to
+	copy arbitrary rectangles.
+	*/
+	ctx->xfer_index = ctx->queue_index;
+	for (i = 0; i < family_len; ++i) {
+		queue_flags = family[i].queueFlags & (VK_QUEUE_GRAPHICS_BIT|VK_QUEUE_COMPUTE_BIT|VK_QUEUE_TRANSFER_BIT);
+		if (family[i].queueCount == 0 ||
+		    family[i].minImageTransferGranularity.width != 1 ||
+		    family[i].minImageTransferGranularity.height != 1)
+		{
+			continue;
+		}
+		if (queue_flags == VK_QUEUE_TRANSFER_BIT) {
+			ctx->xfer_index = i;
+			break;
+		}
+		if (!(queue_flags & VK_QUEUE_GRAPHICS_BIT) && queue_flags & VK_QUEUE_COMPUTE_BIT && ctx->xfer_index == ctx->queue_index)
+			ctx->xfer_index = i;
+	}
 
 	res = vkCreateDevice(ctx->phys, &(VkDeviceCreateInfo){
 		.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
 		.pNext = &(VkPhysicalDeviceVulkan13Features){
 			.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_3_FEATURES,
+			.pNext = &(VkPhysicalDeviceVulkan12Features){
+				.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES,
+				.pNext = ctx->present_wait ? &present_id_features : NULL,
+				.timelineSemaphore = VK_TRUE,
+			},
+			.synchronization2 = VK_TRUE,
 			.dynamicRendering = VK_TRUE,
 		},
-		.queueCreateInfoCount = 1,
-		.pQueueCreateInfos = &(VkDeviceQueueCreateInfo){
-			.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
-			.queueFamilyIndex = ctx->queue_index,
-			.queueCount = 1,
-			.pQueuePriorities = (float[]){1},
+		.queueCreateInfoCount = ctx->xfer_index == ctx->queue_index ? 1 : 2,
+		.pQueueCreateInfos = (VkDeviceQueueCreateInfo[]){
+			{
+				.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
+				.queueFamilyIndex = ctx->queue_index,
+				.queueCount = 1,
+				.pQueuePriorities = (float[]){1},
+			},
+			{
+				.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
+				.queueFamilyIndex = ctx->xfer_index,
+				.queueCount = 1,
+				.pQueuePriorities = (float[]){1},
+			},
 		},
 		.enabledExtensionCount = ext_len,
 		.ppEnabledExtensionNames = ext,
@@ -1085,52 +4334,10 @@ blt_vulkan_new(dev_t dev, int flags)
 	if (res != VK_SUCCESS)
 		goto error5;
 
-	ctx->get_memory_fd = (PFN_vkGetMemoryFdKHR)vkGetDeviceProcAddr(ctx->dev, "vkGetMemoryFdKHR");
-	ctx->get_image_drm_format_modifier_properties = (PFN_vkGetImageDrmFormatModifierPropertiesEXT)vkGetDeviceProcAddr(ctx->dev, "vkGetImageDrmFormatModifierPropertiesEXT");
-
 	vkGetDeviceQueue(ctx->dev, ctx->queue_index, 0, &ctx->queue);
-	res = vkCreateShaderModule(ctx->dev, &(VkShaderModuleCreateInfo){
-		.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
-		.codeSize = sizeof(vert_spv),
-		.pCode = vert_spv,
-	}, NULL, &ctx->vert_shader);
-	if (res != VK_SUCCESS)
+	vkGetDeviceQueue(ctx->dev, ctx->xfer_index, 0, &ctx->xfer_queue);
+	if (init_device(ctx) < 0)
 		goto error6;
-	res = vkCreateShaderModule(ctx->dev, &(VkShaderModuleCreateInfo){
-		.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
-		.codeSize = sizeof(fill_spv),
-		.pCode = fill_spv,
-	}, NULL, &ctx->fill_shader);
-	if (res != VK_SUCCESS)
-		goto error7;
-	res = vkCreateShaderModule(ctx->dev, &(VkShaderModuleCreateInfo){
-		.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
-		.codeSize = sizeof(copy_spv),
-		.pCode = copy_spv,
-	}, NULL, &ctx->copy_shader);
-	if (res != VK_SUCCESS)
-		goto error8;
-	res = vkCreateSampler(ctx->dev, &(VkSamplerCreateInfo){
-		.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
-		.magFilter = VK_FILTER_NEAREST,
-		.minFilter = VK_FILTER_NEAREST,
-		.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_BORDER,
-		.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_BORDER,
-		.borderColor = VK_BORDER_COLOR_FLOAT_TRANSPARENT_BLACK,
-		.unnormalizedCoordinates = VK_TRUE,
-	}, NULL, &ctx->rgb_sampler);
-	if (res != VK_SUCCESS)
-		goto error9;
-	res = make_pipeline(ctx);
-	if (res != VK_SUCCESS)
-		goto error10;
-	res = vkCreateCommandPool(ctx->dev, &(VkCommandPoolCreateInfo){
-		.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
-		.queueFamilyIndex = ctx->queue_index,
-		.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
-	}, NULL, &ctx->cmd_pool);
-	if (res != VK_SUCCESS)
-		goto error11;
 
 	free(family);
 	free(ext_prop);
@@ -1138,17 +4345,6 @@ blt_vulkan_new(dev_t dev, int flags)
 
 	return &ctx->base;
 
-error11:
-	vkDestroyPipeline(ctx->dev, ctx->fill_pipeline.vk, NULL);
-	vkDestroyPipeline(ctx->dev, ctx->copy_rgb_pipeline.vk, NULL);
-error10:
-	vkDestroyPipelineLayout(ctx->dev, ctx->fill_pipeline.layout, NULL);
-error9:
-	vkDestroyShaderModule(ctx->dev, ctx->copy_shader, NULL);
-error8:
-	vkDestroyShaderModule(ctx->dev, ctx->fill_shader, NULL);
-error7:
-	vkDestroyShaderModule(ctx->dev, ctx->vert_shader, NULL);
 error6:
 	vkDestroyDevice(ctx->dev, NULL);
 error5:
@@ -1165,6 +4361,97 @@ error0:
 	return NULL;
 }
 
+struct blt_context *
+blt_vulkan_wrap(VkInstance instance, VkPhysicalDevice phys, VkDevice dev, VkQueue queue, uint32_t family)
+{
+	struct context *ctx;
+	VkQueueFamilyProperties *props;
+	uint32_t props_len;
+
+	vkGetPhysicalDeviceQueueFamilyProperties(phys, &props_len, NULL);
+	props = reallocarray(NULL, props_len, sizeof(props[0]));
+	if (!props)
+		goto error0;
+	vkGetPhysicalDeviceQueueFamilyProperties(phys, &props_len, props);
+	if (family >= props_len || !(props[family].queueFlags & VK_QUEUE_GRAPHICS_BIT)) {
+		errno = EINVAL;
+		goto error1;
+	}
+	ctx = new_context();
+	if (!ctx)
+		goto error1;
+	ctx->instance = instance;
+	ctx->phys = phys;
+	ctx->dev = dev;
+	/* transfers share the application's queue, so no ownership transfers are needed */
+	ctx->queue = queue;
+	ctx->queue_index = family;
+	ctx->xfer_queue = queue;
+	ctx->xfer_index = family;
+	if (init_device(ctx) < 0)
+		goto error2;
+	free(props);
+
+	return &ctx->base;
+
+error2:
+	free(ctx);
+error1:
+	free(props);
+error0:
+	return NULL;
+}
+
+struct blt_image *
+blt_image_from_vkimage(struct blt_context *ctx_base, VkImage vk, int width, int height, uint32_t format, VkImageUsageFlags usage, VkImageLayout layout)
+{
+	struct context *ctx = (void *)ctx_base;
+	struct image *img;
+	const struct format *fmt;
+	int flags = 0;
+
+	assert(ctx_base->impl == &impl);
+	fmt = find_format(format);
+	if (!fmt) {
+		errno = ENOTSUP;
+		return NULL;
+	}
+	if (usage & VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT)
+		flags |= BLT_IMAGE_DST;
+	if (usage & VK_IMAGE_USAGE_SAMPLED_BIT)
+		flags |= BLT_IMAGE_SRC;
+	img = malloc(sizeof(*img));
+	if (!img)
+		return NULL;
+	img->base = (struct blt_image){
+		.impl = &image_impl,
+		.width = width,
+		.height = height,
+		.format = format,
+	};
+	img->vk = vk;
+	img->memory = VK_NULL_HANDLE;
+	img->usage = usage;
+	if (init_image(ctx, img, fmt, flags) < 0) {
+		free(img);
+		return NULL;
+	}
+	img->layout = layout;
+
+	return &img->base;
+}
+
+VkImage
+blt_image_get_vkimage(struct blt_image *img_base, VkImageLayout *layout)
+{
+	struct image *img = (void *)img_base;
+
+	assert(img_base->impl == &image_impl);
+	if (layout)
+		*layout = img->layout;
+	return img->vk;
+}
+
 VkInstance
 blt_vulkan_instance(struct blt_context *ctx_base)
 {
@@ -0,0 +1,34 @@
+#version 450
+
+layout(push_constant) uniform push {
+	layout(offset = 0) vec2 dst_origin;
+	layout(offset = 8) vec2 src_origin;
+	layout(offset = 16) vec2 dst_scale;
+	/* source offsets of one destination pixel in x and y */
+	layout(offset = 24) vec2 src_dx;
+	layout(offset = 32) vec2 src_dy;
+};
+
+/* per-instance bounding box, and the two trapezoids of the shape */
+layout(location = 0) in vec4 bounds;
+layout(location = 1) in vec4 span;
+layout(location = 2) in vec4 line_x;
+layout(location = 3) in vec4 line_dxdy;
+layout(location = 0) out vec2 src_pos;
+layout(location = 1) out vec2 shape_pos;
+layout(location = 2) flat out vec4 out_span;
+layout(location = 3) flat out vec4 out_line_x;
+layout(location = 4) flat out vec4 out_line_dxdy;
+
+void main() {
+	/* cover the bounding box with two triangles, in the same order as rects */
+	vec2 corner = vec2(uint(gl_VertexIndex - 1) < 3u, uint(gl_VertexIndex - 2) < 3u);
+	vec2 pos = mix(bounds.xy, bounds.zw, corner);
+
+	gl_Position = vec4(dst_scale * (dst_origin + pos) - vec2(1, 1), 0, 1);
+	src_pos = src_origin + pos.x * src_dx + pos.y * src_dy;
+	shape_pos = pos;
+	out_span = span;
+	out_line_x = line_x;
+	out_line_dxdy = line_dxdy;
+}
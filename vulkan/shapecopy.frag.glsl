@@ -0,0 +1,27 @@
+#version 450
+
+layout(binding = 0) uniform sampler2D src;
+layout(location = 0) in noperspective vec2 src_pos;
+layout(location = 1) in noperspective vec2 shape_pos;
+/* the two trapezoids of the shape, as in shapefill.frag.glsl */
+layout(location = 2) flat in vec4 span;
+layout(location = 3) flat in vec4 line_x;
+layout(location = 4) flat in vec4 line_dxdy;
+layout(location = 0) out vec4 color;
+
+void main() {
+	vec2 p = shape_pos - 0.5;
+	vec3 y = clamp(span.xyz - p.y, 0, 1);
+	vec4 y0 = y.xxyy, y1 = y.yyzz;
+	vec4 off = p.y - span.xxyy;
+	vec4 u0 = line_x + line_dxdy * (off + y0) - p.x;
+	vec4 u1 = line_x + line_dxdy * (off + y1) - p.x;
+	vec4 lo = min(u0, u1), hi = max(u0, u1);
+	vec4 a = clamp(lo, 0, 1), b = clamp(hi, 0, 1);
+	vec4 area = (b * b - a * a) * 0.5 + max(hi - max(lo, 1), 0);
+	vec4 w = hi - lo;
+	vec4 left = mix(clamp((lo + hi) * 0.5, 0, 1), area / w, greaterThan(w, vec4(1.0 / 256)));
+	float cov = clamp(dot((y1 - y0) * left, vec4(-1, 1, -1, 1)), 0, 1);
+
+	color = textureLod(src, src_pos, 0) * cov;
+}
@@ -0,0 +1,39 @@
+#version 450
+
+layout(push_constant) uniform push {
+	layout(offset = 48) vec4 in_color;
+};
+
+layout(location = 1) in noperspective vec2 shape_pos;
+/*
+The shape is two trapezoids stacked at the kink. span is the top, kink
+and bottom, line_x the x of the left and right lines of the upper one at
+the top and of the lower one at the kink, and line_dxdy their slopes.
+*/
+layout(location = 2) flat in vec4 span;
+layout(location = 3) flat in vec4 line_x;
+layout(location = 4) flat in vec4 line_dxdy;
+layout(location = 0) out vec4 color;
+
+void main() {
+	/*
+	The area of the pixel that is left of each line is integrated
+	over the rows of the pixel in its trapezoid. The covered area is
+	the difference of those of the right and left lines.
+	*/
+	vec2 p = shape_pos - 0.5;
+	vec3 y = clamp(span.xyz - p.y, 0, 1);
+	vec4 y0 = y.xxyy, y1 = y.yyzz;
+	vec4 off = p.y - span.xxyy;
+	vec4 u0 = line_x + line_dxdy * (off + y0) - p.x;
+	vec4 u1 = line_x + line_dxdy * (off + y1) - p.x;
+	vec4 lo = min(u0, u1), hi = max(u0, u1);
+	vec4 a = clamp(lo, 0, 1), b = clamp(hi, 0, 1);
+	/* integral of clamp(u, 0, 1) from lo to hi */
+	vec4 area = (b * b - a * a) * 0.5 + max(hi - max(lo, 1), 0);
+	vec4 w = hi - lo;
+	vec4 left = mix(clamp((lo + hi) * 0.5, 0, 1), area / w, greaterThan(w, vec4(1.0 / 256)));
+	float cov = clamp(dot((y1 - y0) * left, vec4(-1, 1, -1, 1)), 0, 1);
+
+	color = in_color * cov;
+}
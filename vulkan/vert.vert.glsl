@@ -4,6 +4,9 @@ layout(push_constant) uniform push {
 	layout(offset = 0) vec2 dst_origin;
 	layout(offset = 8) vec2 src_origin;
 	layout(offset = 16) vec2 dst_scale;
+	/* source offsets of one destination pixel in x and y */
+	layout(offset = 24) vec2 src_dx;
+	layout(offset = 32) vec2 src_dy;
 };
 
 layout(location = 0) in ivec2 pos;
@@ -11,5 +14,5 @@ layout(location = 0) out vec2 src_pos;
 
 void main() {
 	gl_Position = vec4(dst_scale * (dst_origin + pos) - vec2(1, 1), 0, 1);
-	src_pos = src_origin + pos;
+	src_pos = src_origin + pos.x * src_dx + pos.y * src_dy;
 }